@@ -0,0 +1,144 @@
+#include "conn.h"
+#include "log.h"
+#include "mem_pool.h"
+#include "util.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cstdio>
+#include <cstdlib>
+#include <thread>
+#include <vector>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+using namespace net;
+
+// 用法: churn_bench [连接数] [分配轮数]
+// 连接反复建立、收发一次后关闭，分别在事件循环的内存池及malloc中分配TcpConn，
+// 比较每秒处理的连接数及事件循环线程每个连接消耗的CPU时间，并输出内存池的命中率。
+// 之后在事件循环线程中按连接的分配模式单独比较内存池与malloc每次分配释放的耗时
+
+static int64_t ThreadCpuNano()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static void Bench(bool pooled, int count, unsigned short port)
+{
+    EventBase base(0, TimerMode::MODE_WHEEL, PollerMode::MODE_EPOLL_ET);
+    net::TcpServerPtr server(new net::TcpServer(&base));
+    if (server->Bind("127.0.0.1", port))
+    {
+        printf("bind to port %d failed\n", port);
+        exit(1);
+    }
+    if (!pooled)
+        server->OnConnCreate([] { return TcpConnPtr(new net::TcpConn); });
+    std::atomic<int> closed(0);
+    server->OnConnState([&closed](const TcpConnPtr &con) {
+        if (con->GetState() == net::TcpConn::STATTE_CLOSED)
+            closed++;
+    });
+    server->OnConnRead([](const TcpConnPtr &con) { con->Send(con->GetInput()); });
+    int64_t cpuStart = 0;
+    base.SafeCall([&cpuStart] { cpuStart = ThreadCpuNano(); });
+
+    int64_t start = util::TimeMicro();
+    std::thread client([&] {
+        char buf[64];
+        struct sockaddr_in addr = {};
+        addr.sin_family = AF_INET;
+        addr.sin_port = htons(port);
+        addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        for (int i = 0; i < count; i++)
+        {
+            int fd = socket(AF_INET, SOCK_STREAM, 0);
+            // RST关闭，避免TIME_WAIT耗尽本地端口
+            struct linger l = { 1, 0 };
+            setsockopt(fd, SOL_SOCKET, SO_LINGER, &l, sizeof(l));
+            if (connect(fd, (struct sockaddr *) &addr, sizeof(addr)) || write(fd, "ping", 4) != 4 ||
+                read(fd, buf, sizeof(buf)) <= 0)
+                printf("connection %d failed\n", i);
+            close(fd);
+        }
+        while (closed < count)
+            usleep(1000);
+        base.Exit();
+    });
+    base.Loop();
+    double cpu = (ThreadCpuNano() - cpuStart) / 1000.0 / count;
+    client.join();
+    double secs = (util::TimeMicro() - start) / 1e6;
+
+    EventStats stats = base.GetStats();
+    printf("%-6s %8.0f conns/s %5.2f cpu us/conn  pool allocs %ld hits %ld (%.1f%%) in_use %ld resident %ld\n",
+        pooled ? "pool" : "malloc", count / secs, cpu, (long) stats.pool_allocs, (long) stats.pool_hits,
+        100.0 * stats.pool_hits / std::max<int64_t>(1, stats.pool_allocs), (long) stats.pool_in_use,
+        (long) stats.pool_resident);
+}
+
+// 每轮为kBatch个连接各分配TcpConn、Channel及输入输出缓冲区，再全部释放
+static void AllocBench(int rounds)
+{
+    static const int kBatch = 64;
+    static const size_t kSizes[] = { sizeof(net::TcpConn) + 32, sizeof(Channel), 512, 2048 };
+    EventBase base;
+    base.SafeCall([&] {
+        std::vector<void *> live;
+        live.reserve(kBatch * 4);
+        for (int pooled = 0; pooled < 2; pooled++)
+        {
+            MemPool *pool = pooled ? base.GetPool() : nullptr;
+            int64_t start = util::TimeMicro();
+            for (int r = 0; r < rounds; r++)
+            {
+                for (int i = 0; i < kBatch; i++)
+                {
+                    for (size_t size : kSizes)
+                        live.push_back(MemPool::Allocate(pool, size));
+                }
+                for (void *p : live)
+                    MemPool::Free(p);
+                live.clear();
+            }
+            int64_t used = util::TimeMicro() - start;
+            printf("%-6s %6.1f ns per allocate+free\n", pooled ? "pool" : "malloc",
+                used * 1000.0 / (static_cast<double>(rounds) * kBatch * 4));
+        }
+
+        // 峰值后全部释放，持续空闲的slab在之后的整理中归还系统
+        for (int i = 0; i < 10000; i++)
+        {
+            for (size_t size : kSizes)
+                live.push_back(MemPool::Allocate(base.GetPool(), size));
+        }
+        int64_t peak = base.GetStats().pool_resident;
+        for (void *p : live)
+            MemPool::Free(p);
+        live.clear();
+        base.RunAfter(2500, [&base, peak] {
+            printf("pool resident %ld bytes at peak of 10000 conns, %ld after idle\n", (long) peak,
+                (long) base.GetStats().pool_resident);
+            base.Exit();
+        });
+    });
+    base.Loop();
+}
+
+int main(int argc, char *argv[])
+{
+    // 不挂接输出端，日志不输出
+    logging::Init(logging::Severity::none, nullptr);
+    int count = argc > 1 ? atoi(argv[1]) : 20000;
+    int rounds = argc > 2 ? atoi(argv[2]) : 100000;
+    Bench(false, count, 23481);
+    Bench(true, count, 23482);
+    AllocBench(rounds);
+    return 0;
+}
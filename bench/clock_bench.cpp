@@ -0,0 +1,54 @@
+#include "event_base.h"
+#include "log.h"
+#include "util.h"
+
+#include <cstdio>
+#include <cstdlib>
+#include <ctime>
+
+using namespace net;
+
+// 用法: clock_bench [每种时钟的调用次数]
+// 比较精确时钟、粗粒度时钟与事件循环缓存时钟每次读取的开销
+
+static volatile int64_t sink;
+
+template <typename F>
+static void Bench(const char *name, int count, F &&read)
+{
+    int64_t start = util::TimeMicro();
+    int64_t sum = 0;
+    for (int i = 0; i < count; i++)
+        sum += read();
+    int64_t used = util::TimeMicro() - start;
+    sink = sum;
+    printf("%-28s %6.1f ns/call\n", name, used * 1000.0 / count);
+}
+
+int main(int argc, char *argv[])
+{
+    // 不挂接输出端，日志不输出
+    logging::Init(logging::Severity::none, nullptr);
+    int count = argc > 1 ? atoi(argv[1]) : 10000000;
+    printf("%d calls each\n", count);
+
+    Bench("util::TimeMilli", count, [] { return util::TimeMilli(); });
+    Bench("CLOCK_MONOTONIC", count, [] {
+        struct timespec ts;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+    });
+    Bench("util::CoarseMilli", count, [] { return util::CoarseMilli(); });
+    Bench("util::CoarseTimeMilli", count, [] { return util::CoarseTimeMilli(); });
+
+    EventBase base;
+    Bench("EventBase::Now (not looping)", count, [&base] { return base.Now(); });
+    // 循环运行时Now返回每轮poll后缓存的时间
+    base.SafeCall([&] {
+        Bench("EventBase::Now (in loop)", count, [&base] { return base.Now(); });
+        Bench("EventBase::PreciseNow", count, [&base] { return base.PreciseNow(); });
+        base.Exit();
+    });
+    base.Loop();
+    return 0;
+}
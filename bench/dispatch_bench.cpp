@@ -0,0 +1,115 @@
+#include "channel.h"
+#include "event_base.h"
+#include "log.h"
+#include "poller.h"
+#include "util.h"
+
+#include <cstdio>
+#include <cstdlib>
+#include <memory>
+#include <vector>
+#include <sys/socket.h>
+#include <unistd.h>
+
+using namespace net;
+
+// 用法: dispatch_bench [直接派发次数] [fd数] [事件循环轮数]
+// 比较通道通过std::function回调与通过ChannelHandler虚函数派发事件的开销：
+// 先直接调用HandleRead测量派发本身，再让一批socket保持可读，经poller测量每个事件的开销
+
+struct Counter : public ChannelHandler
+{
+    long n_ = 0;
+    void OnReadable() override { n_++; }
+    void OnWritable() override {}
+    //回调方式下连接的闭包捕获shared_ptr，与原先TcpConn挂接回调的方式相同
+    void Handle(const std::shared_ptr<Counter> &) { n_++; }
+};
+
+static void Direct(long count)
+{
+    EventBase base;
+    int sv[2];
+    socketpair(AF_UNIX, SOCK_STREAM, 0, sv);
+    Channel *ch = new Channel(&base, sv[0], 0);
+    auto c = std::make_shared<Counter>();
+    ch->OnRead([c] { c->Handle(c); });
+
+    int64_t start = util::TimeMicro();
+    for (long i = 0; i < count; i++)
+    {
+        asm volatile("" ::: "memory");
+        ch->HandleRead();
+    }
+    int64_t function = util::TimeMicro() - start;
+    ch->SetHandler(c.get());
+    start = util::TimeMicro();
+    for (long i = 0; i < count; i++)
+    {
+        asm volatile("" ::: "memory");
+        ch->HandleRead();
+    }
+    int64_t handler = util::TimeMicro() - start;
+    printf("direct   function %6.2f ns/event  handler %6.2f ns/event\n", function * 1000.0 / count,
+        handler * 1000.0 / count);
+
+    ch->SetHandler(NULL);
+    ch->OnRead([] {});
+    delete ch;
+    close(sv[1]);
+}
+
+// 水平触发下数据不读走，每轮poll返回全部fd
+static double Polled(bool useHandler, int fds, int rounds)
+{
+    EventBase base;
+    std::vector<Channel *> chs;
+    std::vector<int> peers;
+    auto c = std::make_shared<Counter>();
+    for (int i = 0; i < fds; i++)
+    {
+        int sv[2];
+        socketpair(AF_UNIX, SOCK_STREAM, 0, sv);
+        if (write(sv[1], "x", 1) != 1)
+            exit(1);
+        Channel *ch = new Channel(&base, sv[0], kReadEvent);
+        if (useHandler)
+            ch->SetHandler(c.get());
+        else
+            ch->OnRead([c] { c->Handle(c); });
+        chs.push_back(ch);
+        peers.push_back(sv[1]);
+    }
+    base.LoopOnce(0);
+    c->n_ = 0;
+    int64_t start = util::TimeMicro();
+    for (int i = 0; i < rounds; i++)
+        base.LoopOnce(0);
+    int64_t used = util::TimeMicro() - start;
+    long events = c->n_;
+    for (auto ch : chs)
+    {
+        ch->SetHandler(NULL);
+        ch->OnRead([] {});
+        delete ch;
+    }
+    for (int fd : peers)
+        close(fd);
+    return used * 1000.0 / events;
+}
+
+int main(int argc, char *argv[])
+{
+    // 不挂接输出端，日志不输出
+    logging::Init(logging::Severity::none, nullptr);
+    long count = argc > 1 ? atol(argv[1]) : 100000000;
+    int fds = argc > 2 ? atoi(argv[2]) : 1000;
+    int rounds = argc > 3 ? atoi(argv[3]) : 2000;
+
+    Direct(count);
+    double function = Polled(false, fds, rounds);
+    double handler = Polled(true, fds, rounds);
+    printf("polled   function %6.2f ns/event  handler %6.2f ns/event  (%d fds, %d rounds)\n", function, handler,
+        fds, rounds);
+    return 0;
+}
@@ -0,0 +1,97 @@
+#include "conn.h"
+#include "log.h"
+#include "util.h"
+
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+#include <thread>
+
+using namespace net;
+
+// 用法: epoll_bench [连接数] [每个连接的MB数] [在途的KB数] [客户端每次读取的KB数]
+// 回显服务器分别以水平触发、边沿触发运行，客户端在另一个线程的事件循环中保持每个连接有固定量的数据在途，
+// 比较服务器一侧注册事件的系统调用次数及吞吐。在途数据大于socket缓冲区时服务器的写会反复遇到EAGAIN
+
+struct Options
+{
+    int conns;
+    size_t total;
+    size_t window;
+    size_t read_budget;     // 客户端每次可读事件读取的字节数，较小时服务器的发送缓冲区经常写满
+};
+
+static void Bench(PollerMode mode, const char *name, const Options &opt, unsigned short port)
+{
+    EventBase server(0, TimerMode::MODE_WHEEL, mode);
+    EventBase client;
+    TcpServerPtr srv(new net::TcpServer(&server));
+    if (srv->Bind("127.0.0.1", port))
+    {
+        printf("%s: bind port %d failed\n", name, port);
+        return;
+    }
+    srv->OnConnRead([](const TcpConnPtr &con) { con->Send(con->GetInput()); });
+
+    std::string chunk(64 * 1024, 'x');
+    int done = 0;
+    std::vector<TcpConnPtr> conns;
+    auto fill = [&chunk, &opt](const TcpConnPtr &con, size_t &sent, size_t received) {
+        while (sent < opt.total && sent - received < opt.window)
+        {
+            size_t n = std::min(chunk.size(), opt.total - sent);
+            con->Send(chunk.data(), n);
+            sent += n;
+        }
+    };
+    for (int i = 0; i < opt.conns; i++)
+    {
+        TcpConnPtr con = net::TcpConn::CreateConnection(&client, "127.0.0.1", port);
+        con->SetReadBudget(opt.read_budget);
+        auto sent = std::make_shared<size_t>(0);
+        auto received = std::make_shared<size_t>(0);
+        con->OnState([&, sent, received](const TcpConnPtr &con) {
+            if (con->GetState() == net::TcpConn::STATTE_CONNECTED)
+                fill(con, *sent, *received);
+        });
+        con->OnRead([&, sent, received](const TcpConnPtr &con) {
+            *received += con->GetInput().Size();
+            con->GetInput().Clear();
+            if (*received == opt.total && ++done == opt.conns)
+            {
+                server.Exit();
+                client.Exit();
+            }
+            fill(con, *sent, *received);
+        });
+        conns.push_back(con);
+    }
+
+    int64_t start = util::TimeMicro();
+    std::thread th([&client] { client.Loop(); });
+    server.Loop();
+    th.join();
+    int64_t elapsed = util::TimeMicro() - start;
+    EventStats stats = server.GetStats();
+    double mb = static_cast<double>(opt.total) * opt.conns / (1 << 20);
+    printf("%-8s %8.1f MB/s  epoll_ctl %8lld  (%.0f per GB)\n", name, mb * 1e6 / elapsed, 
+        (long long) stats.poller_ctl, stats.poller_ctl * 1024 / mb);
+    for (auto &con : conns)
+        con->CloseNow();
+}
+
+int main(int argc, char *argv[])
+{
+    // 不挂接输出端，日志不输出
+    logging::Init(logging::Severity::none, nullptr);
+    Options opt;
+    opt.conns = argc > 1 ? atoi(argv[1]) : 64;
+    opt.total = (argc > 2 ? atol(argv[2]) : 16) << 20;
+    opt.window = (argc > 3 ? atol(argv[3]) : 4096) << 10;
+    opt.read_budget = (argc > 4 ? atol(argv[4]) : 16) << 10;
+    printf("%d conns, %zu MB each, %zu KB in flight, client reads %zu KB per event\n", opt.conns, 
+        opt.total >> 20, opt.window >> 10, opt.read_budget >> 10);
+    Bench(PollerMode::MODE_EPOLL_LT, "epoll-lt", opt, 23701);
+    Bench(PollerMode::MODE_EPOLL_ET, "epoll-et", opt, 23702);
+    return 0;
+}
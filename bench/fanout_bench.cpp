@@ -0,0 +1,173 @@
+#include "codec.h"
+#include "conn.h"
+#include "log.h"
+#include "util.h"
+
+#include <atomic>
+#include <cstdio>
+#include <cstdlib>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+using namespace net;
+
+// 用法: fanout_bench [连接数] [消息数] [消息体字节数] [事件循环数]
+// 同一消息发送给所有连接：逐连接编码复制，与编码一次后用TcpConn::Broadcast共享发送，
+// 比较每条消息从开始发送到所有事件循环处理完的耗时。客户端在子进程中接收全部数据
+
+static const unsigned short kPort = 23483;
+
+static void Client(int conns, long want)
+{
+    // 等待父进程开始监听
+    usleep(200000);
+    int ep = epoll_create1(0);
+    for (int i = 0; i < conns; i++)
+    {
+        int fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+        struct sockaddr_in addr = {};
+        addr.sin_family = AF_INET;
+        addr.sin_port = htons(kPort);
+        addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        connect(fd, (struct sockaddr *) &addr, sizeof(addr));
+        struct epoll_event ev = {};
+        ev.events = EPOLLIN;
+        ev.data.fd = fd;
+        epoll_ctl(ep, EPOLL_CTL_ADD, fd, &ev);
+    }
+    long total = 0;
+    struct epoll_event evs[256];
+    static char buf[65536];
+    while (total < want)
+    {
+        int n = epoll_wait(ep, evs, 256, 5000);
+        if (n <= 0)
+            break;
+        for (int i = 0; i < n; i++)
+        {
+            ssize_t r;
+            while ((r = read(evs[i].data.fd, buf, sizeof(buf))) > 0)
+                total += r;
+        }
+    }
+    if (total != want)
+        fprintf(stderr, "client received %ld of %ld bytes\n", total, want);
+    _exit(0);
+}
+
+int main(int argc, char *argv[])
+{
+    // 不挂接输出端，日志不输出
+    logging::Init(logging::Severity::none, nullptr);
+    int conns = argc > 1 ? atoi(argv[1]) : 10000;
+    int msgs = argc > 2 ? atoi(argv[2]) : 50;
+    size_t bodySize = argc > 3 ? atol(argv[3]) : 256;
+    int loops = argc > 4 ? atoi(argv[4]) : 4;
+
+    // 两端各需要conns个fd
+    struct rlimit rl;
+    getrlimit(RLIMIT_NOFILE, &rl);
+    if (rl.rlim_cur < static_cast<rlim_t>(conns) + 100)
+    {
+        rl.rlim_cur = std::min<rlim_t>(rl.rlim_max, conns + 100);
+        setrlimit(RLIMIT_NOFILE, &rl);
+    }
+
+    std::string body(bodySize, 'm');
+    LengthCodec codec;
+    Buffer encoded;
+    codec.Encode(body, encoded);
+    long want = static_cast<long>(conns) * msgs * 2 * encoded.Size();
+
+    pid_t pid = fork();
+    if (pid == 0)
+        Client(conns, want);
+
+    MultiBase bases(loops);
+    net::TcpServerPtr server(new net::TcpServer(&bases));
+    if (server->Bind("127.0.0.1", kPort))
+    {
+        printf("bind to port %d failed\n", kPort);
+        return 1;
+    }
+    std::mutex mutex;
+    std::vector<TcpConnPtr> clients;
+    server->OnConnState([&](const TcpConnPtr &con) {
+        if (con->GetState() == net::TcpConn::STATTE_CONNECTED)
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            clients.push_back(con);
+        }
+    });
+    server->OnConnMsg(new LengthCodec, [](const TcpConnPtr &, net::Slice) {});
+
+    std::thread sender([&] {
+        while (true)
+        {
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                if (static_cast<int>(clients.size()) == conns)
+                    break;
+            }
+            usleep(10000);
+        }
+        std::atomic<int> pending(0);
+        auto wait = [&pending] {
+            while (pending)
+                std::this_thread::yield();
+        };
+
+        // 逐连接编码，按事件循环分组后各投递一个任务，与Broadcast的投递方式相同
+        int64_t start = util::TimeMicro();
+        for (int m = 0; m < msgs; m++)
+        {
+            std::unordered_map<EventBase *, std::vector<TcpConnPtr>> groups;
+            for (auto &con : clients)
+                groups[con->GetBase()].push_back(con);
+            for (auto &g : groups)
+            {
+                pending++;
+                g.first->SafeCall([cons = std::move(g.second), &body, &pending] {
+                    for (auto &con : cons)
+                        con->SendMsg(body);
+                    pending--;
+                });
+            }
+        }
+        wait();
+        int64_t copied = util::TimeMicro() - start;
+
+        start = util::TimeMicro();
+        for (int m = 0; m < msgs; m++)
+        {
+            SharedSlice msg = codec.EncodeShared(body);
+            net::TcpConn::Broadcast(clients, msg);
+            // 各事件循环处理完之前投递的任务后才会执行该任务
+            for (int i = 0; i < loops; i++)
+            {
+                pending++;
+                bases.BaseAt(i)->SafeCall([&pending] { pending--; });
+            }
+        }
+        wait();
+        int64_t shared = util::TimeMicro() - start;
+
+        printf("%d conns, %zu byte body: per-conn encode %.1f us/msg, shared broadcast %.1f us/msg\n", conns,
+            bodySize, static_cast<double>(copied) / msgs, static_cast<double>(shared) / msgs);
+        int status;
+        waitpid(pid, &status, 0);
+        bases.Exit();
+    });
+    bases.Loop();
+    sender.join();
+    return 0;
+}
@@ -0,0 +1,64 @@
+#include "timer.h"
+#include "log.h"
+#include "util.h"
+
+#include <cstdio>
+#include <cstdlib>
+#include <random>
+#include <vector>
+
+using namespace net;
+
+// 用法: timer_bench [定时任务数] [到期时间的分布范围，毫秒]
+// 分别测量两种定时器存储引擎插入后全部取消、插入后全部到期的耗时
+
+static int64_t Elapsed(int64_t start)
+{
+    return util::TimeMicro() - start;
+}
+
+static void Bench(TimerMode mode, const char *name, int count, int64_t span)
+{
+    std::mt19937_64 rng(1);
+    std::vector<int64_t> delays(count);
+    for (auto &d : delays)
+        d = static_cast<int64_t>(rng() % span);
+    std::vector<TimerId> ids;
+    ids.reserve(count);
+
+    TimerBase *timer = CreateTimer(mode);
+    int64_t now = util::TimeMilli();
+    int64_t start = util::TimeMicro();
+    for (int i = 0; i < count; i++)
+        ids.push_back(timer->RunAt(now + delays[i], [] {}, 0));
+    int64_t insert = Elapsed(start);
+    start = util::TimeMicro();
+    for (auto &id : ids)
+        timer->Cancel(id);
+    int64_t cancel = Elapsed(start);
+
+    // 时间逐毫秒推进，每次执行一批到期的任务，与事件循环中的调用方式相同
+    int fired = 0;
+    for (int i = 0; i < count; i++)
+        timer->RunAt(now + delays[i], [&fired] { fired++; }, 0);
+    start = util::TimeMicro();
+    for (int64_t t = now; t <= now + span; t++)
+        timer->HandleTimeouts(t);
+    int64_t expire = Elapsed(start);
+    delete timer;
+
+    printf("%-6s insert %7.1f ns/op  cancel %7.1f ns/op  expire %7.1f ns/op  (fired %d)\n", name,
+        insert * 1000.0 / count, cancel * 1000.0 / count, expire * 1000.0 / count, fired);
+}
+
+int main(int argc, char *argv[])
+{
+    // 不挂接输出端，日志不输出
+    logging::Init(logging::Severity::none, nullptr);
+    int count = argc > 1 ? atoi(argv[1]) : 1000000;
+    int64_t span = argc > 2 ? atoll(argv[2]) : 100000;
+    printf("%d timers, deadlines within %lld ms\n", count, (long long) span);
+    Bench(TimerMode::MODE_MAP, "map", count, span);
+    Bench(TimerMode::MODE_WHEEL, "wheel", count, span);
+    return 0;
+}
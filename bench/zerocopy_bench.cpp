@@ -0,0 +1,125 @@
+#include "conn.h"
+#include "log.h"
+
+#include <cstdio>
+#include <cstdlib>
+#include <thread>
+#include <vector>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+using namespace net;
+
+// 用法: zerocopy_bench [发送MB数] [零拷贝阈值] [poller模式]
+// 以1MB的段经SendRef向本机连接发送，分别用复制发送及MSG_ZEROCOPY发送，
+// 比较事件循环线程每发送1GB消耗的CPU时间。客户端在另一线程中接收全部数据。
+// 本机连接的数据由内核复制给接收端，零拷贝收到COPIED通知后自动停用，远端连接才能看到收益
+
+static const unsigned short kPort = 23485;
+static const size_t kPiece = 1 << 20;
+static const size_t kMaxPending = 8 * kPiece;     // 未发送完的数据达到此值后等可写再提交
+
+static double ThreadCpu()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void Client(unsigned short port, long want)
+{
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    struct sockaddr_in addr = {};
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if (connect(fd, (struct sockaddr *) &addr, sizeof(addr)))
+    {
+        close(fd);
+        return;
+    }
+    static char buf[1 << 18];
+    long total = 0;
+    while (total < want)
+    {
+        ssize_t r = read(fd, buf, sizeof(buf));
+        if (r <= 0)
+            break;
+        total += r;
+    }
+    if (total != want)
+        fprintf(stderr, "client received %ld of %ld bytes\n", total, want);
+    close(fd);
+}
+
+//返回事件循环线程每GB消耗的CPU秒数，失败返回负数
+static double Run(PollerMode mode, unsigned short port, long pieces, size_t threshold, const std::vector<char> &data,
+    int *zeroCopyRet)
+{
+    EventBase base(0, TimerMode::MODE_WHEEL, mode);
+    net::TcpServerPtr server(new net::TcpServer(&base));
+    if (server->Bind("127.0.0.1", port))
+    {
+        printf("bind to port %d failed\n", port);
+        return -1;
+    }
+    long sent = 0;
+    long done = 0;
+    double start = 0;
+    double used = -1;
+    auto pump = [&](const TcpConnPtr &con) {
+        while (sent < pieces && con->PendingBytes() < kMaxPending)
+        {
+            sent++;
+            con->SendRef(data.data(), data.size(), [&done] { done++; });
+        }
+    };
+    server->OnConnState([&](const TcpConnPtr &con) {
+        if (con->GetState() == net::TcpConn::STATTE_CONNECTED)
+        {
+            *zeroCopyRet = threshold ? con->SetZeroCopy(threshold) : 0;
+            start = ThreadCpu();
+            con->OnWritable(pump);
+            pump(con);
+        }
+        else if (con->GetState() == net::TcpConn::STATTE_CLOSED)
+        {
+            // 客户端收完全部数据后关闭
+            if (done == pieces)
+                used = ThreadCpu() - start;
+            base.Exit();
+        }
+    });
+    std::thread client(Client, port, pieces * static_cast<long>(data.size()));
+    base.Loop();
+    client.join();
+    return used < 0 ? used : used / (pieces / 1024.0);
+}
+
+int main(int argc, char *argv[])
+{
+    // 不挂接输出端，日志不输出
+    logging::Init(logging::Severity::none, nullptr);
+    long pieces = argc > 1 ? atol(argv[1]) : 2048;
+    size_t threshold = argc > 2 ? atol(argv[2]) : 65536;
+    PollerMode mode = static_cast<PollerMode>(argc > 3 ? atoi(argv[3]) : 0);
+
+    std::vector<char> data(kPiece);
+    for (size_t i = 0; i < data.size(); i++)
+        data[i] = static_cast<char>(i * 31 + 7);
+
+    int ret = 0;
+    double copied = Run(mode, kPort, pieces, 0, data, &ret);
+    double zeroCopy = Run(mode, kPort + 1, pieces, threshold, data, &ret);
+    if (copied < 0 || zeroCopy < 0)
+    {
+        printf("transfer failed\n");
+        return 1;
+    }
+    printf("%ld MB in 1 MB pieces: copy %.3f cpu s/GB, zerocopy(threshold %zu%s) %.3f cpu s/GB\n", pieces, copied,
+        threshold, ret ? ", not supported" : "", zeroCopy);
+    return 0;
+}
@@ -520,7 +520,7 @@ template <typename T>
 template<typename It>
 size_t ExplicitProducer<T>::DequeueBulk(It& item_first, size_t max)
 {
-    auto tail = this->tail_block_.load(std::memory_order_relaxed);
+    auto tail = this->tail_index_.load(std::memory_order_relaxed);
     auto over_commit = this->dequeue_overcommit_.load(std::memory_order_relaxed);
     auto desired_count = static_cast<size_t>(
         tail - (this->dequeue_optimistic_count_.load(std::memory_order_relaxed) - over_commit));
@@ -599,7 +599,7 @@ size_t ExplicitProducer<T>::DequeueBulk(It& item_first, size_t max)
 			    			block->Block<T>::template 
 			    				SetManyEmpty<explicit_context>(first_index_in_block, 
 			    					static_cast<size_t>(end_index - first_index_in_block));
-			    			indexIndex = (indexIndex + 1) & (local_block_index->size - 1);
+			    			indexIndex = (indexIndex + 1) & (local_block_index->size_ - 1);
 
 			    			first_index_in_block = index;
 			    			end_index = (index & ~static_cast<index_t>(kBlockSize - 1)) 
@@ -615,7 +615,7 @@ size_t ExplicitProducer<T>::DequeueBulk(It& item_first, size_t max)
 			    block->Block<T>::template 
 			    	SetManyEmpty<explicit_context>(first_index_in_block, 
 			    		static_cast<size_t>(end_index - first_index_in_block));
-			    indexIndex = (indexIndex + 1) & (local_block_index->size - 1);
+			    indexIndex = (indexIndex + 1) & (local_block_index->size_ - 1);
 			} while (index != first_index + actual_count);
 					
 			return actual_count;
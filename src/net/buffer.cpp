@@ -4,12 +4,17 @@
 
 namespace net 
 {
+    Buffer::Buffer(const Buffer& buf) : buf_(nullptr)
+    {
+        CopyFrom(buf);
+    }
+
     Buffer& Buffer::operator=(const Buffer& buf)
     {
         if (&buf == this)
             return *this;
 
-        delete [] buf_;
+        MemPool::Free(buf_);
         buf_ = nullptr;
         CopyFrom(buf);
 
@@ -21,7 +26,7 @@ namespace net
 
     void Buffer::Clear()
     {
-        delete [] buf_;
+        MemPool::Free(buf_);
         buf_ = nullptr;
         capacity_ = 0;
         beg_ = end_ = 0;
@@ -87,6 +92,7 @@ namespace net
                 memcpy(this, &buf, sizeof(buf_arr));
                 memcpy(&buf, buf_arr, sizeof(buf_arr));
                 std::swap(expand_, buf.expand_);
+                std::swap(pool_, buf.pool_);
             }
             else 
             {
@@ -103,6 +109,14 @@ namespace net
         expand_ = size;
     }
 
+    void Buffer::Shrink(size_t reserve)
+    {
+        if (Empty())
+            Clear();
+        else if (Size() + reserve < capacity_)
+            Reallocate(Size() + reserve);
+    }
+
     void Buffer::MoveHead()
     {
         std::copy(Begin(), End(), buf_);
@@ -112,13 +126,17 @@ namespace net
 
     void Buffer::Expand(size_t len)
     {
-        size_t capacity = std::max(expand_, std::max(2 * capacity_, Size() + len));
-        char* ptr = new char[capacity];
+        Reallocate(std::max(expand_, std::max(2 * capacity_, Size() + len)));
+    }
+
+    void Buffer::Reallocate(size_t capacity)
+    {
+        char* ptr = static_cast<char*>(MemPool::Allocate(pool_, capacity));
         std::copy(Begin(), End(), ptr);
 
         end_ -= beg_;
         beg_ = 0;
-        delete [] buf_;
+        MemPool::Free(buf_);
         buf_ = ptr;
         capacity_ = capacity;
     }
@@ -128,7 +146,7 @@ namespace net
         memcpy(this, &buf, sizeof(buf));
         if (buf.buf_)
         {
-            buf_ = new char[capacity_];
+            buf_ = static_cast<char*>(MemPool::Allocate(pool_, capacity_));
             memcpy(Data(), buf.Begin(), buf.Size());
         }
     }
@@ -1,15 +1,18 @@
 #pragma once
 
 #include "slice.h"
+#include "mem_pool.h"
 #include <cstddef>
 
 namespace net 
 {
     class Buffer 
     {
+        friend class OutputChain;
+        friend class SharedSlice;
     public:
-        Buffer() : buf_(nullptr), beg_(0), end_(0), capacity_(0), expand_(512) {}
-        ~Buffer() { delete [] buf_; }
+        Buffer() : buf_(nullptr), beg_(0), end_(0), capacity_(0), expand_(512), pool_(nullptr) {}
+        ~Buffer() { MemPool::Free(buf_); }
 
         Buffer(const Buffer& buf);
         Buffer& operator=(const Buffer& buf);
@@ -21,6 +24,7 @@ namespace net
         char* Begin() const { return buf_ + beg_; }
         char* End() const { return buf_ + end_; }
         size_t Space() const { return capacity_ - end_; }
+        size_t Capacity() const { return capacity_; }
         void AddSize(size_t len) { end_ += len; }
 
         void Clear();
@@ -42,17 +46,23 @@ namespace net
         Buffer& Consume(size_t len);
         Buffer& Absorb(Buffer& buf);
         void SetSuggestSize(size_t size);
-        
+        //释放多余的存储，只保留数据及reserve字节的空间，没有数据时释放全部存储
+        void Shrink(size_t reserve);
+        //之后的存储从pool分配，已分配的存储仍可正常释放
+        void SetPool(MemPool *pool) { pool_ = pool; }
+
 
     private:
         void MoveHead();
         void Expand(size_t len);
+        void Reallocate(size_t capacity);
         void CopyFrom(const Buffer& buf);
     private:
         char* buf_;
         size_t beg_;
         size_t end_;
         size_t capacity_;
-        size_t expand_;    // 未知什么含义
+        size_t expand_;    // 扩容时的最小容量，见SetSuggestSize
+        MemPool *pool_;
     };
 }
\ No newline at end of file
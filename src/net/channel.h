@@ -2,19 +2,43 @@
 
 #include "noncopyable.h"
 #include "event_base.h"
+#include "mem_pool.h"
 #include <functional>
+#include <sys/types.h>
 
 namespace net 
 {
     class PollerBase;
 
+    /**
+     * @brief 通道事件处理器，由连接类直接实现，挂接后Channel通过虚函数派发事件，
+     *  不再为每个fd分配std::function闭包。处理器的生命周期由实现者保证长于通道
+     */
+    class ChannelHandler
+    {
+    public:
+        virtual ~ChannelHandler() {}
+        virtual void OnReadable() = 0;
+        virtual void OnWritable() = 0;
+        //完成模式下poller读到数据时回调，len小于等于0表示连接关闭或出错
+        virtual void OnReceived(const char *, ssize_t) {}
+        //socket出错或错误队列中有消息(如MSG_ZEROCOPY的完成通知)时回调，默认按可读处理
+        virtual void OnError() { OnReadable(); }
+    };
+
     class Channel : private util::NonCopyable
     {
         using Task = std::function<void()>;
+        using RecvTask = std::function<void(const char *, ssize_t)>;
     public:
         // base为事件管理器，fd为通道内部的fd，events为通道关心的事件
         Channel(EventBase *base, int fd, int events);
         ~Channel();
+        //在base的内存池中分配通道，其他new表达式使用malloc，均可直接delete
+        static void *operator new(size_t size, EventBase *base);
+        static void *operator new(size_t size) { return MemPool::Allocate(NULL, size); }
+        static void operator delete(void *p) { MemPool::Free(p); }
+        static void operator delete(void *p, EventBase *) { MemPool::Free(p); }
         EventBase *GetBase() { return base_; }
         int Fd() { return fd_; }
         //通道id
@@ -22,12 +46,20 @@ namespace net
         short Events() { return events_; }
         //关闭通道
         void Close();
+        //从poller注销但不关闭fd，返回fd，之后通道不再可用。用于把fd交给其他事件循环
+        int Detach();
+        //fd另有dup时关闭不会使其从epoll中注销，此时关闭通道需显式注销
+        void SetDuplicated() { duplicated_ = true; }
 
         //挂接事件处理器
         void OnRead(const Task &readcb) { read_callback_ = readcb; }
         void OnWrite(const Task &writecb) { write_callback_ = writecb; }
         void OnRead(Task &&readcb) { read_callback_ = std::move(readcb); }
         void OnWrite(Task &&writecb) { write_callback_ = std::move(writecb); }
+        //完成模式下poller读到数据时回调，len小于等于0表示连接关闭或出错
+        void OnRecv(RecvTask &&recvcb) { recv_callback_ = std::move(recvcb); }
+        //挂接处理器，优先于上面的回调，传入NULL恢复使用回调
+        void SetHandler(ChannelHandler *handler) { handler_ = handler; }
 
         //启用读写监听
         void EnableRead(bool enable);
@@ -37,8 +69,44 @@ namespace net
         bool WriteEnabled();
 
         //处理读写事件
-        void HandleRead() { read_callback_(); }
-        void HandleWrite() { write_callback_(); }
+        void HandleRead()
+        {
+            if (handler_)
+                handler_->OnReadable();
+            else
+                read_callback_();
+        }
+        void HandleWrite()
+        {
+            if (handler_)
+                handler_->OnWritable();
+            else
+                write_callback_();
+        }
+        void HandleError()
+        {
+            if (handler_)
+                handler_->OnError();
+            else
+                read_callback_();
+        }
+        void HandleRecv(const char *buf, ssize_t len)
+        {
+            if (handler_)
+                handler_->OnReceived(buf, len);
+            else
+                recv_callback_(buf, len);
+        }
+
+        //poller是否为边沿触发，见PollerBase::EdgeTriggered
+        bool EdgeTriggered();
+        //完成模式(io_uring)，见UringPoller
+        bool Completion();
+        void StartRecv();
+        bool SubmitSend(const char *buf, size_t len);
+        //完成模式下已提交给poller、尚未发送的字节数，由poller更新
+        size_t SendQueued() { return send_queued_; }
+        void SetSendQueued(size_t bytes) { send_queued_ = bytes; }
 
     protected:
         EventBase *base_;
@@ -46,8 +114,12 @@ namespace net
         int fd_;
         short events_;
         int64_t id_;
+        ChannelHandler *handler_;
+        size_t send_queued_;
+        bool duplicated_;
         Task read_callback_;
         Task write_callback_;
         Task error_callback_;
+        RecvTask recv_callback_;
     };
 }
\ No newline at end of file
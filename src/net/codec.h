@@ -2,6 +2,7 @@
 
 #include "buffer.h"
 #include "slice.h"
+#include "output_chain.h"
 
 namespace net 
 {
@@ -18,6 +19,15 @@ namespace net
         virtual void Encode(Slice msg, Buffer& buf) = 0;
         virtual CodecBase* Clone() = 0;
         virtual ~CodecBase() = default;
+
+        //编码一次，结果可发送给多个连接
+        SharedSlice EncodeShared(Slice msg, MemPool *pool = nullptr)
+        {
+            Buffer buf;
+            buf.SetPool(pool);
+            Encode(msg, buf);
+            return SharedSlice(buf);
+        }
     };
 
     // 解析 \r\n结尾的消息
@@ -68,10 +68,11 @@ namespace net
         {
             SkipSpaces();
             char* end = ptr_;
+            //行内注释须以空白与值隔开，值中的';'、'#'保留
             int wasspace = 0;
-            while (!err_ && *end && *end != ';' && *end != '#')
+            while (!err_ && *end)
             {
-                if (wasspace)
+                if (wasspace && (*end == ';' || *end == '#'))
                     break;
 
                 wasspace = isspace(*end);
@@ -137,7 +138,10 @@ namespace net
                 LineScanner ls = scanner;
                 key = ls.ConsumeTill('=');
                 if (ls.PeekChar() == '=')
+                {
                     ls.Skip(1);
+                    scanner = ls;
+                }
                 else
                 {
                     scanner = ls;
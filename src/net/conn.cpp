@@ -2,16 +2,105 @@
 #include "event_base.h"
 #include "log.h"
 #include "poller.h"
+#include "resolver.h"
 #include "slice.h"
 #include "util.h"
 #include "net.h"
 #include "thread_pool.h"
 
+#include <climits>
+#include <fcntl.h>
+#include <unordered_map>
+#include <linux/filter.h>
+#include <linux/errqueue.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+
 namespace net 
 {
     using namespace std;
-    void HandyUnregisterIdle(EventBase *base, const IdleId &idle);
-    void HandyUpdateIdle(EventBase *base, const IdleId &idle);
+#ifdef IOV_MAX
+    const int kMaxIov = IOV_MAX;
+#else
+    const int kMaxIov = 1024;
+#endif
+    // sendfile不可用或完成模式下，每次从文件读出后发送的字节数
+    const size_t kFileReadSize = 16 * 1024;
+    // 连接关闭后等待零拷贝完成通知的检查间隔及最长时间，毫秒
+    const int kZeroCopyPollMs = 10;
+    const int64_t kZeroCopyLingerMs = 30 * 1000;
+
+    //读取fd错误队列中的零拷贝完成通知
+    static void ReadZeroCopyDone(int fd, ZeroCopyTracker &tracker)
+    {
+        char control[128];
+        for (;;)
+        {
+            struct msghdr msg;
+            memset(&msg, 0, sizeof(msg));
+            msg.msg_control = control;
+            msg.msg_controllen = sizeof(control);
+            if (recvmsg(fd, &msg, MSG_ERRQUEUE) < 0)
+                break;
+            for (struct cmsghdr *cm = CMSG_FIRSTHDR(&msg); cm; cm = CMSG_NXTHDR(&msg, cm))
+            {
+                bool recverr = (cm->cmsg_level == SOL_IP && cm->cmsg_type == IP_RECVERR) ||
+                    (cm->cmsg_level == SOL_IPV6 && cm->cmsg_type == IPV6_RECVERR);
+                if (!recverr)
+                    continue;
+                struct sock_extended_err *err = reinterpret_cast<struct sock_extended_err*>(CMSG_DATA(cm));
+                if (err->ee_origin != SO_EE_ORIGIN_ZEROCOPY || err->ee_errno != 0)
+                    continue;
+                if ((err->ee_code & SO_EE_CODE_ZEROCOPY_COPIED) && tracker.Threshold())
+                {
+                    // 内核仍然复制了数据，零拷贝只多了通知的开销
+                    LOG_FMT_DEBUG_MSG("fd %d zerocopy fell back to copy, disabled", fd);
+                    tracker.SetThreshold(0);
+                }
+                tracker.Complete(err->ee_info, err->ee_data);
+            }
+        }
+    }
+
+    // 连接关闭后仍在等待完成通知的零拷贝发送，持有dup的socket直到通知到齐
+    struct ZeroCopyLinger
+    {
+        ZeroCopyLinger(int fd, int64_t deadline) : fd_(fd), deadline_(deadline) {}
+        ~ZeroCopyLinger()
+        {
+            // 超时或事件循环退出时仍未完成，复位连接让内核丢弃未发送的数据，不再引用块
+            if (tracker_.Waiting())
+            {
+                LOG_FMT_WARNING_MSG("fd %d zerocopy completions missing, reset connection", fd_);
+                struct linger l = { 1, 0 };
+                setsockopt(fd_, SOL_SOCKET, SO_LINGER, &l, sizeof(l));
+            }
+            close(fd_);
+        }
+        int fd_;
+        int64_t deadline_;
+        ZeroCopyTracker tracker_;
+    };
+
+    static void LingerZeroCopy(EventBase *base, const std::shared_ptr<ZeroCopyLinger> &linger)
+    {
+        ReadZeroCopyDone(linger->fd_, linger->tracker_);
+        if (linger->tracker_.Waiting() && base->Now() < linger->deadline_ && !base->Exited())
+            base->RunAfter(kZeroCopyPollMs, [base, linger] { LingerZeroCopy(base, linger); });
+    }
+
+    TcpConn::TcpConn()
+        : base_(NULL), channel_(NULL), state_(State::STATTE_INVLAID), destPort_(-1), connect_timeout_(0), 
+        reconnect_interval_(-1), connected_time_(0), zerocopy_fd_(-1) {}
+
+    TcpConn::~TcpConn()
+    {
+        LOG_FMT_VERBOSE_MSG("tcp destroyed %s - %s", local_.ToString().c_str(), peer_.ToString().c_str());
+        // 清理后channel_已置空，等待重连的连接只剩已关闭的通道
+        delete channel_;
+        if (zerocopy_fd_ >= 0)
+            close(zerocopy_fd_);
+    }
 
     void TcpConn::Attach(EventBase *base, int fd, Addr local, Addr peer) 
     {
@@ -19,15 +108,24 @@ namespace net
         state_ = State::STATTE_HANDSHAKING;
         local_ = local;
         peer_ = peer;
-        delete channel_;
-        channel_ = new Channel(base, fd, kWriteEvent | kReadEvent);
+        // 有channel_的连接计入事件循环的连接数，重连时沿用原有的计数
+        if (channel_)
+            delete channel_;
+        else
+            LinkLoop();
+        channel_ = new (base) Channel(base, fd, kWriteEvent | kReadEvent);
+        // 重连时为新socket重新设置
+        if (deferred_.enabled_)
+            SetNoDelay(fd);
+        input_.SetPool(base->GetPool());
+        output_.SetPool(base->GetPool());
+        chain_.SetPool(base->GetPool());
         LOG_FMT_VERBOSE_MSG("Tcp constructed %s - %s fd: %d\n", local.ToString().c_str(), 
             peer_.ToString().c_str(), fd);
 
 
-        TcpConnPtr conn = shared_from_this();
-        conn->channel_->OnRead([=] { conn->HandleRead(conn); });
-        conn->channel_->OnWrite([=] { conn->HandleWrite(conn); });
+        self_ = shared_from_this();
+        channel_->SetHandler(this);
     }
 
 
@@ -37,18 +135,61 @@ namespace net
         destHost_ = host;
         destPort_ = port;
         connect_timeout_ = timeout;
-        connected_time_ = util::TimeMilli();
+        connected_time_ = base->Now();
         localIp_ = localip;
-        Addr addr(host, port);
+        base_ = base;
+        state_ = State::STATTE_HANDSHAKING;
+        // 解析期间发送的数据暂存在chain_中，连接建立后发送
+        input_.SetPool(base->GetPool());
+        output_.SetPool(base->GetPool());
+        chain_.SetPool(base->GetPool());
+        resolve_.pending_ = true;
+        TcpConnPtr conn = shared_from_this();
+        if (timeout) 
+        {
+            timeout_id_ = base->RunAfter(timeout, [conn] {
+                if (conn->GetState() != STATTE_HANDSHAKING)
+                    return;
+                if (conn->channel_)
+                    conn->channel_->Close();
+                else if (conn->resolve_.pending_)
+                    conn->CancelResolve();
+            });
+        }
+        // 域名在解析线程中查询，不阻塞事件循环。数字地址及命中缓存时直接连接
+        Resolver::Default().Resolve(base, host, [conn, port](const std::vector<struct in_addr> &addrs) {
+            if (!conn->resolve_.pending_)
+                return;
+            conn->resolve_.pending_ = false;
+            // 解析失败时连接INADDR_NONE，与同步解析时相同，由握手失败清理连接
+            Addr addr(port);
+            addr.GetAddr().sin_addr.s_addr = addrs.empty() ? INADDR_NONE : addrs[0].s_addr;
+            conn->ConnectTo(addr);
+        });
+    }
 
+    void TcpConn::CancelResolve()
+    {
+        resolve_.pending_ = false;
+        state_ = State::STATTE_FAILED;
+        LOG_FMT_VERBOSE_MSG("tcp connect to %s:%d canceled while resolving", destHost_.c_str(), destPort_);
+        GetBase()->Cancel(timeout_id_);
+        chain_.Clear();
+        if (state_callback_)
+            state_callback_(shared_from_this());
+        read_callback_ = write_callback_ = state_callback_ = nullptr;
+    }
+
+    void TcpConn::ConnectTo(Addr addr)
+    {
         int fd = socket(AF_INET, SOCK_STREAM, 0);
         SetNonBlock(fd);
         int t = util::AddFdFlag(fd, FD_CLOEXEC);
         
         int ret = 0;
-        if (localip.size()) 
+        if (localIp_.size()) 
         {
-            Addr addr(localip, 0);
+            Addr addr(localIp_, 0);
             ret = ::bind(fd, (struct sockaddr *) &addr.GetAddr(), sizeof(struct sockaddr));
             LOG_FMT_ERROR_MSG("bind to %s failed LOG_FMT_ERROR_MSG %d %s", addr.ToString().c_str(), 
                 errno, strerror(errno));
@@ -72,27 +213,133 @@ namespace net
             }
         }
         state_ = State::STATTE_HANDSHAKING;
-        Attach(base, fd, Addr(local), addr);
-        if (timeout) 
+        Attach(base_, fd, Addr(local), addr);
+    }
+
+    void TcpConn::Close() 
+    {
+        if (channel_) 
         {
+            // 推迟到当前回调返回之后关闭，在事件循环线程中调用时不需要经过任务队列唤醒
             TcpConnPtr conn = shared_from_this();
-            timeout_id_ = base->RunAfter(timeout, [conn] {
-                if (conn->GetState() == STATTE_HANDSHAKING) 
+            EventBase *base = GetBase();
+            base->QueueInLoop([conn, base] {
+                // 期间已迁移的连接交给其所属的事件循环关闭
+                if (conn->GetBase() != base)
+                    conn->GetBase()->SafeCall([conn] { conn->Close(); });
+                else if (conn->channel_)
+                {
+                    // 延迟的数据在关闭前发出，之后未发送的数据随清理丢弃
+                    if (conn->deferred_.dirty_)
+                        conn->FlushDeferred();
                     conn->channel_->Close();
+                }
+            });
+        }
+        else if (resolve_.pending_)
+        {
+            // 正在解析的连接不再连接
+            TcpConnPtr conn = shared_from_this();
+            GetBase()->QueueInLoop([conn] {
+                if (conn->resolve_.pending_)
+                    conn->CancelResolve();
             });
         }
     }
 
-    void TcpConn::Close() 
+    bool TcpConn::MigrateTo(EventBase *target)
     {
-        if (channel_) 
+        if (!channel_ || state_ != State::STATTE_CONNECTED || target == GetBase() || channel_->Completion() 
+            || Completion(target) || zerocopy_.Waiting())
+            return false;
+        // 推迟到当前回调返回之后，此前加入的关闭、继续读等任务先在原事件循环执行
+        TcpConnPtr con = shared_from_this();
+        EventBase *base = GetBase();
+        base->QueueInLoop([con, base, target] {
+            // 本轮中先执行的迁移已把连接交出时不能再访问
+            if (con->GetBase() == base)
+                con->MigrateOut(target);
+        });
+        return true;
+    }
+
+    struct TcpConn::Handoff
+    {
+        Handoff(const TcpConnPtr &con, int fd) : con_(con), fd_(fd) {}
+        ~Handoff()
         {
-            TcpConnPtr conn = shared_from_this();
-            GetBase()->SafeCall([conn] {
-                if (conn->channel_)
-                    conn->channel_->Close();
+            if (fd_ < 0)
+                return;
+            LOG_FMT_WARNING_MSG("loop exited while migrating fd %d, connection closed", fd_);
+            close(fd_);
+            con_->state_ = State::STATTE_CLOSED;
+            con_->self_.reset();
+        }
+        TcpConnPtr con_;
+        int fd_;
+    };
+
+    void TcpConn::MigrateOut(EventBase *target)
+    {
+        // 期间连接可能已关闭或又有零拷贝发送，完成通知只能从原事件循环读取
+        if (!channel_ || state_ != State::STATTE_CONNECTED || zerocopy_.Waiting() || target->Exited())
+            return;
+        LOG_FMT_DEBUG_MSG("migrating channel %lld fd %d", (long long) channel_->Id(), channel_->Fd());
+        GetBase()->Cancel(sizer_.shrink_id_);
+        bool shrink = sizer_.shrink_pending_;
+        sizer_.shrink_pending_ = false;
+        int idle = idle_node_.Linked() ? idle_node_.idle_ : 0;
+        idle_node_.Unlink();
+        // 原事件循环的待发送列表不再处理本连接，先发送延迟的数据，写不完的部分随可写事件迁移
+        if (deferred_.dirty_)
+            FlushDeferred();
+        ReportOutput(-static_cast<int64_t>(watermark_.reported_), watermark_.above_ ? -1 : 0);
+        UnlinkLoop();
+        short events = channel_->Events();
+        int fd = channel_->Detach();
+        delete channel_;
+        channel_ = NULL;
+
+        // 交接途中先计入target的连接数，挂接时抵消。缓冲区中已有的内存块可在任意线程归还，之后从target的内存池分配
+        target->AddConnections(1);
+        base_.store(target, std::memory_order_release);
+        input_.SetPool(target->GetPool());
+        output_.SetPool(target->GetPool());
+        chain_.SetPool(target->GetPool());
+        auto handoff = std::make_shared<Handoff>(self_, fd);
+        target->SafeCall([handoff, events, idle, shrink] {
+            int fd = handoff->fd_;
+            handoff->fd_ = -1;
+            handoff->con_->MigrateIn(fd, events, idle, shrink);
+        });
+    }
+
+    void TcpConn::MigrateIn(int fd, short events, int idle, bool shrink)
+    {
+        GetBase()->AddConnections(-1);
+        LinkLoop();
+        // 注册时poller报告fd当前的可读写状态，迁移期间到达的数据及未写完的数据随之继续处理
+        EventBase *base = GetBase();
+        channel_ = new (base) Channel(base, fd, events);
+        channel_->SetHandler(this);
+        if (zerocopy_fd_ >= 0)
+            channel_->SetDuplicated();
+        read_limit_.resumed_ = false;
+        ReportOutput(static_cast<int64_t>(watermark_.reported_), watermark_.above_ ? 1 : 0, false);
+        if (idle)
+            RegisterIdle(idle);
+        if (shrink)
+            ShrinkInputLater(InputSizer::kIdleMs);
+        // 已读入未处理的数据不会再有可读事件，同ResumeRead
+        if (input_.Size() && read_callback_ && !ReadPaused())
+        {
+            TcpConnPtr con = self_;
+            GetBase()->QueueInLoop([con] {
+                if (!con->ReadPaused() && con->input_.Size() && con->read_callback_)
+                    con->read_callback_(con);
             });
         }
+        LOG_FMT_DEBUG_MSG("migrated channel %lld fd %d", (long long) channel_->Id(), fd);
     }
 
     void TcpConn::Cleanup(const TcpConnPtr &conn) 
@@ -108,54 +355,85 @@ namespace net
         LOG_FMT_VERBOSE_MSG("tcp closing %s - %s fd %d %d", local_.ToString().c_str(), 
             peer_.ToString().c_str(), channel_ ? channel_->Fd() : -1, errno);
         GetBase()->Cancel(timeout_id_);
+        GetBase()->Cancel(sizer_.shrink_id_);
         if (state_callback_) {
             state_callback_(conn);
         }
+        // 重连使用新的socket，零拷贝状态不沿用
+        FinishZeroCopy();
         if (reconnect_interval_ >= 0 && !GetBase()->Exited()) 
         {  
             Reconnect();
             return;
         }
-        for (auto &idle : idle_ids_) 
-        {
-            HandyUnregisterIdle(GetBase(), idle);
-        }
+        idle_node_.Unlink();
 
+        // 未发送的数据丢弃，用户内存在此回调
+        chain_.Clear();
+        // 撤销计入事件循环统计的部分，不再回调
+        ReportOutput(-static_cast<int64_t>(watermark_.reported_), watermark_.above_ ? -1 : 0);
+        watermark_.reported_ = 0;
+        watermark_.above_ = false;
         // channel may have hold TcpConnPtr, set channel_ to NULL before delete
         read_callback_ = write_callback_ = state_callback_ = nullptr;
         Channel *ch = channel_;
         channel_ = NULL;
+        if (ch)
+            UnlinkLoop();
         delete ch;
+        ReleaseSelf();
     }
 
 
     void TcpConn::HandleRead(const TcpConnPtr &con) 
     {
-        if (state_ == State::STATTE_HANDSHAKING && HandleHandshake(con)) {
-            return;
+        if (state_ == State::STATTE_HANDSHAKING)
+        {
+            if (HandleHandshake(con))
+                return;
+            // 握手完成时已关闭可写关注，解析及握手期间写入的数据在此发送
+            if (state_ == State::STATTE_CONNECTED && Pending())
+                HandleWrite(con);
         }
+        size_t readed = 0;
         while (state_ == State::STATTE_CONNECTED) 
         {
-            input_.MakeRoom();
-            int rd = 0;
+            // 读预算用完或input_已满时先交给读回调，剩余数据之后再读。通道关闭后直接走下面的清理
+            if (channel_->Fd() >= 0 && (readed >= read_limit_.budget_ || input_.Size() >= read_limit_.max_input_))
+            {
+                ReadDone(con);
+                ReadLimited(con);
+                break;
+            }
+            // 有未处理完的数据时后续数据接在其后，按最近的读取量预留空间直接读入input_。
+            // input_为空时不预先分配，数据先读入事件循环的共享缓冲区再复制，空闲连接不占用input_的存储
+            if (!input_.Empty() && input_.Space() < sizer_.hint_)
+                input_.MakeRoom(sizer_.hint_);
+            // 一次最多读到预算及input_上限为止
+            size_t want = std::min(read_limit_.budget_ - readed, read_limit_.max_input_ - input_.Size());
+            struct iovec iov[2];
+            iov[0].iov_base = input_.End();
+            iov[0].iov_len = std::min(input_.Space(), want);
+            iov[1].iov_base = GetBase()->ReadBuffer();
+            iov[1].iov_len = std::min(EventBase::kReadBufferSize, want - iov[0].iov_len);
+            int cnt = iov[1].iov_len ? 2 : 1;
+            ssize_t rd = 0;
+            int err = 0;
             if (channel_->Fd() >= 0) 
             {
-                rd = ReadImp(channel_->Fd(), input_.End(), input_.Space());
-                LOG_FMT_VERBOSE_MSG("channel %lld fd %d readed %d bytes", 
-                    (long long)channel_->Id(), channel_->Fd(), rd);
+                rd = ReadvImp(channel_->Fd(), iov, cnt);
+                // 输出日志可能改写errno，先保存
+                err = errno;
+                LOG_FMT_VERBOSE_MSG("channel %lld fd %d readed %ld bytes", 
+                    (long long)channel_->Id(), channel_->Fd(), (long) rd);
             }
-            if (rd == -1 && errno == EINTR) 
+            if (rd == -1 && err == EINTR) 
             {
                 continue;
             } 
-            else if (rd == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) 
+            else if (rd == -1 && (err == EAGAIN || err == EWOULDBLOCK)) 
             {
-                for (auto &idle : idle_ids_) 
-                    HandyUpdateIdle(GetBase(), idle);
-                
-                if (read_callback_ && input_.Size()) 
-                    read_callback_(con);
-                
+                ReadDone(con);
                 break;
             }
             else if (channel_->Fd() == -1 || rd == 0 || rd == -1) 
@@ -164,10 +442,134 @@ namespace net
                 break;
             } 
             else 
-                input_.AddSize(rd);
+            {
+                size_t room = iov[0].iov_len;
+                if (static_cast<size_t>(rd) <= room)
+                {
+                    input_.AddSize(rd);
+                }
+                else
+                {
+                    input_.AddSize(room);
+                    input_.Append(static_cast<const char *>(iov[1].iov_base), rd - room);
+                }
+                readed += rd;
+                sizer_.Record(rd, GetBase()->Now());
+                input_.SetSuggestSize(sizer_.hint_);
+                // 水平触发时读不满说明内核中暂时没有数据，省去一次返回EAGAIN的读。
+                // 边沿触发时数据与FIN可能在同一边沿到达，需读到EAGAIN或0才能发现关闭
+                if (static_cast<size_t>(rd) < room + iov[1].iov_len && !channel_->EdgeTriggered())
+                {
+                    ReadDone(con);
+                    break;
+                }
+            }
         }
     }
 
+    void TcpConn::InputSizer::Record(size_t bytes, int64_t now)
+    {
+        last_read_ = now;
+        if (bytes >= hint_)
+        {
+            hint_ = hint_ * 2 < kMaxHint ? hint_ * 2 : kMaxHint;
+            smalls_ = 0;
+        }
+        else if (bytes < hint_ / 2 && ++smalls_ >= 2)
+        {
+            hint_ = hint_ / 2 > kMinHint ? hint_ / 2 : kMinHint;
+            smalls_ = 0;
+        }
+        else if (bytes >= hint_ / 2)
+        {
+            smalls_ = 0;
+        }
+    }
+
+    void TcpConn::ReadDone(const TcpConnPtr &con)
+    {
+        if (idle_node_.Linked())
+            idle_node_.Touch(GetBase()->Now() / 1000);
+        if (read_callback_ && input_.Size()) 
+            read_callback_(con);
+        // 读回调消费完数据时input_已释放。剩余不完整的消息时只保留按最近读取量预留的空间，
+        // 以便后续数据直接读入，一段时间没有新数据后再全部释放
+        if (input_.Capacity() > 2 * (input_.Size() + sizer_.hint_))
+            input_.Shrink(sizer_.hint_);
+        if (channel_ && input_.Capacity() > input_.Size() && !sizer_.shrink_pending_)
+            ShrinkInputLater(InputSizer::kIdleMs);
+    }
+
+    void TcpConn::ShrinkInputLater(int64_t delay)
+    {
+        TcpConnPtr con = shared_from_this();
+        sizer_.shrink_pending_ = true;
+        sizer_.shrink_id_ = GetBase()->RunAfter(delay, [con] {
+            InputSizer &sizer = con->sizer_;
+            sizer.shrink_pending_ = false;
+            if (!con->channel_ || con->input_.Capacity() == con->input_.Size())
+                return;
+            int64_t idle = con->GetBase()->Now() - sizer.last_read_;
+            if (idle < InputSizer::kIdleMs)
+            {
+                con->ShrinkInputLater(InputSizer::kIdleMs - idle);
+                return;
+            }
+            sizer.hint_ = InputSizer::kMinHint;
+            con->input_.SetSuggestSize(sizer.hint_);
+            con->input_.Shrink(0);
+        });
+    }
+
+    void TcpConn::ReadLimited(const TcpConnPtr &con)
+    {
+        // 读回调中连接可能已关闭
+        if (!channel_ || state_ != State::STATTE_CONNECTED)
+            return;
+        if (input_.Size() >= read_limit_.max_input_)
+        {
+            LOG_FMT_DEBUG_MSG("channel %lld fd %d input %lu exceeds %lu", (long long) channel_->Id(), 
+                channel_->Fd(), input_.Size(), read_limit_.max_input_);
+            if (read_limit_.overflow_callback_)
+                read_limit_.overflow_callback_(con);
+            return;
+        }
+        // 水平触发时下一轮仍会报告可读，边沿触发时内核不会再通知，在下一轮事件循环中继续读
+        // 期间再次报告的可读事件也会用完预算，只保留一个待执行的读任务
+        if (channel_->EdgeTriggered() && channel_->ReadEnabled() && !read_limit_.resumed_)
+        {
+            read_limit_.resumed_ = true;
+            EventBase *base = GetBase();
+            base->QueueInLoop([con, base] {
+                // 期间已迁移的连接由迁移后的注册重新报告可读
+                if (con->GetBase() != base)
+                    return;
+                con->read_limit_.resumed_ = false;
+                if (con->channel_ && con->channel_->ReadEnabled())
+                    con->HandleRead(con);
+            });
+        }
+    }
+
+
+    void TcpConn::HandleRecv(const TcpConnPtr &con, const char *buf, ssize_t len)
+    {
+        if (len <= 0)
+        {
+            LOG_FMT_VERBOSE_MSG("channel %lld fd %d recv return %ld", (long long) channel_->Id(), 
+                channel_->Fd(), (long) len);
+            Cleanup(con);
+            return;
+        }
+        sizer_.Record(len, GetBase()->Now());
+        input_.SetSuggestSize(sizer_.hint_);
+        input_.Append(buf, len);
+        ReadDone(con);
+        // 完成模式下每次回调一个接收完成的数据，不需要读预算
+        if (channel_ && input_.Size() >= read_limit_.max_input_)
+            ReadLimited(con);
+    }
+
 
     int TcpConn::HandleHandshake(const TcpConnPtr &con) 
     {
@@ -177,10 +579,12 @@ namespace net
         int r = poll(&pfd, 1, 0);
         if (r == 1 && pfd.revents == POLLOUT) {
             channel_->EnableReadWrite(true, false);
+            // 完成模式下之后的数据由poller接收，通过HandleRecv回调
+            channel_->StartRecv();
             state_ = State::STATTE_CONNECTED;
             if (state_ == State::STATTE_CONNECTED) 
             {
-                connected_time_ = util::TimeMilli();
+                connected_time_ = GetBase()->Now();
                 LOG_FMT_VERBOSE_MSG("tcp connected %s - %s fd %d", 
                     local_.ToString().c_str(), peer_.ToString().c_str(), channel_->Fd());
                 if (state_callback_) 
@@ -202,17 +606,19 @@ namespace net
     {
         if (state_ == State::STATTE_HANDSHAKING) 
         {
-            HandleHandshake(conn);
+            // 握手期间写入的数据不会再有可写事件通知(边沿触发), 握手完成后直接发送
+            if (HandleHandshake(conn) || !Pending())
+                return;
         } 
-        else if (state_ == State::STATTE_CONNECTED) 
+        if (state_ == State::STATTE_CONNECTED) 
         {
-            ssize_t sended = Isend(output_.Begin(), output_.Size());
-            output_.Consume(sended);
-            if (output_.Empty() && write_callback_) 
+            chain_.Append(output_);
+            FlushChain();
+            if (!PendingBytes() && write_callback_) 
             {
                 write_callback_(conn);
             }
-            if (output_.Empty() && channel_->WriteEnabled()) 
+            if (!PendingBytes() && channel_ && channel_->WriteEnabled()) 
             {  // writablecb_ may write something
                 channel_->EnableWrite(false);
             }
@@ -226,10 +632,19 @@ namespace net
 
     ssize_t TcpConn::Isend(const char *buf, size_t len) 
     {
+        // 完成模式下数据复制到poller的发送队列，总是全部发送
+        if (channel_->Completion())
+        {
+            bool ok = channel_->SubmitSend(buf, len);
+            CheckWatermark();
+            return ok ? len : 0;
+        }
+
         size_t sended = 0;
         while (len > sended) 
         {
             ssize_t wd = WriteImp(channel_->Fd(), buf + sended, len - sended);
+            int err = errno;
             LOG_FMT_VERBOSE_MSG("channel %lld fd %d write %ld bytes", (long long) channel_->Id(), 
                 channel_->Fd(), wd);
             if (wd > 0) 
@@ -237,11 +652,11 @@ namespace net
                 sended += wd;
                 continue;
             } 
-            else if (wd == -1 && errno == EINTR) 
+            else if (wd == -1 && err == EINTR) 
             {
                 continue;
             } 
-            else if (wd == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) 
+            else if (wd == -1 && (err == EAGAIN || err == EWOULDBLOCK)) 
             {
                 if (!channel_->WriteEnabled()) 
                     channel_->EnableWrite(true);
@@ -251,33 +666,264 @@ namespace net
             else 
             {
                 LOG_FMT_ERROR_MSG("write error: channel %lld fd %d wd %ld %d %s", (long long) channel_->Id(), 
-                    channel_->Fd(), wd, errno, strerror(errno));
+                    channel_->Fd(), wd, err, strerror(err));
                 break;
             }
         }
         return sended;
     }
 
+    void TcpConn::FlushChain()
+    {
+        struct iovec iov[kMaxIov];
+        while (chain_.Size())
+        {
+            int n = chain_.Fill(iov, kMaxIov);
+            if (n == 0)
+            {
+                if (FlushFile())
+                    continue;
+                break;
+            }
+            // 完成模式下数据复制到poller的发送队列，总是全部发送
+            if (channel_->Completion())
+            {
+                for (int i = 0; i < n; i++)
+                    channel_->SubmitSend(static_cast<const char*>(iov[i].iov_base), iov[i].iov_len);
+                size_t len = 0;
+                for (int i = 0; i < n; i++)
+                    len += iov[i].iov_len;
+                chain_.Consume(len);
+                continue;
+            }
+
+            size_t threshold = zerocopy_.Threshold();
+            if (threshold)
+            {
+                if (iov[0].iov_len >= threshold)
+                {
+                    if (FlushZeroCopy(iov[0]))
+                        continue;
+                    break;
+                }
+                // 大段之前的小段照常复制发送
+                for (int i = 1; i < n; i++)
+                {
+                    if (iov[i].iov_len >= threshold)
+                    {
+                        n = i;
+                        break;
+                    }
+                }
+            }
+
+            ssize_t wd = WritevImp(channel_->Fd(), iov, n);
+            int err = errno;
+            LOG_FMT_VERBOSE_MSG("channel %lld fd %d writev %d pieces %ld bytes", (long long) channel_->Id(), 
+                channel_->Fd(), n, wd);
+            if (wd > 0) 
+            {
+                chain_.Consume(wd);
+            } 
+            else if (wd == -1 && err == EINTR) 
+            {
+                continue;
+            } 
+            else if (wd == -1 && (err == EAGAIN || err == EWOULDBLOCK)) 
+            {
+                break;
+            } 
+            else 
+            {
+                LOG_FMT_ERROR_MSG("writev error: channel %lld fd %d wd %ld %d %s", (long long) channel_->Id(), 
+                    channel_->Fd(), wd, err, strerror(err));
+                break;
+            }
+        }
+        if (chain_.Size() && !channel_->WriteEnabled()) 
+            channel_->EnableWrite(true);
+        CheckWatermark();
+    }
+
+    bool TcpConn::FlushFile()
+    {
+        int fd;
+        off_t offset;
+        size_t len;
+        chain_.FrontFile(&fd, &offset, &len);
+        char buf[kFileReadSize];
+        // 完成模式下没有可写通知，读出后提交到poller的发送队列。每次只提交一段，
+        // 队列中仍有一段以上未发出时停止，poller发送完成时回调HandleWrite再读下一段，文件不会整个读入内存
+        if (channel_->Completion())
+        {
+            if (channel_->SendQueued() >= kFileReadSize)
+                return false;
+            ssize_t rd = pread(fd, buf, std::min(len, sizeof(buf)), offset);
+            if (rd > 0)
+            {
+                channel_->SubmitSend(buf, rd);
+                chain_.Consume(rd);
+                return true;
+            }
+        }
+
+        ssize_t wd = channel_->Completion() ? 0 : SendFileImp(channel_->Fd(), fd, &offset, len);
+        if (wd == -1 && (errno == EINVAL || errno == ENOSYS))
+        {
+            // 文件或连接不支持sendfile，读出后发送
+            ssize_t rd = pread(fd, buf, std::min(len, sizeof(buf)), offset);
+            wd = rd > 0 ? WriteImp(channel_->Fd(), buf, rd) : rd;
+        }
+        int err = errno;
+        LOG_FMT_VERBOSE_MSG("channel %lld fd %d sendfile %d %ld bytes", (long long) channel_->Id(), 
+            channel_->Fd(), fd, wd);
+        if (wd > 0) 
+        {
+            chain_.Consume(wd);
+            return true;
+        } 
+        else if (wd == -1 && err == EINTR) 
+        {
+            return true;
+        } 
+        else if (wd == -1 && (err == EAGAIN || err == EWOULDBLOCK)) 
+        {
+            return false;
+        }
+        else if (wd == 0 || (wd == -1 && err != EPIPE && err != ECONNRESET))
+        {
+            // 文件比提交的长度短或读取失败，对端按长度等待的数据已无法补齐，关闭连接
+            LOG_FMT_ERROR_MSG("sendfile failed: channel %lld fd %d file %d offset %ld left %lu %d %s", 
+                (long long) channel_->Id(), channel_->Fd(), fd, (long) offset, len, err, strerror(err));
+            chain_.Consume(len);
+            shutdown(channel_->Fd(), SHUT_RDWR);
+            return true;
+        }
+        LOG_FMT_ERROR_MSG("sendfile error: channel %lld fd %d wd %ld %d %s", (long long) channel_->Id(), 
+            channel_->Fd(), wd, err, strerror(err));
+        return false;
+    }
+
+    bool TcpConn::FlushZeroCopy(const struct iovec &iov)
+    {
+        struct msghdr msg;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = const_cast<struct iovec*>(&iov);
+        msg.msg_iovlen = 1;
+        ssize_t wd = sendmsg(channel_->Fd(), &msg, MSG_ZEROCOPY);
+        if (wd > 0)
+        {
+            // 内核引用了块的内存，持有到完成通知
+            zerocopy_.Sent(chain_.FrontChunk());
+        }
+        else if (wd == -1 && errno == ENOBUFS)
+        {
+            // 超出optmem_max限制，本次复制发送
+            wd = WritevImp(channel_->Fd(), &iov, 1);
+        }
+        int err = errno;
+        LOG_FMT_VERBOSE_MSG("channel %lld fd %d zerocopy send %ld bytes", (long long) channel_->Id(), 
+            channel_->Fd(), wd);
+        if (wd > 0) 
+        {
+            chain_.Consume(wd);
+            return true;
+        } 
+        else if (wd == -1 && err == EINTR) 
+        {
+            return true;
+        } 
+        else if (wd == -1 && (err == EAGAIN || err == EWOULDBLOCK)) 
+        {
+            return false;
+        }
+        LOG_FMT_ERROR_MSG("zerocopy send error: channel %lld fd %d wd %ld %d %s", (long long) channel_->Id(), 
+            channel_->Fd(), wd, err, strerror(err));
+        return false;
+    }
+
+    void TcpConn::FinishZeroCopy()
+    {
+        if (zerocopy_fd_ < 0)
+            return;
+        int fd = zerocopy_fd_;
+        zerocopy_fd_ = -1;
+        // 新的socket需要重新SetZeroCopy
+        zerocopy_.SetThreshold(0);
+        ReadZeroCopyDone(fd, zerocopy_);
+        if (!zerocopy_.Waiting())
+        {
+            close(fd);
+            return;
+        }
+        // 内核仍引用发送中的块，关闭写方向让对端尽快确认，之后继续读取完成通知
+        LOG_FMT_DEBUG_MSG("fd %d closed with zerocopy sends pending, waiting for completions", fd);
+        shutdown(fd, SHUT_WR);
+        auto linger = std::make_shared<ZeroCopyLinger>(fd, GetBase()->Now() + kZeroCopyLingerMs);
+        zerocopy_.MoveTo(&linger->tracker_);
+        LingerZeroCopy(GetBase(), linger);
+    }
+
+    void TcpConn::OnError()
+    {
+        if (zerocopy_.Waiting())
+            ReadZeroCopyDone(zerocopy_fd_, zerocopy_);
+        // socket本身的错误由读取时处理
+        HandleRead(self_);
+    }
+
+    int TcpConn::SetZeroCopy(size_t threshold)
+    {
+        if (!channel_ || channel_->Completion())
+            return -1;
+        if (threshold)
+        {
+            int on = 1;
+            if (setsockopt(channel_->Fd(), SOL_SOCKET, SO_ZEROCOPY, &on, sizeof(on)) < 0)
+            {
+                LOG_FMT_WARNING_MSG("set SO_ZEROCOPY on fd %d failed %d %s", channel_->Fd(), errno, strerror(errno));
+                return -1;
+            }
+            // 通道关闭时fd随之关闭，另持有一个fd以便关闭后继续读取完成通知
+            if (zerocopy_fd_ < 0)
+                zerocopy_fd_ = fcntl(channel_->Fd(), F_DUPFD_CLOEXEC, 0);
+            if (zerocopy_fd_ < 0)
+            {
+                LOG_FMT_WARNING_MSG("dup fd %d for zerocopy failed %d %s", channel_->Fd(), errno, strerror(errno));
+                return -1;
+            }
+            channel_->SetDuplicated();
+        }
+        zerocopy_.SetThreshold(threshold);
+        return 0;
+    }
+
     void TcpConn::Send(Buffer &buf) 
     {
         if (channel_) 
         {
-            if (channel_->WriteEnabled()) 
-                output_.Absorb(buf);
-            
-            if (buf.Size()) 
+            // 暂存在output_中的数据先于buf发送
+            if (&buf != &output_)
+                chain_.Append(output_);
+            if (chain_.Empty() && buf.Size() && !deferred_.enabled_) 
             {
                 ssize_t sended = Isend(buf.Begin(), buf.Size());
                 buf.Consume(sended);
             }
             if (buf.Size()) 
             {
-                output_.Absorb(buf);
-                if (!channel_->WriteEnabled()) 
-                    channel_->EnableWrite(true);
-                
+                // 接管buf的存储，不复制
+                chain_.Append(buf);
+                WaitFlush();
+                CheckWatermark();
             }
         } 
+        else if (resolve_.pending_)
+        {
+            if (&buf != &output_)
+                chain_.Append(output_);
+            chain_.Append(buf);
+        }
         else 
         {
             LOG_FMT_WARNING_MSG("connection %s - %s closed, but still writing %lu bytes", 
@@ -289,16 +935,25 @@ namespace net
     {
         if (channel_) 
         {
-            if (output_.Empty()) 
+            chain_.Append(output_);
+            if (chain_.Empty() && !deferred_.enabled_) 
             {
                 ssize_t sended = Isend(buf, len);
                 buf += sended;
                 len -= sended;
             }
             if (len)
-                output_.Append(buf, len);
-            
+            {
+                chain_.Append(buf, len);
+                WaitFlush();
+                CheckWatermark();
+            }
         } 
+        else if (resolve_.pending_)
+        {
+            chain_.Append(output_);
+            chain_.Append(buf, len);
+        }
         else 
         {
             LOG_FMT_WARNING_MSG("connection %s - %s closed, but still writing %lu bytes", 
@@ -306,12 +961,283 @@ namespace net
         }
     }
 
+    void TcpConn::Send(const SharedSlice &msg)
+    {
+        if (!channel_ && resolve_.pending_)
+        {
+            chain_.Append(output_);
+            chain_.Append(msg);
+            return;
+        }
+        if (!channel_) 
+        {
+            LOG_FMT_WARNING_MSG("connection %s - %s closed, but still writing %lu bytes", 
+                local_.ToString().c_str(), peer_.ToString().c_str(), msg.Size());
+            return;
+        }
+        chain_.Append(output_);
+        bool idle = chain_.Empty() && !deferred_.enabled_;
+        // 达到零拷贝阈值的数据经chain_发送，块持有到完成通知
+        bool zerocopy = ZeroCopyable(msg.Size());
+        size_t sended = 0;
+        if (idle && !zerocopy) 
+            sended = Isend(msg.Data(), msg.Size());
+        if (sended < msg.Size())
+        {
+            chain_.Append(msg.GetChunk(), msg.Data() + sended, msg.Size() - sended);
+            if (idle && zerocopy)
+                FlushChain();
+            else
+            {
+                WaitFlush();
+                CheckWatermark();
+            }
+        }
+    }
+
+    // 分组后连接可能已迁移到其他事件循环，转交给其当前所属的事件循环发送
+    static void SendIn(EventBase *base, const TcpConnPtr &con, const SharedSlice &msg)
+    {
+        EventBase *current = con->GetBase();
+        if (current == base)
+            con->Send(msg);
+        else
+            current->SafeCall([current, con, msg] { SendIn(current, con, msg); });
+    }
+
+    void TcpConn::Broadcast(const std::vector<TcpConnPtr> &conns, const SharedSlice &msg)
+    {
+        std::unordered_map<EventBase*, std::vector<TcpConnPtr>> groups;
+        for (auto &con : conns)
+        {
+            if (con->GetBase())
+                groups[con->GetBase()].push_back(con);
+        }
+        for (auto &g : groups)
+        {
+            EventBase *base = g.first;
+            g.first->RunInLoop([base, cons = std::move(g.second), msg] {
+                for (auto &con : cons)
+                    SendIn(base, con, msg);
+            });
+        }
+    }
+
+    void TcpConn::SendRef(const char *buf, size_t len, std::function<void()> done)
+    {
+        if (!channel_ && resolve_.pending_)
+        {
+            chain_.Append(output_);
+            chain_.AppendRef(buf, len, std::move(done));
+            return;
+        }
+        if (!channel_) 
+        {
+            LOG_FMT_WARNING_MSG("connection %s - %s closed, but still writing %lu bytes", 
+                local_.ToString().c_str(), peer_.ToString().c_str(), len);
+            if (done)
+                done();
+            return;
+        }
+        chain_.Append(output_);
+        bool idle = chain_.Empty() && !deferred_.enabled_;
+        bool zerocopy = ZeroCopyable(len);
+        if (idle && !zerocopy) 
+        {
+            ssize_t sended = Isend(buf, len);
+            buf += sended;
+            len -= sended;
+        }
+        chain_.AppendRef(buf, len, std::move(done));
+        if (idle && zerocopy)
+            FlushChain();
+        else if (chain_.Size()) 
+        {
+            WaitFlush();
+            CheckWatermark();
+        }
+    }
+
+    void TcpConn::SendFile(int fd, off_t offset, size_t len, std::function<void()> done)
+    {
+        if (!channel_ && resolve_.pending_)
+        {
+            chain_.Append(output_);
+            chain_.AppendFile(fd, offset, len, std::move(done));
+            return;
+        }
+        if (!channel_) 
+        {
+            LOG_FMT_WARNING_MSG("connection %s - %s closed, but still sending file %d %lu bytes", 
+                local_.ToString().c_str(), peer_.ToString().c_str(), fd, len);
+            if (done)
+                done();
+            return;
+        }
+        // output_中尚未发送的数据(如响应头)随文件一起发送，不算作之前未发送完的数据
+        bool idle = chain_.Empty();
+        chain_.Append(output_);
+        chain_.AppendFile(fd, offset, len, std::move(done));
+        // 之前有数据未发送完时已在等待可写，由HandleWrite继续发送
+        if (deferred_.enabled_)
+            MarkDirty();
+        else if (idle)
+            FlushChain();
+    }
+
+    void TcpConn::SetDeferredFlush(bool on)
+    {
+        deferred_.enabled_ = on;
+        if (on && channel_ && channel_->Fd() >= 0)
+            SetNoDelay(channel_->Fd());
+        if (!on && deferred_.dirty_)
+            FlushDeferred();
+    }
+
+    void TcpConn::WaitFlush()
+    {
+        if (deferred_.enabled_)
+            MarkDirty();
+        else if (!channel_->WriteEnabled()) 
+            channel_->EnableWrite(true);
+    }
+
+    void TcpConn::FlushDeferred()
+    {
+        deferred_.dirty_ = false;
+        // 正在等待可写时由HandleWrite继续发送，握手中的连接在握手完成后发送
+        if (!channel_ || state_ != State::STATTE_CONNECTED || channel_->WriteEnabled())
+            return;
+        chain_.Append(output_);
+        if (chain_.Empty())
+            return;
+        // 完成模式下数据提交到poller的发送队列，不需要合并报文段
+        bool cork = !channel_->Completion() 
+            && (!chain_.Gatherable(kMaxIov) || (zerocopy_.Threshold() && chain_.Pieces() > 1));
+        if (cork)
+            SetCork(channel_->Fd());
+        FlushChain();
+        if (cork && channel_)
+            SetCork(channel_->Fd(), false);
+    }
+
+    void TcpConn::OnWatermark(size_t high, size_t low, const TcpCallBack &highcb, const TcpCallBack &lowcb)
+    {
+        watermark_.high_ = high;
+        watermark_.low_ = std::min(low, high);
+        watermark_.high_callback_ = highcb;
+        watermark_.low_callback_ = lowcb;
+    }
+
+    void TcpConn::SetBackpressure(size_t high, size_t low)
+    {
+        OnWatermark(high, low, [](const TcpConnPtr &con) { con->PauseRead(); },
+            [](const TcpConnPtr &con) { con->ResumeRead(); });
+    }
+
+    void TcpConn::SetMaxInput(size_t max, OverflowPolicy policy)
+    {
+        if (policy == OverflowPolicy::POLICY_PAUSE)
+        {
+            OnInputOverflow(max, [](const TcpConnPtr &con) {
+                if (!con->ReadPaused())
+                    con->PauseRead();
+            });
+        }
+        else
+        {
+            OnInputOverflow(max, [](const TcpConnPtr &con) {
+                LOG_FMT_WARNING_MSG("connection %s input %lu exceeds limit, closing", con->Str().c_str(), 
+                    con->GetInput().Size());
+                // 关闭在稍后执行，先停止读，水平触发时不会在此之前再次回调
+                if (!con->ReadPaused())
+                    con->PauseRead();
+                con->Close();
+            });
+        }
+    }
+
+    void TcpConn::OnInputOverflow(size_t max, const TcpCallBack &cb)
+    {
+        read_limit_.max_input_ = max ? max : SIZE_MAX;
+        read_limit_.overflow_callback_ = cb;
+    }
+
+    void TcpConn::PauseRead()
+    {
+        if (watermark_.pauses_++ == 0 && channel_)
+            channel_->EnableRead(false);
+    }
+
+    void TcpConn::ResumeRead()
+    {
+        if (watermark_.pauses_ == 0 || --watermark_.pauses_ || !channel_)
+            return;
+        channel_->EnableRead(true);
+        // 暂停时已读入未处理的数据不会再有可读事件，在本轮事件循环稍后处理，避免在发送的调用中重入读回调
+        if (input_.Size() && read_callback_)
+        {
+            TcpConnPtr con = shared_from_this();
+            EventBase *base = GetBase();
+            base->QueueInLoop([con, base] {
+                if (con->GetBase() == base && !con->ReadPaused() && con->input_.Size() && con->read_callback_)
+                    con->read_callback_(con);
+            });
+        }
+    }
+
+    OutputStats TcpConn::GetOutputStats()
+    {
+        OutputStats stats;
+        stats.queued = PendingBytes();
+        stats.peak = watermark_.peak_;
+        stats.high_hits = watermark_.hits_;
+        stats.above_high = watermark_.above_;
+        stats.read_paused = watermark_.pauses_ > 0;
+        return stats;
+    }
+
+    void TcpConn::CheckWatermark()
+    {
+        Watermark &w = watermark_;
+        size_t queued = PendingBytes();
+        if (queued == w.reported_)
+            return;
+        if (queued > w.peak_)
+            w.peak_ = queued;
+        bool high = w.high_ && !w.above_ && queued > w.high_;
+        bool low = w.above_ && queued <= w.low_;
+        if (high)
+        {
+            w.above_ = true;
+            w.hits_++;
+        }
+        else if (low)
+            w.above_ = false;
+        ReportOutput(static_cast<int64_t>(queued) - static_cast<int64_t>(w.reported_), high ? 1 : low ? -1 : 0);
+        w.reported_ = queued;
+        // 完成模式下数据在poller的发送队列中，超过高水位期间关注可写，poller每次发送完成时回调HandleWrite再次检查
+        if (w.above_ && channel_ && channel_->SendQueued() && !channel_->WriteEnabled())
+            channel_->EnableWrite(true);
+
+        if ((high && w.high_callback_) || (low && w.low_callback_))
+        {
+            // 回调中连接可能被关闭，持有引用直到回调返回
+            TcpConnPtr con = shared_from_this();
+            if (high)
+                w.high_callback_(con);
+            else
+                w.low_callback_(con);
+        }
+    }
+
     void TcpConn::OnMsg(CodecBase *codec, const MsgCallBack &cb) 
     {
         codec_.reset(codec);
         OnRead([cb](const TcpConnPtr &con) {
             int r = 1;
-            while (r) 
+            // 读被暂停时剩余的消息留在input_中，恢复读时再处理
+            while (r && !con->ReadPaused()) 
             {
                 Slice msg;
                 r = con->codec_->TryDecode(con->GetInput(), msg);
@@ -336,31 +1262,97 @@ namespace net
         SendOutput();
     }
 
-    TcpServer::TcpServer(EventBases *bases) 
-        : base_(bases->AllocBase()), bases_(bases), listen_channel_(NULL), 
-        createcb_([] { return TcpConnPtr(new TcpConn); }) {}
+    void TokenBucket::Reset(double rate, double burst)
+    {
+        rate_ = rate;
+        burst_ = std::max(burst, 1.0);
+        tokens_ = burst_;
+        last_ = util::TimeMilli();
+    }
+
+    bool TokenBucket::Take(int64_t nowMs)
+    {
+        if (nowMs > last_)
+        {
+            tokens_ = std::min(burst_, tokens_ + (nowMs - last_) * rate_ / 1000);
+            last_ = nowMs;
+        }
+        if (tokens_ < 1)
+            return false;
+        tokens_ -= 1;
+        return true;
+    }
 
-    int TcpServer::Bind(const std::string &host, unsigned short port, bool reusePort) 
+    int64_t TokenBucket::WaitMs()
+    {
+        return static_cast<int64_t>((1 - tokens_) * 1000 / rate_) + 1;
+    }
+
+
+    TcpServer::TcpServer(EventBases *bases, AcceptMode mode)
+        : base_(bases->AllocBase()), bases_(bases), mode_(mode), backlog_(SOMAXCONN), accept_budget_(0),
+        accept_rate_(0), accept_burst_(0), reject_over_rate_(false), accepted_(0), deferred_(0), rejected_(0),
+        high_water_(0), low_water_(0), read_budget_(0), max_input_(0), overflow_policy_(OverflowPolicy::POLICY_CLOSE),
+        deferred_flush_(false), createcb_(nullptr), alive_(std::make_shared<bool>(true)) {}
+
+    int TcpServer::Bind(const std::string &host, unsigned short port, bool reusePort)
     {
         addr_ = Addr(host, port);
+        if (mode_ == AcceptMode::MODE_SINGLE)
+            return Listen(base_, reusePort, false);
+
+        // 按事件循环的顺序绑定，socket在reuseport组中的下标即事件循环的下标
+        for (int i = 0; i < bases_->BaseCount(); i++)
+        {
+            int r = Listen(bases_->BaseAt(i), true, i == 0 && mode_ == AcceptMode::MODE_REUSEPORT_CPU);
+            if (r)
+            {
+                for (auto &l : listeners_)
+                    delete l.ch_;
+                listeners_.clear();
+                return r;
+            }
+        }
+        return 0;
+    }
+
+    int TcpServer::Listen(EventBase *base, bool reusePort, bool cpuSteering)
+    {
         int fd = socket(AF_INET, SOCK_STREAM, 0);
         int r = net::SetReuseAddr(fd);
         r = net::SetReusePort(fd, reusePort);
-        
+
         r = util::AddFdFlag(fd, FD_CLOEXEC);
-        
+
+        if (cpuSteering)
+        {
+            // 返回收包的CPU号对socket数取模，作为reuseport组中的下标。挂载在组内任一socket上即对整个组生效
+            struct sock_filter code[] = {
+                { BPF_LD | BPF_W | BPF_ABS, 0, 0, static_cast<uint32_t>(SKF_AD_OFF + SKF_AD_CPU) },
+                { BPF_ALU | BPF_MOD | BPF_K, 0, 0, static_cast<uint32_t>(bases_->BaseCount()) },
+                { BPF_RET | BPF_A, 0, 0, 0 },
+            };
+            struct sock_fprog prog = { sizeof(code) / sizeof(code[0]), code };
+            if (setsockopt(fd, SOL_SOCKET, SO_ATTACH_REUSEPORT_CBPF, &prog, sizeof(prog)))
+                LOG_FMT_WARNING_MSG("attach reuseport cbpf failed %d %s", errno, strerror(errno));
+        }
+
         r = ::bind(fd, (struct sockaddr *) &addr_.GetAddr(), sizeof(struct sockaddr));
-        if (r) 
+        if (r)
         {
             close(fd);
             LOG_FMT_ERROR_MSG("bind to %s failed %d %s", addr_.ToString().c_str(), errno, strerror(errno));
             return errno;
         }
-        r = listen(fd, 20);
-        
-        LOG_FMT_INFO_MSG("fd %d listening at %s", fd, addr_.ToString().c_str());
-        listen_channel_ = new Channel(base_, fd, kReadEvent);
-        listen_channel_->OnRead([this] { handleAccept(); });
+        r = listen(fd, backlog_);
+
+        LOG_FMT_INFO_MSG("fd %d listening at %s backlog %d", fd, addr_.ToString().c_str(), backlog_);
+        listeners_.push_back(Listener{base, new Channel(base, fd, kReadEvent), TokenBucket(), false});
+        Listener *l = &listeners_.back();
+        int n = mode_ == AcceptMode::MODE_SINGLE ? 1 : bases_->BaseCount();
+        if (accept_rate_ > 0)
+            l->bucket_.Reset(accept_rate_ / n, static_cast<double>(accept_burst_) / n);
+        l->ch_->OnRead([this, l] { handleAccept(l); });
         return 0;
     }
 
@@ -369,39 +1361,118 @@ namespace net
     {
         TcpServerPtr p(new TcpServer(bases));
         int r = p->Bind(host, port, reusePort);
-        if (r) 
+        if (r)
             LOG_FMT_ERROR_MSG("bind to %s:%d failed %d %s", host.c_str(), port, errno, strerror(errno));
-        
+
+        return r == 0 ? p : NULL;
+    }
+
+    TcpServerPtr TcpServer::StartServer(EventBases *bases, const std::string &host,
+        unsigned short port, AcceptMode mode)
+    {
+        TcpServerPtr p(new TcpServer(bases, mode));
+        int r = p->Bind(host, port);
+        if (r)
+            LOG_FMT_ERROR_MSG("bind to %s:%d failed %d %s", host.c_str(), port, r, strerror(r));
+
         return r == 0 ? p : NULL;
     }
 
-    void TcpServer::handleAccept() 
+    AcceptStats TcpServer::GetAcceptStats()
+    {
+        AcceptStats stats;
+        stats.accepted = accepted_.load(std::memory_order_relaxed);
+        stats.deferred = deferred_.load(std::memory_order_relaxed);
+        stats.rejected = rejected_.load(std::memory_order_relaxed);
+        return stats;
+    }
+
+    void TcpServer::PauseAccept(Listener *l, int64_t delayMs)
+    {
+        // 暂停读而不是直接重试，水平触发时不会在每轮循环中被反复唤醒
+        deferred_.fetch_add(1, std::memory_order_relaxed);
+        l->paused_ = true;
+        l->ch_->EnableRead(false);
+        std::weak_ptr<bool> alive = alive_;
+        auto resume = [alive, l] {
+            if (alive.expired())
+                return;
+            l->paused_ = false;
+            if (l->ch_->Fd() >= 0)
+                l->ch_->EnableRead(true);
+        };
+        if (delayMs)
+            l->base_->RunAfter(delayMs, std::move(resume));
+        else
+            l->base_->QueueInLoop(std::move(resume));
+    }
+
+    void TcpServer::handleAccept(Listener *l)
     {
-        struct sockaddr_in raddr;
-        socklen_t rsz = sizeof(raddr);
-        int lfd = listen_channel_->Fd();
-        int cfd;
-        while (lfd >= 0 && (cfd = accept(lfd, (struct sockaddr *) &raddr, &rsz)) >= 0) 
+        int lfd = l->ch_->Fd();
+        if (lfd < 0 || l->paused_)
+            return;
+
+        // 绑定到具体地址时本地地址即监听地址，省去getsockname
+        bool any_addr = addr_.GetAddr().sin_addr.s_addr == htonl(INADDR_ANY);
+        int budget = accept_budget_ > 0 ? accept_budget_ : INT_MAX;
+        int64_t now = l->base_->Now();
+        int cfd = -1;
+        for (int n = 0; ; n++)
         {
-            sockaddr_in peer, local;
+            if (n >= budget)
+            {
+                PauseAccept(l, 0);
+                break;
+            }
+            bool allowed = !l->bucket_.Enabled() || l->bucket_.Take(now);
+            if (!allowed && !reject_over_rate_)
+            {
+                PauseAccept(l, l->bucket_.WaitMs());
+                break;
+            }
+
+            struct sockaddr_in peer, local;
             socklen_t alen = sizeof(peer);
-            int r = getpeername(cfd, (sockaddr *) &peer, &alen);
-            if (r < 0) 
+            cfd = accept4(lfd, (struct sockaddr *) &peer, &alen, SOCK_NONBLOCK | SOCK_CLOEXEC);
+            if (cfd < 0)
             {
-                LOG_FMT_ERROR_MSG("get peer name failed %d %s", errno, strerror(errno));
-                continue;
+                if (allowed && l->bucket_.Enabled())
+                    l->bucket_.Refund();
+                break;
             }
-            r = getsockname(cfd, (sockaddr *) &local, &alen);
-            if (r < 0) {
-                LOG_FMT_ERROR_MSG("getsockname failed %d %s", errno, strerror(errno));
+            if (!allowed)
+            {
+                rejected_.fetch_add(1, std::memory_order_relaxed);
+                close(cfd);
                 continue;
             }
-            r = util::AddFdFlag(cfd, FD_CLOEXEC);
-            
-            EventBase *b = bases_->AllocBase();
-            auto addcon = [=] 
+            if (any_addr)
+            {
+                alen = sizeof(local);
+                if (getsockname(cfd, (sockaddr *) &local, &alen) < 0)
+                {
+                    LOG_FMT_ERROR_MSG("getsockname failed %d %s", errno, strerror(errno));
+                    close(cfd);
+                    continue;
+                }
+            }
+            else
+                local = addr_.GetAddr();
+            accepted_.fetch_add(1, std::memory_order_relaxed);
+
+            // reuseport模式下连接留在接受它的事件循环。
+            // 交接到其他事件循环的连接先计入目标的连接数，按负载分配时同一批连接不会都分到一处
+            bool handoff = mode_ == AcceptMode::MODE_SINGLE;
+            EventBase *b = handoff ? bases_->AllocBase() : l->base_;
+            if (handoff)
+                b->AddConnections(1);
+            auto addcon = [=]
             {
-                TcpConnPtr con = createcb_();
+                if (handoff)
+                    b->AddConnections(-1);
+                TcpConnPtr con = createcb_ ? createcb_()
+                    : std::allocate_shared<TcpConn>(PoolAllocator<TcpConn>(b->GetPool()));
                 con->Attach(b, cfd, local, peer);
                 if (statecb_) {
                     con->OnState(statecb_);
@@ -412,14 +1483,23 @@ namespace net
                 if (msgcb_) {
                     con->OnMsg(codec_->Clone(), msgcb_);
                 }
+                if (high_water_) {
+                    con->OnWatermark(high_water_, low_water_, highcb_, lowcb_);
+                }
+                if (read_budget_) {
+                    con->SetReadBudget(read_budget_);
+                }
+                if (max_input_) {
+                    con->SetMaxInput(max_input_, overflow_policy_);
+                }
+                if (deferred_flush_) {
+                    con->SetDeferredFlush(true);
+                }
             };
-            if (b == base_) 
-                addcon();
-            else 
-                b->SafeCall(std::move(addcon));
-            
+            // 分配到本事件循环时直接挂接
+            b->RunInLoop(std::move(addcon));
         }
-        if (lfd >= 0 && errno != EAGAIN && errno != EINTR) {
+        if (cfd < 0 && errno != EAGAIN && errno != EINTR) {
             LOG_FMT_WARNING_MSG("accept return %d  %d %s", cfd, errno, strerror(errno));
         }
     }
@@ -8,12 +8,18 @@
 #include "codec.h"
 #include "event_base.h"
 #include "thread_pool.h"
+#include "idle_wheel.h"
+#include "output_chain.h"
 
 #include <memory>
 #include <functional>
 #include <list>
+#include <deque>
+#include <atomic>
 #include <unistd.h>
+#include <sys/sendfile.h>
 #include <cassert>
+#include <cstdint>
 
 namespace net
 {
@@ -25,28 +31,26 @@ namespace net
     using TcpCallBack = std::function<void(const TcpConnPtr &)>;
     using MsgCallBack = std::function<void(const TcpConnPtr &, Slice msg)>;
 
-
-    struct IdleNode 
+    // input_超过上限时的处理方式
+    enum class OverflowPolicy
     {
-        TcpConnPtr conn_;
-        int64_t updated_;
-        TcpCallBack callback_;
+        POLICY_PAUSE,   // 暂停读，应用处理完input_中的数据后调用ResumeRead恢复
+        POLICY_CLOSE,   // 关闭连接
     };
 
-    struct IdleIdImp 
+    struct OutputStats
     {
-        using Iter = std::list<IdleNode>::iterator;
-
-        IdleIdImp() {}
-        IdleIdImp(std::list<IdleNode> *lst, Iter iter) : list_(lst), iter_(iter) {}
-        std::list<IdleNode> *list_;
-        Iter iter_;
+        size_t queued;          // 已提交但尚未写入内核的字节数
+        size_t peak;            // queued的峰值
+        int64_t high_hits;      // 超过高水位的次数
+        bool above_high;        // 超过高水位后尚未降到低水位
+        bool read_paused;       // 读已被PauseRead暂停
     };
 
-
-    class TcpConn : public std::enable_shared_from_this<TcpConn>, util::NonCopyable
+    class TcpConn : public std::enable_shared_from_this<TcpConn>, util::NonCopyable, private ChannelHandler
     {
         friend class HttpConnPtr;
+        friend class EventsImp;
     public:
         enum State 
         {
@@ -60,12 +64,13 @@ namespace net
         TcpConn();
         virtual ~TcpConn();
 
-        //可传入连接类型，返回智能指针
+        //可传入连接类型，返回智能指针。host为域名时由Resolver::Default()异步解析，
+        //期间连接处于握手状态，发送的数据在连接建立后发送，超时时间包含解析的时间
         template <class C = TcpConn>
         static TcpConnPtr CreateConnection(EventBase *base, const std::string &host, unsigned short port, 
             int timeout = 0, const std::string &localip = "") 
         {
-            TcpConnPtr con(new C);
+            TcpConnPtr con = std::allocate_shared<C>(PoolAllocator<C>(base->GetPool()));
             con->Connect(base, host, port, timeout, localip);
             return con;
         }
@@ -73,7 +78,7 @@ namespace net
         template <class C = TcpConn>
         static TcpConnPtr CreateConnection(EventBase *base, int fd, Addr local, Addr peer) 
         {
-            TcpConnPtr conn(new C);
+            TcpConnPtr conn = std::allocate_shared<C>(PoolAllocator<C>(base->GetPool()));
             conn->Attach(base, fd, local, peer);
             
             return conn;
@@ -88,7 +93,8 @@ namespace net
             return ctx_.Context<T>();
         }
 
-        EventBase *GetBase() { return base_; }
+        //可在任意线程读取，迁移期间可能已是目标事件循环
+        EventBase *GetBase() { return base_.load(std::memory_order_acquire); }
         State GetState() { return state_; }
         // TcpConn的输入输出缓冲区
         Buffer &GetInput() { return input_; }
@@ -103,6 +109,63 @@ namespace net
         void Send(const char *buf, size_t len);
         void Send(const std::string &s) { Send(s.data(), s.size()); }
         void Send(const char *s) { Send(s, strlen(s)); }
+        //发送用户内存，不复制。数据发送完毕或连接关闭丢弃后回调done，在此之前buf必须有效
+        void SendRef(const char *buf, size_t len, std::function<void()> done);
+        //发送共享数据，写不完的部分只引用不复制
+        void Send(const SharedSlice &msg);
+        //用本连接的codec编码一次，发送给所有连接
+        SharedSlice EncodeShared(Slice msg) { return codec_->EncodeShared(msg, GetBase()->GetPool()); }
+        /**
+         * @brief 向多个连接发送同一数据，可在任意线程调用。
+         *  按连接所属的事件循环分组，每个事件循环通过RunInLoop执行一个任务(调用者所在的事件循环直接发送)，数据只引用不复制
+         */
+        static void Broadcast(const std::vector<TcpConnPtr> &conns, const SharedSlice &msg);
+        /**
+         * @brief 发送文件fd从offset开始的len字节，由sendfile从内核直接发送，不经过用户空间。
+         *  与其他数据按提交顺序发送，写不完的部分在可写时继续发送
+         * @param done 发送完毕或连接关闭丢弃后回调，在此之前fd必须有效，可在done中关闭fd
+         */
+        void SendFile(int fd, off_t offset, size_t len, std::function<void()> done);
+        /**
+         * @brief 启用MSG_ZEROCOPY发送，需在连接建立后调用。不小于threshold字节的段不复制到内核，
+         *  数据保留到错误队列中的完成通知到达后释放。小数据的通知开销大于复制，
+         *  内核回退为复制(如本机连接)时自动停用。关闭时仍有发送未完成的，socket保留到通知到齐。完成模式下不支持
+         * @param threshold 0表示停用
+         * @return 成功返回0，失败返回-1
+         */
+        int SetZeroCopy(size_t threshold);
+        /**
+         * @brief 延迟发送。开启后各Send只把数据追加到待发送链并标记连接，事件循环在本轮结束时对标记的连接
+         *  各发送一次，一次事件中的多次Send合并为一次系统调用。开启时设置TCP_NODELAY，合并后的数据不再等待Nagle；
+         *  一次writev发送不完(含文件段、段数过多或零拷贝分段)时发送期间开启TCP_CORK，避免发出不满的报文段。
+         *  只在连接所属的事件循环线程中调用，关闭时立即发送已延迟的数据
+         */
+        void SetDeferredFlush(bool on);
+        bool DeferredFlush() { return deferred_.enabled_; }
+        //已提交但尚未写入内核的字节数，完成模式下含poller发送队列中的数据
+        size_t PendingBytes() { return chain_.Size() + output_.Size() + (channel_ ? channel_->SendQueued() : 0); }
+        /**
+         * @brief 设置待发送数据的高低水位。待发送数据超过high时回调highcb，之后降到low以下时回调lowcb，
+         *  可在回调中暂停、恢复本连接或上游连接的读，上游连接在其他事件循环时通过SafeCall调用
+         * @param high 0表示不启用
+         */
+        void OnWatermark(size_t high, size_t low, const TcpCallBack &highcb, const TcpCallBack &lowcb);
+        //待发送数据超过high时暂停读本连接，降到low以下时恢复
+        void SetBackpressure(size_t high, size_t low);
+        //暂停、恢复读，可嵌套，恢复与暂停的次数相同时重新开始读。只在连接所属的事件循环线程中调用
+        void PauseRead();
+        void ResumeRead();
+        bool ReadPaused() { return watermark_.pauses_ > 0; }
+        /**
+         * @brief 每次可读事件最多读取的字节数，用完后先回调读回调，剩余数据在下一轮事件循环读取，
+         *  避免持续发送的连接占住事件循环。0表示读到EAGAIN为止
+         */
+        void SetReadBudget(size_t bytes) { read_limit_.budget_ = bytes ? bytes : SIZE_MAX; }
+        //input_的上限，读回调处理后仍不小于max时按policy处理。max需大于最大的消息
+        void SetMaxInput(size_t max, OverflowPolicy policy);
+        //input_的上限，读回调处理后仍不小于max时回调cb，cb需暂停读、关闭连接或消费数据
+        void OnInputOverflow(size_t max, const TcpCallBack &cb);
+        OutputStats GetOutputStats();
 
         //数据到达时回调
         void OnRead(const TcpCallBack &cb) 
@@ -114,7 +177,7 @@ namespace net
         void OnWritable(const TcpCallBack &cb) { write_callback_ = cb; }
         // tcp状态改变时回调
         void OnState(const TcpCallBack &cb) { state_callback_ = cb; }
-        // tcp空闲回调
+        // tcp空闲回调，连接空闲idle秒后回调，之后每空闲idle秒回调一次。每个连接一个空闲回调，再次调用替换之前的设置
         void AddIdleCB(int idle, const TcpCallBack &cb);
 
         //消息回调，此回调与onRead回调冲突，只能够调用一个
@@ -134,31 +197,49 @@ namespace net
                 channel_->Close();
         }
 
+        /**
+         * @brief 把连接迁移到target事件循环，只在连接所属的事件循环线程中调用，在本轮循环结束时进行。
+         *  通道从原poller注销后在target上重新注册，input_、待发送的数据、空闲检测及收缩定时随之迁移，
+         *  期间到达的数据留在内核中，迁移后按序读取。之后的回调均在target线程中执行，
+         *  其他线程应通过GetBase()向连接所属的事件循环提交任务，迁移前已提交到原事件循环的任务仍在原线程执行。
+         *  完成模式、有未确认的零拷贝发送或连接未建立时不迁移
+         * @return 已安排迁移返回true
+         */
+        bool MigrateTo(EventBase *target);
+
         //远程地址的字符串
         std::string Str() { return peer_.ToString(); }
     public:
         void HandleRead(const TcpConnPtr &con);
         void HandleWrite(const TcpConnPtr &con);
+        //完成模式下由poller读到数据后回调，len小于等于0表示连接关闭或出错
+        void HandleRecv(const TcpConnPtr &con, const char *buf, ssize_t len);
         ssize_t Isend(const char *buf, size_t len);
         void Cleanup(const TcpConnPtr &con);
         void Connect(EventBase *base, const std::string &host, unsigned short port, int timeout, const std::string &localip);
         void Reconnect();
         void Attach(EventBase *base, int fd, Addr local, Addr peer);
-        virtual int ReadImp(int fd, void *buf, size_t bytes) { return ::read(fd, buf, bytes); }
+        //读取的唯一入口，读数据需经过处理的子类(如解密)重写此函数。返回值少于请求的字节数表示内核中暂时没有更多数据
+        virtual ssize_t ReadvImp(int fd, const struct iovec *iov, int cnt) { return ::readv(fd, iov, cnt); }
         virtual int WriteImp(int fd, const void *buf, size_t bytes) { return ::write(fd, buf, bytes); }
+        //重写WriteImp的子类需同时重写此函数
+        virtual ssize_t WritevImp(int fd, const struct iovec *iov, int cnt) { return ::writev(fd, iov, cnt); }
+        //数据需经过用户空间处理的子类(如加密)返回-1并设置errno为EINVAL，文件改为读出后用WriteImp发送
+        virtual ssize_t SendFileImp(int fd, int in_fd, off_t *offset, size_t len) { return ::sendfile(fd, in_fd, offset, len); }
         virtual int HandleHandshake(const TcpConnPtr &con);
     private:
-        EventBase* base_;
+        std::atomic<EventBase *> base_;     // 只由所属事件循环修改，迁移时改为目标事件循环
         Channel* channel_;
         Buffer input_;
-        Buffer output_;
+        Buffer output_;             // 由GetOutput暴露给编码器等写入，发送时整体并入chain_
+        OutputChain chain_;
         Addr local_;
         Addr peer_;
         State state_;
         TcpCallBack read_callback_;
         TcpCallBack write_callback_;
         TcpCallBack state_callback_;
-        std::list<IdleId> idle_ids_;
+        IdleNode idle_node_;
         TimerId timeout_id_;
         AutoContext ctx_;
         AutoContext internal_ctx_;
@@ -169,6 +250,111 @@ namespace net
         int reconnect_interval_;
         int64_t connected_time_;
         std::unique_ptr<CodecBase> codec_;
+        ZeroCopyTracker zerocopy_;
+        int zerocopy_fd_;       // 开启零拷贝时dup的socket，通道关闭后仍可读取完成通知，-1表示没有
+        struct Watermark
+        {
+            Watermark() : high_(0), low_(0), above_(false), pauses_(0), peak_(0), hits_(0), reported_(0) {}
+            size_t high_;
+            size_t low_;
+            bool above_;
+            int pauses_;            // PauseRead的嵌套次数
+            size_t peak_;
+            int64_t hits_;
+            size_t reported_;       // 已计入事件循环统计的待发送字节数
+            TcpCallBack high_callback_;
+            TcpCallBack low_callback_;
+        };
+        Watermark watermark_;
+        struct ReadLimit
+        {
+            ReadLimit() : budget_(SIZE_MAX), max_input_(SIZE_MAX), resumed_(false) {}
+            size_t budget_;
+            size_t max_input_;
+            bool resumed_;      // 已安排在下一轮事件循环继续读
+            TcpCallBack overflow_callback_;
+        };
+        ReadLimit read_limit_;
+        // 按最近的读取量估计下一次读取的大小，用于预留input_的空间。连接空闲后释放预留的空间
+        struct InputSizer
+        {
+            static const size_t kMinHint = 512;
+            static const size_t kMaxHint = 256 * 1024;
+            static const int64_t kIdleMs = 1000;
+            InputSizer() : hint_(kMinHint), smalls_(0), last_read_(0), shrink_pending_(false) {}
+            //记录一次读到的字节数，读满hint_时加倍，连续两次不足一半时减半
+            void Record(size_t bytes, int64_t now);
+            size_t hint_;
+            int smalls_;
+            int64_t last_read_;     // 最近一次读到数据的时间，毫秒
+            bool shrink_pending_;
+            TimerId shrink_id_;
+        };
+        InputSizer sizer_;
+        struct Deferred
+        {
+            Deferred() : enabled_(false), dirty_(false) {}
+            bool enabled_;
+            bool dirty_;        // 已加入事件循环的待发送列表
+        };
+        Deferred deferred_;
+        struct ResolveState
+        {
+            ResolveState() : pending_(false) {}
+            bool pending_;      // Connect正在解析域名，尚未创建socket
+        };
+        ResolveState resolve_;
+        TcpConnPtr self_;       // 挂接通道后持有自身，直到连接清理
+
+        //域名解析完成后创建socket并连接addr
+        void ConnectTo(Addr addr);
+        //解析期间关闭或超时，连接失败
+        void CancelResolve();
+        //清理后由事件循环在本轮结束时释放self_
+        void ReleaseSelf();
+        //把chain_中的数据写入内核，写不完时关注可写事件
+        void FlushChain();
+        //发送chain_头部的文件段，返回false表示需等待可写或出错
+        bool FlushFile();
+        //零拷贝发送chain_头部的段，返回值同FlushFile
+        bool FlushZeroCopy(const struct iovec &iov);
+        //连接关闭时调用，仍有发送等待完成通知时保留socket，通知到齐后才释放块并关闭
+        void FinishZeroCopy();
+        //len字节的段达到零拷贝阈值
+        bool ZeroCopyable(size_t len) { return zerocopy_.Threshold() && len >= zerocopy_.Threshold(); }
+        //本次可读事件读取完毕，回调读回调并收缩input_
+        void ReadDone(const TcpConnPtr &con);
+        //delay毫秒后若连接仍没有新数据，释放input_中预留的空间
+        void ShrinkInputLater(int64_t delay);
+        //读预算用完或input_已满时调用，处理超限或重新调度读
+        void ReadLimited(const TcpConnPtr &con);
+        //待发送数据变化后检查水位
+        void CheckWatermark();
+        //数据留在chain_中时调用，延迟发送时标记连接，否则关注可写事件
+        void WaitFlush();
+        //加入事件循环的待发送列表，本轮循环结束时发送
+        void MarkDirty();
+        //发送延迟的数据，写不完时关注可写事件
+        void FlushDeferred();
+        //计入事件循环的待发送字节数及超过高水位的连接数，hit为false时不计入超过高水位的次数
+        void ReportOutput(int64_t queued, int above, bool hit = true);
+        //加入、移出所属事件循环的连接集合及连接数
+        void LinkLoop();
+        void UnlinkLoop();
+        void RegisterIdle(int idle);
+        static bool Completion(EventBase *base);
+        //迁移途中的连接及fd，目标事件循环在执行MigrateIn前退出时随任务释放，关闭fd并解除自引用
+        struct Handoff;
+        //在原事件循环中注销通道，交给target
+        void MigrateOut(EventBase *target);
+        //在target中以原fd重新注册通道，恢复空闲检测等
+        void MigrateIn(int fd, short events, int idle, bool shrink);
+        bool Pending() { return !chain_.Empty() || !output_.Empty(); }
+
+        void OnReadable() override { HandleRead(self_); }
+        void OnWritable() override { HandleWrite(self_); }
+        void OnReceived(const char *buf, ssize_t len) override { HandleRecv(self_, buf, len); }
+        void OnError() override;
     };
 
 
@@ -177,16 +363,96 @@ namespace net
 
 
     // Tcp服务器
+    enum class AcceptMode
+    {
+        MODE_SINGLE,        // 一个监听socket，接受的连接通过SafeCall交给各事件循环
+        MODE_REUSEPORT,     // 每个事件循环各自监听SO_REUSEPORT socket，连接直接在本循环接受，由内核按四元组哈希分配
+        MODE_REUSEPORT_CPU  // 同MODE_REUSEPORT，并挂载CBPF程序按收包CPU选择socket，需将第i个事件循环绑定到第i个CPU
+    };
+
+    // 令牌桶，rate为每秒产生的令牌数，burst为桶容量。只在所属的事件循环线程中使用
+    struct TokenBucket
+    {
+        TokenBucket() : rate_(0), burst_(0), tokens_(0), last_(0) {}
+        void Reset(double rate, double burst);
+        bool Enabled() { return rate_ > 0; }
+        //取一个令牌，没有令牌时返回false
+        bool Take(int64_t nowMs);
+        void Refund() { tokens_ += 1; }
+        //距下一个令牌产生的毫秒数
+        int64_t WaitMs();
+
+        double rate_;
+        double burst_;
+        double tokens_;
+        int64_t last_;
+    };
+
+    struct AcceptStats
+    {
+        int64_t accepted;   // 接受的连接数
+        int64_t deferred;   // 因预算或限速暂停接受的次数，连接留在内核的backlog中
+        int64_t rejected;   // 超出限速被接受后立即关闭的连接数
+    };
+
     struct TcpServer : private util::NonCopyable
     {
-        TcpServer(EventBases *bases);
+        TcpServer(EventBases *bases, AcceptMode mode = AcceptMode::MODE_SINGLE);
         // return 0 on sucess, errno on error
         int Bind(const std::string &host, unsigned short port, bool reusePort = false);
         static TcpServerPtr StartServer(EventBases *bases, const std::string &host, unsigned short port, bool reusePort = false);
-        ~TcpServer() { delete listen_channel_; }
+        static TcpServerPtr StartServer(EventBases *bases, const std::string &host, unsigned short port, AcceptMode mode);
+        ~TcpServer()
+        {
+            alive_.reset();
+            for (auto &l : listeners_)
+                delete l.ch_;
+        }
+
+        //listen的backlog，需在Bind之前设置
+        void SetBacklog(int backlog) { backlog_ = backlog; }
+        //每次可读事件最多接受的连接数，剩余连接在下一轮事件循环接受，0表示不限制
+        void SetAcceptBudget(int budget) { accept_budget_ = budget; }
+        /**
+         * @brief 按令牌桶限制接受连接的速率，需在Bind之前设置，多个监听socket时平分
+         * @param perSecond 每秒允许接受的连接数，0表示不限速
+         * @param burst 允许的突发连接数
+         * @param reject 为true时超出速率的连接被接受后立即关闭，否则留在backlog中等待令牌
+         */
+        void SetAcceptRate(double perSecond, int burst, bool reject = false)
+        {
+            accept_rate_ = perSecond;
+            accept_burst_ = burst;
+            reject_over_rate_ = reject;
+        }
+        AcceptStats GetAcceptStats();
+        //新连接的读预算及input_上限，见TcpConn::SetReadBudget、TcpConn::SetMaxInput
+        void SetConnReadBudget(size_t bytes) { read_budget_ = bytes; }
+        void SetConnMaxInput(size_t max, OverflowPolicy policy)
+        {
+            max_input_ = max;
+            overflow_policy_ = policy;
+        }
+        //新连接开启延迟发送，见TcpConn::SetDeferredFlush
+        void SetConnDeferredFlush(bool on) { deferred_flush_ = on; }
+        //新连接的高低水位，见TcpConn::OnWatermark
+        void OnConnWatermark(size_t high, size_t low, const TcpCallBack &highcb, const TcpCallBack &lowcb)
+        {
+            high_water_ = high;
+            low_water_ = low;
+            highcb_ = highcb;
+            lowcb_ = lowcb;
+        }
+        //新连接待发送数据超过high时暂停读，降到low以下时恢复。HSHA中工作线程的回复同样受此限制
+        void SetConnBackpressure(size_t high, size_t low)
+        {
+            OnConnWatermark(high, low, [](const TcpConnPtr &con) { con->PauseRead(); },
+                [](const TcpConnPtr &con) { con->ResumeRead(); });
+        }
 
         Addr GetAddr() { return addr_; }
         EventBase *GetBase() { return base_; }
+        //自定义连接的创建，默认在接受连接的事件循环的内存池中分配TcpConn
         void OnConnCreate(const std::function<TcpConnPtr()> &cb) { createcb_ = cb; }
         void OnConnState(const TcpCallBack &cb) { statecb_ = cb; }
         void OnConnRead(const TcpCallBack &cb) 
@@ -205,13 +471,39 @@ namespace net
     private:
         EventBase *base_;
         EventBases *bases_;
+        AcceptMode mode_;
         Addr addr_;
-        Channel *listen_channel_;
-        TcpCallBack statecb_, readcb_;
+        struct Listener
+        {
+            EventBase *base_;
+            Channel *ch_;
+            TokenBucket bucket_;
+            bool paused_;       // 已暂停读，等待下一轮或令牌
+        };
+        std::deque<Listener> listeners_;
+        int backlog_;
+        int accept_budget_;
+        double accept_rate_;
+        int accept_burst_;
+        bool reject_over_rate_;
+        std::atomic<int64_t> accepted_;
+        std::atomic<int64_t> deferred_;
+        std::atomic<int64_t> rejected_;
+        size_t high_water_;
+        size_t low_water_;
+        size_t read_budget_;
+        size_t max_input_;
+        OverflowPolicy overflow_policy_;
+        bool deferred_flush_;
+        TcpCallBack statecb_, readcb_, highcb_, lowcb_;
         MsgCallBack msgcb_;
         std::function<TcpConnPtr()> createcb_;
         std::unique_ptr<CodecBase> codec_;
-        void handleAccept();
+        // 恢复接受连接的任务持有其弱引用，服务器析构后任务不再访问已删除的监听者
+        std::shared_ptr<bool> alive_;
+        int Listen(EventBase *base, bool reusePort, bool cpuSteering);
+        void handleAccept(Listener *l);
+        void PauseAccept(Listener *l, int64_t delayMs);
     };
 
 
@@ -1,22 +1,26 @@
 #include "epoll_poller.h"
+#include "uring_poller.h"
 #include "log.h"
 
 #include <sys/epoll.h>
 #include <cstring>
+#include <unistd.h>
 
 namespace net 
 {
-    EpollPoller::EpollPoller()
+    EpollPoller::EpollPoller(bool edge_triggered)
+        : edge_triggered_(edge_triggered)
     {
         fd_ = epoll_create1(EPOLL_CLOEXEC);
-        LOG_FMT_VERBOSE_MSG("epoll %d created\n", fd_);
+        LOG_FMT_VERBOSE_MSG("epoll %d created edge triggered %d\n", fd_, edge_triggered_);
     }
 
     EpollPoller::~EpollPoller()
     {
         LOG_FMT_VERBOSE_MSG("Destroying epoll %d\n", fd_);
         while (live_channels_.size())
-            (*live_channels_.begin())->Close();
+            live_channels_.begin()->first->Close();
+        ::close(fd_);
         LOG_FMT_VERBOSE_MSG("destroyed epoll %d\n", fd_);
     }
 
@@ -24,12 +28,15 @@ namespace net
     {
         struct epoll_event ev;
         memset(&ev, 0, sizeof(ev));
-        ev.events = ch->Events();
+        ev.events = edge_triggered_ ? (kReadEvent | kWriteEvent | EPOLLET) : ch->Events();
         ev.data.ptr = ch;
         LOG_FMT_VERBOSE_MSG("adding channel %lld Fd %d events %d epoll %d", (long long) ch->Id(), ch->Fd(), 
             ev.events, fd_);
         int r = epoll_ctl(fd_, EPOLL_CTL_ADD, ch->Fd(), &ev);
-        live_channels_.insert(ch);
+        if (r)
+            LOG_FMT_ERROR_MSG("epoll_ctl add failed %d %s", errno, strerror(errno));
+        ctl_count_++;
+        live_channels_[ch] = ch->Events();
     }
 
     void EpollPoller::UpdateChannel(Channel *ch) 
@@ -38,9 +45,29 @@ namespace net
         memset(&ev, 0, sizeof(ev));
         ev.events = ch->Events();
         ev.data.ptr = ch;
+        if (edge_triggered_) 
+        {
+            // 读由关闭变为开启时，期间的边沿可能已丢失，MOD会让内核重新检查可读状态
+            short &last = live_channels_[ch];
+            bool rearm = !(last & kReadEvent) && (ch->Events() & kReadEvent);
+            last = ch->Events();
+            if (!rearm)
+                return;
+            ev.events = kReadEvent | kWriteEvent | EPOLLET;
+        }
         LOG_FMT_VERBOSE_MSG("modifying channel %lld Fd %d events read %d write %d epoll %d", (long long) ch->Id(), 
             ch->Fd(), ev.events & POLLIN, ev.events & POLLOUT, fd_);
         epoll_ctl(fd_, EPOLL_CTL_MOD, ch->Fd(), &ev);
+        ctl_count_++;
+    }
+
+    // fd关闭时内核自动移除，不关闭fd时需显式删除，否则其事件仍会带着已释放的通道指针返回
+    void EpollPoller::DetachChannel(Channel *ch)
+    {
+        if (epoll_ctl(fd_, EPOLL_CTL_DEL, ch->Fd(), NULL))
+            LOG_FMT_ERROR_MSG("epoll_ctl del failed %d %s", errno, strerror(errno));
+        ctl_count_++;
+        RemoveChannel(ch);
     }
 
     void EpollPoller::RemoveChannel(Channel *ch) 
@@ -61,9 +88,11 @@ namespace net
 
     void EpollPoller::LoopOnce(int wait_ms) 
     {
-        int64_t ticks = util::TimeMilli();
+        int64_t ticks = util::CoarseMilli();
         last_active_ = epoll_wait(fd_, active_events_, kMaxEvents, wait_ms);
-        int64_t used = util::TimeMilli() - ticks;
+        Polled();
+        active_ = last_active_ > 0 ? last_active_ : 0;
+        int64_t used = util::CoarseMilli() - ticks;
         LOG_FMT_VERBOSE_MSG("epoll wait %d return %d errno %d used %lld millsecond", wait_ms, 
             last_active_, errno, (long long) used);
 
@@ -72,9 +101,35 @@ namespace net
             int i = last_active_;
             Channel *ch = (Channel *) active_events_[i].data.ptr;
             int events = active_events_[i].events;
-            if (ch) 
+            if (ch && edge_triggered_) 
             {
-                if (events & (kReadEvent | POLLERR)) 
+                // 边沿只报告一次，读写需要在同一轮中都处理
+                if (events & POLLERR)
+                {
+                    LOG_FMT_VERBOSE_MSG("channel %lld Fd %d handle error", (long long) ch->Id(), ch->Fd());
+                    ch->HandleError();
+                }
+                else if ((events & POLLHUP) || ((events & kReadEvent) && ch->ReadEnabled())) 
+                {
+                    LOG_FMT_VERBOSE_MSG("channel %lld Fd %d handle read", (long long) ch->Id(), ch->Fd());
+                    ch->HandleRead();
+                }
+                // 读回调中可能已关闭通道
+                ch = (Channel *) active_events_[i].data.ptr;
+                if (ch && (events & kWriteEvent) && ch->WriteEnabled()) 
+                {
+                    LOG_FMT_VERBOSE_MSG("channel %lld Fd %d handle write", (long long) ch->Id(), ch->Fd());
+                    ch->HandleWrite();
+                }
+            }
+            else if (ch) 
+            {
+                if (events & POLLERR)
+                {
+                    LOG_FMT_VERBOSE_MSG("channel %lld Fd %d handle error", (long long) ch->Id(), ch->Fd());
+                    ch->HandleError();
+                }
+                else if (events & kReadEvent) 
                 {
                     LOG_FMT_VERBOSE_MSG("channel %lld Fd %d handle read", (long long) ch->Id(), ch->Fd());
                     ch->HandleRead();
@@ -95,8 +150,19 @@ namespace net
 
 
 
-    PollerBase *CreatePoller()
+    PollerBase *CreatePoller(PollerMode mode)
     {
-         return new EpollPoller;
+        if (mode == PollerMode::MODE_URING_POLL || mode == PollerMode::MODE_URING_COMPLETION)
+        {
+            UringPoller *poller = new UringPoller(mode == PollerMode::MODE_URING_COMPLETION);
+            if (poller->Init())
+                return poller;
+
+            // 内核版本过低或io_uring被禁止(如容器的seccomp)时回退到语义相同的边沿触发epoll
+            LOG_WARNING_MSG("io_uring unavailable, fallback to edge triggered epoll");
+            delete poller;
+            mode = PollerMode::MODE_EPOLL_ET;
+        }
+        return new EpollPoller(mode == PollerMode::MODE_EPOLL_ET);
     }
-}
\ No newline at end of file
+}
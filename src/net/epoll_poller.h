@@ -3,25 +3,34 @@
 #include "poller.h"
 #include "channel.h"
 
-#include <unordered_set>
+#include <unordered_map>
 
 namespace net 
 {
+    /**
+     * @brief epoll实现的poller
+     *  边沿触发模式下通道在添加时一次性注册读写事件，之后开关读写只修改Channel的标记，
+     *  只有重新开启读时才需要EPOLL_CTL_MOD让内核重新报告当前的可读状态。
+     *  此模式下读回调需要读到EAGAIN为止，写回调在写到EAGAIN之后才会再次收到可写事件
+     */
     class EpollPoller : public PollerBase
     {
     public:
-        EpollPoller();
+        EpollPoller(bool edge_triggered = false);
         ~EpollPoller();
 
         void AddChannel(Channel *ch) override;
         void RemoveChannel(Channel *ch) override;
         void UpdateChannel(Channel *ch) override;
+        void DetachChannel(Channel *ch) override;
         void LoopOnce(int waitMs) override;
+        bool EdgeTriggered() override { return edge_triggered_; }
     private:
         int fd_;
+        bool edge_triggered_;
         struct epoll_event active_events_[kMaxEvents];
-        std::unordered_set<Channel*> live_channels_;
+        std::unordered_map<Channel*, short> live_channels_;    // 通道及其上一次的事件标记
     };
 
-    PollerBase *CreatePoller();
+    PollerBase *CreatePoller(PollerMode mode = PollerMode::MODE_EPOLL_LT);
 }
\ No newline at end of file
@@ -5,36 +5,228 @@
 #include "poller.h"
 #include "threads.h"
 #include "conn.h"
+#include "net.h"
+#include "timer.h"
 #include "concurrent_queue_impl.h"
+#include "conf.h"
+#include "idle_wheel.h"
+#include "mem_pool.h"
 
 #include <unordered_set>
+#include <thread>
 #include <map>
 #include <fcntl.h>
+#include <sys/eventfd.h>
+#include <sys/syscall.h>
+#include <linux/mempolicy.h>
+#include <pthread.h>
+#include <sched.h>
+#include <chrono>
+#include <random>
 
 namespace net 
 {
+    const int kTaskBatch = 128;         // 每次批量出队的任务数
+    const int kDefaultTaskBudget = 1024;
+    const int64_t kActiveMs = 1000;     // 负载均衡只迁移此时间内有数据到达的连接
+    const int64_t kPoolTrimMs = 1000;   // 内存池中空闲超过此时间的slab归还系统
+
+    static int64_t NowNano()
+    {
+        return std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::steady_clock::now().time_since_epoch()).count();
+    }
+
+    // 粗粒度时钟的精度，即一个时钟节拍，毫秒
+    static int64_t CoarseTickMs()
+    {
+        static const int64_t tick = [] {
+            struct timespec ts;
+            if (clock_getres(CLOCK_REALTIME_COARSE, &ts))
+                return static_cast<int64_t>(10);
+            return ts.tv_sec * 1000 + (ts.tv_nsec + 999999) / 1000000;
+        }();
+        return tick;
+    }
+
+    // 对数分桶的延迟直方图，每个2的幂区间再分4个子桶，误差不超过25%。只由事件循环线程写入
+    class LatencyHistogram
+    {
+    public:
+        LatencyHistogram()
+        {
+            for (auto &b : buckets_)
+                b = 0;
+        }
+
+        void Add(int64_t value)
+        {
+            uint64_t v = value > 0 ? value : 0;
+            buckets_[Index(v)].fetch_add(1, std::memory_order_relaxed);
+            count_.fetch_add(1, std::memory_order_relaxed);
+        }
+        int64_t Count() { return count_.load(std::memory_order_relaxed); }
+
+        // 返回percent分位所在桶的上界
+        int64_t Percentile(double percent)
+        {
+            int64_t total = Count();
+            if (total == 0)
+                return 0;
+
+            int64_t rank = static_cast<int64_t>(total * percent / 100);
+            int64_t seen = 0;
+            for (int i = 0; i < kBuckets; i++)
+            {
+                seen += buckets_[i].load(std::memory_order_relaxed);
+                if (seen > rank)
+                    return UpperBound(i);
+            }
+            return UpperBound(kBuckets - 1);
+        }
+    private:
+        static const int kBuckets = 62 * 4;
+
+        static int Index(uint64_t v)
+        {
+            if (v < 4)
+                return static_cast<int>(v);
+            int msb = 63 - __builtin_clzll(v);
+            return std::min(msb * 4 + static_cast<int>((v >> (msb - 2)) & 3) - 4, kBuckets - 1);
+        }
+        static int64_t UpperBound(int idx)
+        {
+            if (idx < 4)
+                return idx;
+            int msb = (idx + 4) / 4;
+            uint64_t sub = (idx + 4) % 4;
+            return static_cast<int64_t>(((4 + sub + 1) << (msb - 2)) - 1);
+        }
+    private:
+        std::atomic<int64_t> buckets_[kBuckets];
+        std::atomic<int64_t> count_{0};
+    };
+
     class EventsImp 
     {
     public:
-        EventsImp(EventBase *base, int task_capacity)
-            : base_(base), poller_(CreatePoller()), exit_(false),
-            next_timeout_(1 << 30),
-            timer_seq_(0), idle_enabled(false) {}
+        EventsImp(EventBase *base, int task_capacity, TimerMode timer_mode, PollerMode poller_mode)
+            : base_(base), poller_(CreatePoller(poller_mode)), timer_(CreateTimer(timer_mode)), timer_mode_(timer_mode), 
+            exit_(false), wakeup_fd_(-1), wakeup_pending_(false), next_timeout_(1 << 30), 
+            task_batch_(kTaskBatch), task_budget_(kDefaultTaskBudget), 
+            wakeup_sent_(0), wakeup_suppressed_(0), tasks_drained_(0), 
+            task_budget_exhausted_(0), busy_poll_us_(0), spinning_(false), spin_handoffs_(0),
+            wakeup_at_(0), now_(util::TimeMilli()), looping_(false), loop_thread_(std::thread::id()), pool_(new MemPool), pool_trim_at_(0), 
+            output_queued_(0), output_above_high_(0), output_high_hits_(0), 
+            connections_(0), busy_since_(0), lag_ns_(0), busy_ns_(0), deferred_sends_(0), deferred_flushes_(0), 
+            idle_enabled(false) {}
 
+        // wakeup_fd_由其Channel在poller析构时关闭。poller析构时关闭的连接会取消定时器，因此最后释放timer_
         ~EventsImp()
         {
+            // 关闭通道时加入的任务(如UdpConn::Close中的delete)在本线程中执行，否则泄漏
+            loop_thread_ = std::this_thread::get_id();
             delete poller_;
-            ::close(wakeup_fds_[1]);
+            while (RunPending())
+                ;
+            loop_thread_ = std::thread::id();
+            dirty_.clear();
+            ReleaseClosed();
+            delete timer_;
+            pool_->Release();
         }
 
         void Init();
-        void CallIdles();
-        IdleId RegisterIdle(int idle, const TcpConnPtr &conn, const TcpCallBack &cb);
-        void UnregisterIdle(const IdleId &id);
-        void UpdateIdle(const IdleId &id);
+        PollerBase *GetPoller() { return poller_; }
+        void HandleTasks();
+        void SetTaskBudget(int budget) { task_budget_ = budget; }
+        void SetBusyPoll(int spin_us) { busy_poll_us_ = spin_us; }
+        void Relocate();
+        MemPool *GetPool() { return pool_; }
+        // 首次使用时在事件循环线程中分配
+        char *ReadBuffer()
+        {
+            if (!read_buf_)
+                read_buf_.reset(new char[EventBase::kReadBufferSize]);
+            return read_buf_.get();
+        }
+        void ReportOutput(int64_t queued, int above, bool hit)
+        {
+            // 单一写者，不需要原子的读改写
+            output_queued_.store(output_queued_.load(std::memory_order_relaxed) + queued, std::memory_order_relaxed);
+            if (above)
+                output_above_high_.store(output_above_high_.load(std::memory_order_relaxed) + above, std::memory_order_relaxed);
+            if (above > 0 && hit)
+                output_high_hits_.store(output_high_hits_.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+        }
+        void AddConnections(int64_t delta) { connections_.fetch_add(delta, std::memory_order_relaxed); }
+        void AddConn(TcpConn *con)
+        {
+            attached_.insert(con);
+            AddConnections(1);
+        }
+        void RemoveConn(TcpConn *con)
+        {
+            attached_.erase(con);
+            AddConnections(-1);
+        }
+        // 把最近有数据到达的最多n个连接迁移到target，这些连接是本事件循环负载的主要来源
+        void MigrateActive(EventBase *target, int n)
+        {
+            int64_t since = Now() - kActiveMs;
+            for (TcpConn *con : attached_)
+            {
+                if (n <= 0)
+                    break;
+                // 迁移在本轮循环结束时进行，遍历期间attached_不变
+                if (con->sizer_.last_read_ >= since && con->MigrateTo(target))
+                    n--;
+            }
+        }
+        // 本轮循环从poller返回到处理完毕的耗时计入滑动平均，权重1/8
+        void UpdateLag()
+        {
+            int64_t since = busy_since_.load(std::memory_order_relaxed);
+            if (!since)
+                return;
+            int64_t busy = NowNano() - since;
+            int64_t lag = lag_ns_.load(std::memory_order_relaxed);
+            lag_ns_.store(lag + (busy - lag) / 8, std::memory_order_relaxed);
+            busy_ns_.store(busy_ns_.load(std::memory_order_relaxed) + busy, std::memory_order_relaxed);
+            busy_since_.store(0, std::memory_order_relaxed);
+        }
+        LoopLoad GetLoad()
+        {
+            LoopLoad load;
+            load.connections = connections_.load(std::memory_order_relaxed);
+            load.output_queued = output_queued_.load(std::memory_order_relaxed);
+            // 正在处理的一轮已经超过平均耗时的，按已耗时计算，使卡在耗时回调中的事件循环及时体现出来
+            int64_t lag = lag_ns_.load(std::memory_order_relaxed);
+            int64_t busy = busy_ns_.load(std::memory_order_relaxed);
+            int64_t since = busy_since_.load(std::memory_order_relaxed);
+            int64_t running = since ? NowNano() - since : 0;
+            load.lag_us = std::max(lag, running) / 1000;
+            // 读取busy_ns_与busy_since_之间本轮可能恰好结束，此时少计本轮的耗时，下次读取时补上
+            load.busy_us = (busy + running) / 1000;
+            return load;
+        }
+        int64_t Now() { return looping_.load(std::memory_order_relaxed) ? now_.load(std::memory_order_relaxed) : PreciseNow(); }
+        int64_t PreciseNow()
+        {
+            int64_t now = util::TimeMilli();
+            now_.store(now, std::memory_order_relaxed);
+            return now;
+        }
+        // 每轮poll后以粗粒度时钟更新缓存的时间，落后于PreciseNow存入的值时不回退
+        void CoarseNow()
+        {
+            int64_t now = util::CoarseTimeMilli();
+            if (now > now_.load(std::memory_order_relaxed))
+                now_.store(now, std::memory_order_relaxed);
+        }
+        void RegisterIdle(int idle, IdleNode *node);
         void HandleTimeouts();
         void RefreshNearest(const TimerId *tid = NULL);
-        void RepeatableTimeout(TimerRepeatable *tr);
 
         // eventbase functions
         EventBase &Exit() 
@@ -49,15 +241,134 @@ namespace net
             tasks_.Enqueue(std::move(task));
             Wakeup();
         }
+        bool IsInLoopThread() { return loop_thread_.load(std::memory_order_relaxed) == std::this_thread::get_id(); }
+        void QueueInLoop(Task &&task)
+        {
+            if (IsInLoopThread())
+                pending_.push_back(std::move(task));
+            else
+                SafeCall(std::move(task));
+        }
+        // 执行QueueInLoop加入的任务，执行期间加入的任务留到下一轮，避免反复加入自身的任务占住事件循环
+        bool RunPending()
+        {
+            if (pending_.empty())
+                return false;
+            running_.swap(pending_);
+            for (auto &task : running_)
+                task();
+            running_.clear();
+            return true;
+        }
+        // 延迟发送的连接，每轮只加入一次
+        void AddDirty(const TcpConnPtr &con) { dirty_.push_back(con); }
+        void CountDeferred() { deferred_sends_.store(deferred_sends_.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed); }
+        // 发送本轮标记的连接，发送中再次标记的留到下一轮
+        void FlushDirty()
+        {
+            if (dirty_.empty())
+                return;
+            flushing_.swap(dirty_);
+            for (auto &con : flushing_)
+            {
+                // 本轮已迁移的连接在交出前已发送
+                if (con->GetBase() == base_)
+                    con->FlushDeferred();
+            }
+            deferred_flushes_.store(deferred_flushes_.load(std::memory_order_relaxed) + flushing_.size(), 
+                std::memory_order_relaxed);
+            flushing_.clear();
+        }
         void Loop();
         void LoopOnce(int waitMs) 
         {
-            poller_->LoopOnce(std::min(waitMs, next_timeout_));
+            // 有待执行的本地任务或待发送的连接时不阻塞
+            bool block = pending_.empty() && dirty_.empty();
+            // 等待时间由定时任务决定时，按精确时间计算，否则粗粒度时钟落后的部分会推迟任务
+            if (block && next_timeout_ > 0 && next_timeout_ < waitMs)
+                next_timeout_ = timer_->NextTimeout(PreciseNow());
+            poller_->LoopOnce(block ? std::min(waitMs, next_timeout_) : 0);
             HandleTimeouts();
+            RunPending();
+            FlushDirty();
+            ReleaseClosed();
+            UpdateLag();
+            TrimPool();
         }
-        void Wakeup() 
+        // 每隔kPoolTrimMs整理一次内存池，释放持续空闲的slab
+        void TrimPool()
         {
-            write(wakeup_fds_[1], "", 1);
+            int64_t now = Now();
+            if (now < pool_trim_at_)
+                return;
+            pool_trim_at_ = now + kPoolTrimMs;
+            pool_->Trim();
+        }
+        // 等待重连的连接没有打开的通道，退出时单独清理
+        void AddReconnect(const TcpConnPtr &con) { reconnect_conns_.insert(con); }
+        void RemoveReconnect(const TcpConnPtr &con) { reconnect_conns_.erase(con); }
+        // 调用栈中的回调参数引用连接的self_，因此清理后的连接在本轮循环结束时才释放
+        void ReleaseLater(const TcpConnPtr &con) { closed_conns_.push_back(con); }
+        void ReleaseClosed()
+        {
+            for (auto &con : closed_conns_)
+                con->self_.reset();
+            closed_conns_.clear();
+        }
+        void BusyLoopOnce();
+        // 只有事件循环处理完上一次唤醒后的第一个调用者需要写eventfd，其余的唤醒被合并
+        void Wakeup()
+        {
+            // 记录这一批任务中第一次唤醒的时间，用于统计唤醒延迟
+            if (wakeup_at_.load(std::memory_order_relaxed) == 0)
+            {
+                int64_t expected = 0;
+                wakeup_at_.compare_exchange_strong(expected, NowNano(), std::memory_order_relaxed);
+            }
+            // 与BusyLoopOnce中停止自旋后的检查配对，保证入队的任务不会既没有唤醒也没有被自旋看到
+            if (busy_poll_us_ > 0)
+            {
+                std::atomic_thread_fence(std::memory_order_seq_cst);
+                if (spinning_.load(std::memory_order_relaxed))
+                {
+                    spin_handoffs_.fetch_add(1, std::memory_order_relaxed);
+                    return;
+                }
+            }
+            if (wakeup_pending_.exchange(true)) 
+            {
+                wakeup_suppressed_.fetch_add(1, std::memory_order_relaxed);
+                return;
+            }
+            wakeup_sent_.fetch_add(1, std::memory_order_relaxed);
+            eventfd_write(wakeup_fd_, 1);
+        }
+        EventStats GetStats() 
+        {
+            EventStats stats;
+            stats.wakeup_sent = wakeup_sent_.load(std::memory_order_relaxed);
+            stats.wakeup_suppressed = wakeup_suppressed_.load(std::memory_order_relaxed);
+            stats.tasks_drained = tasks_drained_.load(std::memory_order_relaxed);
+            stats.task_budget_exhausted = task_budget_exhausted_.load(std::memory_order_relaxed);
+            stats.poller_ctl = poller_->CtlCount();
+            stats.spin_handoffs = spin_handoffs_.load(std::memory_order_relaxed);
+            stats.wakeup_samples = wakeup_latency_.Count();
+            stats.wakeup_latency_p50 = wakeup_latency_.Percentile(50);
+            stats.wakeup_latency_p99 = wakeup_latency_.Percentile(99);
+            PoolStats pool = pool_->Stats();
+            stats.pool_allocs = pool.allocs;
+            stats.pool_hits = pool.hits;
+            stats.pool_in_use = pool.in_use;
+            stats.pool_resident = pool.resident;
+            stats.output_queued = output_queued_.load(std::memory_order_relaxed);
+            stats.output_above_high = output_above_high_.load(std::memory_order_relaxed);
+            stats.output_high_hits = output_high_hits_.load(std::memory_order_relaxed);
+            LoopLoad load = GetLoad();
+            stats.connections = load.connections;
+            stats.loop_lag_us = load.lag_us;
+            stats.deferred_sends = deferred_sends_.load(std::memory_order_relaxed);
+            stats.deferred_flushes = deferred_flushes_.load(std::memory_order_relaxed);
+            return stats;
         }
 
         bool Cancel(TimerId timerid);
@@ -66,139 +377,202 @@ namespace net
     private:
         EventBase *base_;
         PollerBase *poller_;
+        TimerBase *timer_;
+        TimerMode timer_mode_;
         std::atomic<bool> exit_;
-        int wakeup_fds_[2];
+        int wakeup_fd_;
+        std::atomic<bool> wakeup_pending_;  // 已写eventfd但事件循环尚未处理
         int next_timeout_;
         ConcurrentQueue<Task> tasks_;
+        std::vector<Task> task_batch_;      // 批量出队的缓冲区，循环复用
+        int task_budget_;
+        std::atomic<int64_t> wakeup_sent_;
+        std::atomic<int64_t> wakeup_suppressed_;
+        std::atomic<int64_t> tasks_drained_;
+        std::atomic<int64_t> task_budget_exhausted_;
+        std::atomic<int> busy_poll_us_;     // 忙轮询的自旋时长，0为关闭
+        std::atomic<bool> spinning_;        // 事件循环正在忙轮询，会主动检查任务队列
+        std::atomic<int64_t> spin_handoffs_;
+        std::atomic<int64_t> wakeup_at_;    // 尚未处理的第一次唤醒的时间，纳秒，0表示没有
+        LatencyHistogram wakeup_latency_;
+        std::atomic<int64_t> now_;          // 本轮循环缓存的时间，毫秒
+        std::atomic<bool> looping_;
+        std::atomic<std::thread::id> loop_thread_;  // 执行Loop的线程
+        std::vector<Task> pending_;         // QueueInLoop加入的任务，只由事件循环线程访问
+        std::vector<Task> running_;         // 正在执行的pending_，循环复用
+        MemPool *pool_;
+        int64_t pool_trim_at_;              // 下次整理内存池的时间
+        std::unique_ptr<char[]> read_buf_;
+        // 只由事件循环线程修改，其他线程读取统计
+        std::atomic<int64_t> output_queued_;
+        std::atomic<int64_t> output_above_high_;
+        std::atomic<int64_t> output_high_hits_;
+        std::atomic<int64_t> connections_;  // 可由交接连接的其他线程修改
+        std::atomic<int64_t> busy_since_;   // 本轮循环poller返回的时间，纳秒，阻塞等待时为0
+        std::atomic<int64_t> lag_ns_;
+        std::atomic<int64_t> busy_ns_;      // 累计处理事件的时间
+        std::unordered_set<TcpConn *> attached_;    // 挂接在本事件循环的连接
+        std::atomic<int64_t> deferred_sends_;
+        std::atomic<int64_t> deferred_flushes_;
+        std::vector<TcpConnPtr> dirty_;     // 延迟发送、在本轮结束时发送的连接
+        std::vector<TcpConnPtr> flushing_;  // 正在发送的dirty_，循环复用
 
-        std::map<TimerId, TimerRepeatable> timer_reps_;
-        std::map<TimerId, Task> timers_;
-        std::atomic<int64_t> timer_seq_;
-        // 记录每个idle时间（单位秒）下所有的连接。链表中的所有连接，最新的插入到链表末尾。连接若有活动，
-        // 会把连接从链表中移到链表尾部，做法参考memcache
-        std::unordered_map<int, std::list<IdleNode>> idle_conns_;
+        // 空闲检测的连接，节点嵌入在TcpConn中，连接有活动时只更新节点的活动时间
+        IdleWheel idle_wheel_;
         std::unordered_set<TcpConnPtr> reconnect_conns_;
+        std::vector<TcpConnPtr> closed_conns_;
         bool idle_enabled;
     };
 
 
     void EventsImp::Init()
     {
-        int ret = pipe(wakeup_fds_);
-        ret = util::AddFdFlag(wakeup_fds_[0], FD_CLOEXEC);
-        
-        ret = util::AddFdFlag(wakeup_fds_[1], FD_CLOEXEC);
-        LOG_FMT_VERBOSE_MSG("wakeup pipe created %d %d", wakeup_fds_[0], wakeup_fds_[1]);
-        Channel *channel = new Channel(base_, wakeup_fds_[0], kReadEvent);
+        wakeup_fd_ = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        if (wakeup_fd_ < 0)
+            LOG_FMT_FATAL_MSG("eventfd create failed %d %s", errno, strerror(errno));
+        LOG_FMT_VERBOSE_MSG("wakeup eventfd created %d", wakeup_fd_);
+        poller_->OnPolled([this] 
+        { 
+            CoarseNow(); 
+            busy_since_.store(NowNano(), std::memory_order_relaxed);
+        });
+        Channel *channel = new Channel(base_, wakeup_fd_, kReadEvent);
         channel->OnRead([=] {
-            char buf[1024];
-            int r = channel->Fd() >= 0 ? ::read(channel->Fd(), buf, sizeof buf) : 0;
-            if (r > 0) 
-            {
-                Task task;
-                while (tasks_.TryDequeue(task))
-                    task();
-            } 
-            else if (r == 0) 
+            eventfd_t val;
+            int r = channel->Fd() >= 0 ? eventfd_read(channel->Fd(), &val) : -1;
+            if (channel->Fd() < 0) 
                 delete channel;
+            else if (r == 0 || errno == EAGAIN) 
+                HandleTasks();
             else 
                 LOG_FMT_FATAL_MSG("wakeup channel read error %d %d %s", r, errno, strerror(errno));
         });
     }
 
 
-    void EventsImp::CallIdles() 
+    void EventsImp::HandleTasks() 
     {
-        int64_t now = util::TimeMilli() / 1000;
-        for (auto &l : idle_conns_) 
+        // 先清除标记再取任务，之后入队的任务会重新唤醒
+        wakeup_pending_ = false;
+        int64_t wakeup_at = wakeup_at_.exchange(0, std::memory_order_relaxed);
+        if (wakeup_at)
+            wakeup_latency_.Add(NowNano() - wakeup_at);
+        size_t drained = 0;
+        size_t budget = task_budget_ > 0 ? task_budget_ : SIZE_MAX;
+        while (drained < budget) 
         {
-            int idle = l.first;
-            auto& lst = l.second;
-            while (lst.size()) 
+            size_t n = tasks_.TryDequeueBulk(task_batch_.begin(), std::min(task_batch_.size(), budget - drained));
+            for (size_t i = 0; i < n; i++) 
             {
-                IdleNode &node = lst.front();
-                if (node.updated_ + idle > now) 
-                    break;
-                
-                node.updated_ = now;
-                lst.splice(lst.end(), lst, lst.begin());
-                node.callback_(node.conn_);
+                Task task = std::move(task_batch_[i]);
+                task();
             }
+            drained += n;
+            if (n < task_batch_.size())
+                break;
+        }
+        tasks_drained_.store(drained, std::memory_order_relaxed);
+
+        // 超出预算的任务留到下一轮，先处理IO与定时器
+        if (drained >= budget && tasks_.SizeApprox()) 
+        {
+            task_budget_exhausted_.fetch_add(1, std::memory_order_relaxed);
+            Wakeup();
         }
     }
 
 
-    IdleId EventsImp::RegisterIdle(int idle, const TcpConnPtr &con, const TcpCallBack &cb) 
+    void EventsImp::RegisterIdle(int idle, IdleNode *node) 
     {
         if (!idle_enabled) 
         {
-            base_->RunAfter(1000, [this] { CallIdles(); }, 1000);
+            base_->RunAfter(1000, [this] { idle_wheel_.Advance(Now() / 1000); }, 1000);
             idle_enabled = true;
         }
-        auto &lst = idle_conns_[idle];
-        lst.push_back(IdleNode{con, util::TimeMilli() / 1000, std::move(cb)});
+        idle_wheel_.Add(node, idle, Now() / 1000);
         LOG_VERBOSE_MSG("register idle");
-        return IdleId(new IdleIdImp(&lst, --lst.end()));
     }
 
-
-    void EventsImp::UnregisterIdle(const IdleId &id) 
+    void EventsImp::HandleTimeouts() 
     {
-        LOG_VERBOSE_MSG("unregister idle");
-        id->list_->erase(id->iter_);
+        // 缓存的粗粒度时间最多落后一个节拍，一个节拍内有定时任务到期时读取精确时间，避免任务推迟一个节拍
+        if (timer_->NextTimeout(Now()) <= CoarseTickMs())
+            PreciseNow();
+        timer_->HandleTimeouts(Now());
+        RefreshNearest();
     }
 
-
-    void EventsImp::UpdateIdle(const IdleId &id) 
+    void EventsImp::RefreshNearest(const TimerId *tid) 
     {
-        LOG_VERBOSE_MSG("update idle");
-        id->iter_->updated_ = util::TimeMilli() / 1000;
-        id->list_->splice(id->list_->end(), *id->list_, id->iter_);
+        next_timeout_ = timer_->NextTimeout(Now());
     }
 
-    void EventsImp::HandleTimeouts() 
+
+    // 在事件循环线程中调用，重新分配构造时由其他线程分配的结构，使其位于本线程的NUMA节点
+    void EventsImp::Relocate()
     {
-        int64_t now = util::TimeMilli();
-        TimerId tid{now, 1L << 62};
-        while (timers_.size() && timers_.begin()->first < tid) 
+        if (timer_->Size() == 0)
         {
-            Task task = std::move(timers_.begin()->second);
-            timers_.erase(timers_.begin());
-            task();
+            delete timer_;
+            timer_ = CreateTimer(timer_mode_);
         }
-        RefreshNearest();
+        std::vector<Task>(kTaskBatch).swap(task_batch_);
     }
 
-    void EventsImp::RefreshNearest(const TimerId *tid) 
+
+    void EventsImp::BusyLoopOnce()
     {
-        if (timers_.empty())
-            next_timeout_ = 1 << 30;
-        else 
+        int64_t spin_us = busy_poll_us_;
+        int64_t deadline = util::TimeMicro() + spin_us;
+        spinning_.store(true, std::memory_order_relaxed);
+        while (!exit_)
         {
-            const TimerId &t = timers_.begin()->first;
-            next_timeout_ = t.first - util::TimeMilli();
-            next_timeout_ = next_timeout_ < 0 ? 0 : next_timeout_;
+            poller_->LoopOnce(0);
+            HandleTimeouts();
+            bool active = RunPending();
+            FlushDirty();
+            ReleaseClosed();
+            UpdateLag();
+            TrimPool();
+            active = poller_->Active() > 0 || active;
+            if (tasks_.SizeApprox())
+            {
+                HandleTasks();
+                active = true;
+            }
+            int64_t now = util::TimeMicro();
+            if (active)
+                deadline = now + spin_us;
+            else if (now >= deadline)
+                break;
         }
-    }
-
+        spinning_.store(false, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
 
-    void EventsImp::RepeatableTimeout(TimerRepeatable *tr) 
-    {
-        tr->at += tr->interval;
-        tr->timerid = {tr->at, ++timer_seq_};
-        timers_[tr->timerid] = [this, tr] { RepeatableTimeout(tr); };
-        RefreshNearest(&tr->timerid);
-        tr->cb();
+        // 停止自旋前入队的任务，其生产者可能没有写eventfd，阻塞前需要处理
+        if (tasks_.SizeApprox())
+            HandleTasks();
+        else if (!exit_)
+            LoopOnce(10000);
     }
 
 
-    void EventsImp::Loop() 
+    void EventsImp::Loop()
     {
+        PreciseNow();
+        looping_ = true;
+        loop_thread_ = std::this_thread::get_id();
+        // 循环期间本线程从本事件循环的内存池分配
+        pool_->Bind();
         while (!exit_)
-            LoopOnce(10000);
-        timer_reps_.clear();
-        timers_.clear();
-        idle_conns_.clear();
+        {
+            if (busy_poll_us_ > 0)
+                BusyLoopOnce();
+            else
+                LoopOnce(10000);
+        }
+        timer_->Clear();
+        idle_wheel_.Clear();
 
         //重连的连接无法通过channel清理，因此单独清理
         for (auto recon : reconnect_conns_) 
@@ -206,59 +580,562 @@ namespace net
             recon->Cleanup(recon);
         }
         LoopOnce(0);
+        // 任务中加入的任务留到下一轮，退出时执行到没有为止
+        while (RunPending())
+            ;
+        pool_->Unbind();
+        looping_ = false;
+        loop_thread_ = std::thread::id();
     }
 
 
     bool EventsImp::Cancel(TimerId timerid) 
     {
-        if (timerid.first < 0) 
+        return timer_->Cancel(timerid);
+    }
+
+
+    TimerId EventsImp::RunAt(int64_t milli, Task &&task, int64_t interval) 
+    {
+        if (exit_) 
+            return TimerId();
+        
+        TimerId tid = timer_->RunAt(milli, std::move(task), interval);
+        RefreshNearest(&tid);
+        return tid;
+    }
+
+
+
+
+    EventBase::EventBase(int taskCapacity, TimerMode timerMode, PollerMode pollerMode) 
+    {
+        imp_.reset(new EventsImp(this, taskCapacity, timerMode, pollerMode));
+        imp_->Init();
+    }
+
+    EventBase::~EventBase() {}
+
+    EventBase &EventBase::Exit() 
+    {
+        return imp_->Exit();
+    }
+
+    bool EventBase::Exited() 
+    {
+        return imp_->Exited();
+    }
+
+    void EventBase::SafeCall(Task &&task) 
+    {
+        imp_->SafeCall(std::move(task));
+    }
+
+    bool EventBase::IsInLoopThread()
+    {
+        return imp_->IsInLoopThread();
+    }
+
+    void EventBase::RunInLoop(Task &&task)
+    {
+        if (imp_->IsInLoopThread())
+            task();
+        else
+            imp_->SafeCall(std::move(task));
+    }
+
+    void EventBase::QueueInLoop(Task &&task)
+    {
+        imp_->QueueInLoop(std::move(task));
+    }
+
+    void EventBase::Wakeup() 
+    {
+        imp_->Wakeup();
+    }
+
+    void EventBase::SetTaskBudget(int budget) 
+    {
+        imp_->SetTaskBudget(budget);
+    }
+
+    // 解析"0-3,8"格式的CPU列表
+    static int ParseCpuList(const std::string &str, std::vector<int> *cpus)
+    {
+        const char *p = str.c_str();
+        while (*p)
         {
-            auto it = timer_reps_.find(timerid);
-            auto ptimer = timers_.find(it->second.timerid);
-            if (ptimer != timers_.end()) 
-                timers_.erase(ptimer);
-            
-            timer_reps_.erase(it);
-            return true;
-        } 
-        else 
+            char *end;
+            long first = strtol(p, &end, 10);
+            long last = first;
+            if (end == p || first < 0)
+                return -1;
+            p = end;
+            if (*p == '-')
+            {
+                last = strtol(++p, &end, 10);
+                if (end == p || last < first)
+                    return -1;
+                p = end;
+            }
+            for (long cpu = first; cpu <= last; cpu++)
+                cpus->push_back(static_cast<int>(cpu));
+            if (*p == ',')
+                p++;
+            else if (*p)
+                return -1;
+        }
+        return cpus->empty() ? -1 : 0;
+    }
+
+
+    MultiBase &MultiBase::SetAffinity(const std::vector<std::vector<int>> &cpus, bool numaLocal)
+    {
+        affinity_ = cpus;
+        numa_local_ = numaLocal;
+        return *this;
+    }
+
+
+    int MultiBase::LoadConf(Configure &conf, const std::string &section)
+    {
+        std::vector<std::vector<int>> cpus;
+        for (auto &line : conf.GetStrings(section, "affinity"))
+        {
+            std::vector<int> set;
+            if (ParseCpuList(line, &set) < 0)
+            {
+                LOG_FMT_ERROR_MSG("invalid cpu list '%s' in %s", line.c_str(), conf.filename_.c_str());
+                return -1;
+            }
+            cpus.push_back(std::move(set));
+        }
+        SetAffinity(cpus, conf.GetBoolean(section, "numa_local", true));
+        SetRebalance(conf.GetInteger(section, "rebalance_ms", 0), conf.GetReal(section, "rebalance_threshold", 0.2));
+
+        static const std::pair<const char *, DistributeMode> kModes[] = {
+            {"round_robin", DistributeMode::MODE_ROUND_ROBIN},
+            {"least_conns", DistributeMode::MODE_LEAST_CONNS},
+            {"least_queued", DistributeMode::MODE_LEAST_QUEUED},
+            {"two_choices", DistributeMode::MODE_TWO_CHOICES},
+        };
+        std::string mode = conf.Get(section, "distribute", "round_robin");
+        for (auto &m : kModes)
         {
-            auto p = timers_.find(timerid);
-            if (p != timers_.end()) 
+            if (mode == m.first)
             {
-                timers_.erase(p);
-                return true;
+                SetDistribution(m.second);
+                return 0;
             }
-            return false;
         }
+        LOG_FMT_ERROR_MSG("invalid distribute mode '%s' in %s", mode.c_str(), conf.filename_.c_str());
+        return -1;
     }
 
 
-    TimerId EventsImp::RunAt(int64_t milli, Task &&task, int64_t interval) 
+    MultiBase &MultiBase::SetDistribution(DistributeMode mode)
     {
-        if (exit_) 
-            return TimerId();
-        
-        if (interval) 
+        mode_ = mode;
+        distribute_ = nullptr;
+        return *this;
+    }
+
+    MultiBase &MultiBase::SetDistribution(DistributeFunc &&fn)
+    {
+        distribute_ = std::move(fn);
+        return *this;
+    }
+
+    MultiBase &MultiBase::SetRebalance(int intervalMs, double threshold, int maxMoves)
+    {
+        rebalance_ms_ = intervalMs;
+        rebalance_threshold_ = threshold;
+        rebalance_moves_ = maxMoves;
+        return *this;
+    }
+
+    void MultiBase::Rebalance()
+    {
+        size_t n = bases_.size();
+        std::vector<int64_t> last(n);
+        for (size_t i = 0; i < n; i++)
+            last[i] = bases_[i].GetLoad().busy_us;
+        int64_t at = util::TimeMicro();
+        // 迁移任务在最忙的事件循环中可能排队较久，执行前及执行后的一个周期内负载数据不反映迁移的结果
+        auto moving = std::make_shared<std::atomic<bool>>(false);
+        bool settle = false;
+        while (!bases_[0].Exited())
+        {
+            // 分段睡眠以便及时退出
+            for (int slept = 0; slept < rebalance_ms_ && !bases_[0].Exited(); slept += 100)
+                usleep(std::min(100, rebalance_ms_ - slept) * 1000);
+            int64_t now = util::TimeMicro();
+            int64_t elapsed = now - at;
+            at = now;
+            if (elapsed <= 0 || bases_[0].Exited())
+                continue;
+
+            std::vector<LoopLoad> loads(n);
+            std::vector<double> usage(n);
+            size_t hi = 0, lo = 0;
+            for (size_t i = 0; i < n; i++)
+            {
+                loads[i] = bases_[i].GetLoad();
+                usage[i] = static_cast<double>(loads[i].busy_us - last[i]) / elapsed;
+                last[i] = loads[i].busy_us;
+                if (usage[i] > usage[hi])
+                    hi = i;
+                if (usage[i] < usage[lo])
+                    lo = i;
+            }
+            if (moving->load(std::memory_order_acquire))
+            {
+                settle = true;
+                continue;
+            }
+            if (settle)
+            {
+                settle = false;
+                continue;
+            }
+            if (usage[hi] - usage[lo] < rebalance_threshold_)
+                continue;
+            // 按连接平均分担负载估算，迁移后两者各承担差值的一半。单个连接占满时迁移只会转移热点，不迁移
+            int moves = static_cast<int>(loads[hi].connections * (usage[hi] - usage[lo]) / (2 * usage[hi]));
+            if (moves <= 0)
+                continue;
+            if (moves > rebalance_moves_)
+                moves = rebalance_moves_;
+            LOG_FMT_DEBUG_MSG("rebalance %d conns from loop %d (%.2f) to loop %d (%.2f)", moves, 
+                static_cast<int>(hi), usage[hi], static_cast<int>(lo), usage[lo]);
+            EventBase *from = &bases_[hi], *to = &bases_[lo];
+            moving->store(true, std::memory_order_relaxed);
+            settle = true;
+            from->SafeCall([from, to, moves, moving] 
+            { 
+                from->imp_->MigrateActive(to, moves);
+                moving->store(false, std::memory_order_release);
+            });
+        }
+    }
+
+    template <class Key>
+    EventBase *MultiBase::Least(Key key)
+    {
+        size_t n = bases_.size();
+        size_t start = static_cast<unsigned>(id_++) % n;
+        EventBase *best = &bases_[start];
+        int64_t least = key(best->GetLoad());
+        for (size_t i = 1; i < n; i++)
+        {
+            EventBase *b = &bases_[(start + i) % n];
+            int64_t k = key(b->GetLoad());
+            if (k < least)
+            {
+                least = k;
+                best = b;
+            }
+        }
+        return best;
+    }
+
+    EventBase *MultiBase::AllocBase()
+    {
+        if (distribute_)
+            return distribute_(this);
+        size_t n = bases_.size();
+        switch (mode_)
         {
-            TimerId tid{-milli, ++timer_seq_};
-            TimerRepeatable &rtr = timer_reps_[tid];
-            rtr = {milli, interval, {milli, ++timer_seq_}, std::move(task)};
-            TimerRepeatable *tr = &rtr;
-            timers_[tr->timerid] = [this, tr] { RepeatableTimeout(tr); };
-            RefreshNearest(&tr->timerid);
-            return tid;
-        } 
-        else 
+        case DistributeMode::MODE_LEAST_CONNS:
+            return Least([](const LoopLoad &l) { return l.connections; });
+        case DistributeMode::MODE_LEAST_QUEUED:
+            return Least([](const LoopLoad &l) { return l.output_queued; });
+        case DistributeMode::MODE_TWO_CHOICES:
         {
-            TimerId tid{milli, ++timer_seq_};
-            timers_.insert({tid, std::move(task)});
-            RefreshNearest(&tid);
-            return tid;
+            // 只比较随机的两个，同一批分配不会都落到同一个事件循环，负载计数也只需读两次
+            if (n == 1)
+                return &bases_[0];
+            thread_local std::minstd_rand rng(static_cast<unsigned>(NowNano()));
+            size_t i = rng() % n;
+            size_t j = (i + 1 + rng() % (n - 1)) % n;
+            // 取循环延迟较低者，延迟相同(如都空闲)时取连接数少的
+            LoopLoad a = bases_[i].GetLoad(), b = bases_[j].GetLoad();
+            if (a.lag_us != b.lag_us)
+                return &bases_[a.lag_us < b.lag_us ? i : j];
+            return &bases_[a.connections <= b.connections ? i : j];
         }
+        default:
+            return &bases_[static_cast<unsigned>(id_++) % n];
+        }
+    }
+
+
+    void MultiBase::Loop()
+    {
+        auto run = [this](int i) {
+            if (affinity_.size())
+            {
+                cpu_set_t set;
+                CPU_ZERO(&set);
+                for (int cpu : affinity_[i % affinity_.size()])
+                    CPU_SET(cpu, &set);
+                int r = pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+                if (r)
+                    LOG_FMT_ERROR_MSG("set affinity of loop %d failed %d %s", i, r, strerror(r));
+                // 绑定CPU后默认的首次访问分配即在本节点，显式设置以覆盖进程级的交叉分配等策略
+                if (numa_local_)
+                {
+                    if (syscall(SYS_set_mempolicy, MPOL_LOCAL, NULL, 0) < 0)
+                        LOG_FMT_WARNING_MSG("set_mempolicy of loop %d failed %d %s", i, errno, strerror(errno));
+                    bases_[i].imp_->Relocate();
+                }
+            }
+            bases_[i].Loop();
+        };
+
+        int sz = static_cast<int>(bases_.size());
+        std::vector<std::thread> ths;
+        for (int i = 0; i < sz - 1; i++)
+            ths.emplace_back(run, i);
+        if (rebalance_ms_ > 0 && sz > 1)
+            ths.emplace_back([this] { Rebalance(); });
+        run(sz - 1);
+        for (auto &t : ths)
+            t.join();
+    }
+
+
+
+
+    void TcpConn::AddIdleCB(int idle, const TcpCallBack &cb)
+    {
+        if (!channel_)
+            return;
+        idle_node_.callback_ = [this, cb] {
+            // 回调中连接可能被关闭，持有引用直到回调返回
+            TcpConnPtr con = shared_from_this();
+            cb(con);
+        };
+        RegisterIdle(idle);
+    }
+
+    void TcpConn::ReleaseSelf()
+    {
+        GetBase()->imp_->ReleaseLater(self_);
+    }
+
+    void TcpConn::Reconnect()
+    {
+        TcpConnPtr con = shared_from_this();
+        EventBase *base = GetBase();
+        base->imp_->AddReconnect(con);
+        // 从上次连接开始计算间隔，连接很快断开时不会立即反复重连
+        int64_t interval = reconnect_interval_ - (base->Now() - connected_time_);
+        interval = interval > 0 ? interval : 0;
+        LOG_FMT_INFO_MSG("reconnect interval: %d will reconnect after %lld ms", reconnect_interval_, (long long) interval);
+        base->RunAfter(interval, [con, base] {
+            base->imp_->RemoveReconnect(con);
+            // 已关闭的通道保留到Attach时释放，连接数沿用原有的计数
+            con->Connect(base, con->destHost_, static_cast<unsigned short>(con->destPort_), con->connect_timeout_, 
+                con->localIp_);
+        });
+    }
+
+    void TcpConn::ReportOutput(int64_t queued, int above, bool hit)
+    {
+        GetBase()->imp_->ReportOutput(queued, above, hit);
+    }
+
+    void TcpConn::LinkLoop()
+    {
+        GetBase()->imp_->AddConn(this);
+    }
+
+    void TcpConn::UnlinkLoop()
+    {
+        GetBase()->imp_->RemoveConn(this);
+    }
+
+    void TcpConn::RegisterIdle(int idle)
+    {
+        GetBase()->imp_->RegisterIdle(idle, &idle_node_);
+    }
+
+    void TcpConn::MarkDirty()
+    {
+        EventsImp *imp = GetBase()->imp_.get();
+        imp->CountDeferred();
+        if (!deferred_.dirty_)
+        {
+            deferred_.dirty_ = true;
+            imp->AddDirty(self_);
+        }
+    }
+
+    bool TcpConn::Completion(EventBase *base)
+    {
+        return base->imp_->GetPoller()->Completion();
+    }
+
+    LoopLoad EventBase::GetLoad()
+    {
+        return imp_->GetLoad();
     }
 
+    void EventBase::AddConnections(int64_t delta)
+    {
+        imp_->AddConnections(delta);
+    }
+
+    int64_t EventBase::Now()
+    {
+        return imp_->Now();
+    }
+
+    int64_t EventBase::PreciseNow()
+    {
+        return imp_->PreciseNow();
+    }
+
+    void EventBase::SetBusyPoll(int spinUs)
+    {
+        imp_->SetBusyPoll(spinUs);
+    }
+
+    EventStats EventBase::GetStats() 
+    {
+        return imp_->GetStats();
+    }
+
+    MemPool *EventBase::GetPool()
+    {
+        return imp_->GetPool();
+    }
+
+    const size_t EventBase::kReadBufferSize;
+
+    char *EventBase::ReadBuffer()
+    {
+        return imp_->ReadBuffer();
+    }
+
+    void EventBase::Loop() 
+    {
+        imp_->Loop();
+    }
+
+    void EventBase::LoopOnce(int waitMs) 
+    {
+        imp_->LoopOnce(waitMs);
+    }
+
+    bool EventBase::Cancel(TimerId timerid) 
+    {
+        return imp_ && imp_->Cancel(timerid);
+    }
+
+    TimerId EventBase::RunAt(int64_t milli, Task &&task, int64_t interval) 
+    {
+        return imp_->RunAt(milli, std::move(task), interval);
+    }
+
+
 
 
+    void *Channel::operator new(size_t size, EventBase *base)
+    {
+        return MemPool::Allocate(base->GetPool(), size);
+    }
+
+    Channel::Channel(EventBase *base, int fd, int events) 
+        : base_(base), fd_(fd), events_(events), handler_(NULL), send_queued_(0), duplicated_(false) 
+    {
+        if (SetNonBlock(fd_) < 0)
+            LOG_FMT_FATAL_MSG("channel set non block failed %d %s", errno, strerror(errno));
+        static std::atomic<int64_t> id(0);
+        id_ = ++id;
+        poller_ = base_->imp_->GetPoller();
+        poller_->AddChannel(this);
+    }
 
+    Channel::~Channel() 
+    {
+        Close();
+    }
+
+    void Channel::EnableRead(bool enable) 
+    {
+        EnableReadWrite(enable, WriteEnabled());
+    }
+
+    void Channel::EnableWrite(bool enable) 
+    {
+        EnableReadWrite(ReadEnabled(), enable);
+    }
+
+    void Channel::EnableReadWrite(bool readable, bool writable) 
+    {
+        short events = (readable ? kReadEvent : 0) | (writable ? kWriteEvent : 0);
+        if (events == events_)
+            return;
+        events_ = events;
+        poller_->UpdateChannel(this);
+    }
+
+    bool Channel::ReadEnabled() 
+    {
+        return events_ & kReadEvent;
+    }
+
+    bool Channel::WriteEnabled() 
+    {
+        return events_ & kWriteEvent;
+    }
+
+    bool Channel::EdgeTriggered()
+    {
+        return poller_->EdgeTriggered();
+    }
+
+    bool Channel::Completion()
+    {
+        return poller_->Completion();
+    }
+
+    void Channel::StartRecv()
+    {
+        poller_->StartRecv(this);
+    }
+
+    bool Channel::SubmitSend(const char *buf, size_t len)
+    {
+        return poller_->SubmitSend(this, buf, len);
+    }
+
+    int Channel::Detach()
+    {
+        int fd = fd_;
+        if (fd_ >= 0)
+        {
+            LOG_FMT_VERBOSE_MSG("detach channel %lld fd %d", (long long) id_, fd_);
+            poller_->DetachChannel(this);
+            fd_ = -1;
+        }
+        return fd;
+    }
+
+    void Channel::Close() 
+    {
+        if (fd_ >= 0) 
+        {
+            LOG_FMT_VERBOSE_MSG("close channel %lld fd %d", (long long) id_, fd_);
+            if (duplicated_)
+                poller_->DetachChannel(this);
+            else
+                poller_->RemoveChannel(this);
+            ::close(fd_);
+            fd_ = -1;
+            HandleRead();
+        }
+    }
 }
\ No newline at end of file
@@ -8,6 +8,8 @@
 #include <atomic>
 #include <functional>
 #include <utility>
+#include <string>
+#include <vector>
 
 
 struct TcpConn;
@@ -19,34 +21,108 @@ struct Slice;
 namespace net 
 {
     using Task = std::function<void()>;
-    struct IdleIdImp;
 
     using TimerId = std::pair<int64_t, int64_t>;
-    using IdleId = std::unique_ptr<IdleIdImp>;
+
+    enum class TimerMode
+    {
+        MODE_MAP,       // std::map存储定时任务，插入、取消为O(logn)
+        MODE_WHEEL      // 分层时间轮，插入、取消为O(1)
+    };
+
+    enum class PollerMode
+    {
+        MODE_EPOLL_LT,  // epoll水平触发
+        MODE_EPOLL_ET,  // epoll边沿触发，读写事件只注册一次
+        MODE_URING_POLL,        // io_uring multishot poll，语义同边沿触发
+        MODE_URING_COMPLETION   // io_uring完成模式，TcpConn的收发由内核直接完成
+    };
+
+    // MultiBase分配事件循环的方式
+    enum class DistributeMode
+    {
+        MODE_ROUND_ROBIN,       // 依次轮流分配
+        MODE_LEAST_CONNS,       // 连接数最少的事件循环
+        MODE_LEAST_QUEUED,      // 待发送字节数最少的事件循环
+        MODE_TWO_CHOICES        // 随机取两个事件循环，选循环延迟(LoopLoad::lag_us)较低者，相同时选连接数少的
+    };
+
+    // 事件循环的负载，各项为原子计数，可在任意线程读取
+    struct LoopLoad
+    {
+        int64_t connections;    // 挂接的连接数，含正在交接给本事件循环的连接
+        int64_t output_queued;  // 各连接已提交但尚未写入内核的字节数
+        int64_t lag_us;         // 每轮循环处理事件耗时的滑动平均，微秒，即新任务平均需要等待的时间
+        int64_t busy_us;        // 累计处理事件的时间，微秒，两次读取的差值除以间隔即为利用率
+    };
     
+    // 事件循环的统计信息
+    struct EventStats 
+    {
+        int64_t wakeup_sent;        // 实际写eventfd的唤醒次数
+        int64_t wakeup_suppressed;  // 已有唤醒待处理而被合并的次数
+        int64_t tasks_drained;      // 最近一轮处理的跨线程任务数
+        int64_t task_budget_exhausted;  // 任务数超出预算、剩余任务推迟到下一轮的次数
+        int64_t poller_ctl;         // epoll_ctl等注册事件的系统调用次数
+        int64_t spin_handoffs;      // 事件循环忙轮询中、无需写eventfd的唤醒次数
+        int64_t wakeup_samples;     // 唤醒延迟的采样数
+        int64_t wakeup_latency_p50; // 从唤醒到开始处理任务的延迟，纳秒
+        int64_t wakeup_latency_p99;
+        int64_t pool_allocs;        // 内存池的分配次数，命中率为pool_hits / pool_allocs
+        int64_t pool_hits;
+        int64_t pool_in_use;        // 内存池中尚未归还的块数
+        int64_t pool_resident;      // 内存池占用的字节数
+        int64_t output_queued;      // 本事件循环中各连接已提交但尚未写入内核的字节数
+        int64_t output_above_high;  // 待发送数据超过高水位的连接数
+        int64_t output_high_hits;   // 连接超过高水位的次数
+        int64_t connections;        // 同LoopLoad
+        int64_t loop_lag_us;
+        int64_t deferred_sends;     // 延迟发送的Send次数
+        int64_t deferred_flushes;   // 本轮结束时发送延迟数据的次数，deferred_sends / deferred_flushes为平均合并的Send数
+    };
+
+    struct Configure;
     struct EventBase;
-    struct EventBases : private util::NonCopyable
+    class MemPool;
+    struct EventBases: private util::NonCopyable
     {
         virtual EventBase* AllocBase() = 0;
+        //事件派发器的数量及第i个派发器，用于在每个事件循环上各自监听
+        virtual int BaseCount() = 0;
+        virtual EventBase *BaseAt(int i) = 0;
     };
 
     struct EventsImp;
     struct EventBase : public EventBases
     {
-        // taskCapacity指定任务队列的大小，0无限制
-        EventBase(int taskCapacity = 0);
+        // taskCapacity指定任务队列的大小，0无限制. timerMode指定定时器的存储方式，pollerMode指定IO多路复用方式
+        EventBase(int taskCapacity = 0, TimerMode timerMode = TimerMode::MODE_WHEEL, 
+            PollerMode pollerMode = PollerMode::MODE_EPOLL_LT);
         ~EventBase();
         //处理已到期的事件,waitMs表示若无当前需要处理的任务，需要等待的时间
         void LoopOnce(int waitMs);
         //进入事件处理循环
         void Loop();
+        //每轮事件循环最多执行的SafeCall任务数，剩余任务在下一轮执行，0表示不限制
+        void SetTaskBudget(int budget);
+        //忙轮询模式，空闲时继续以0超时轮询spinUs微秒后才阻塞等待，期间跨线程任务无需写eventfd唤醒。0表示关闭
+        void SetBusyPoll(int spinUs);
         //取消定时任务，若timer已经过期，则忽略
         bool Cancel(TimerId timerid);
         //添加定时任务，interval=0表示一次性任务，否则为重复任务，时间为毫秒
         TimerId RunAt(int64_t milli, const Task &task, int64_t interval = 0) { return RunAt(milli, Task(task), interval); }
         TimerId RunAt(int64_t milli, Task &&task, int64_t interval = 0);
-        TimerId RunAfter(int64_t milli, const Task &task, int64_t interval = 0) { return RunAt(util::TimeMilli() + milli, Task(task), interval); }
-        TimerId RunAfter(int64_t milli, Task &&task, int64_t interval = 0) { return RunAt(util::TimeMilli() + milli, std::move(task), interval); }
+        TimerId RunAfter(int64_t milli, const Task &task, int64_t interval = 0) { return RunAt(Now() + milli, Task(task), interval); }
+        TimerId RunAfter(int64_t milli, Task &&task, int64_t interval = 0) { return RunAt(Now() + milli, std::move(task), interval); }
+        //当前毫秒时间，与util::TimeMilli同基准。Loop中返回本轮poller返回时以粗粒度时钟缓存的时间，
+        //避免反复读取时钟，最多落后一个时钟节拍，回调执行较久后落后更多；Loop之外读取精确时间
+        int64_t Now();
+        //读取精确时间并刷新缓存，用于需要精确计时的场合
+        int64_t PreciseNow();
+        //本事件循环共享的读缓冲区，大小为kReadBufferSize。连接读取时超出其缓冲区剩余空间的数据先读入这里再复制，
+        //读回调之前即已复制完，因此各连接可以复用
+        char *ReadBuffer();
+        static const size_t kReadBufferSize = 64 * 1024;
 
         //下列函数为线程安全的
 
@@ -56,11 +132,33 @@ namespace net
         bool Exited();
         //唤醒事件处理
         void Wakeup();
+        //获取统计信息
+        EventStats GetStats();
+        //获取负载计数，开销远小于GetStats，用于分配连接
+        LoopLoad GetLoad();
+        //调整连接计数。TcpConn挂接时加一、清理时减一；跨线程交接连接时可先行加一、挂接前减回，
+        //使连接在交接途中也计入负载，避免同一批连接都分配到同一个事件循环
+        void AddConnections(int64_t delta);
+        //本事件循环的内存池，用于分配连接、通道和缓冲区
+        MemPool *GetPool();
         //添加任务
         void SafeCall(Task &&task);
         void SafeCall(const Task &task) { SafeCall(Task(task)); }
+        //当前线程是否为执行Loop的线程，Loop之外返回false
+        bool IsInLoopThread();
+        //在事件循环线程中调用时直接执行，否则同SafeCall
+        void RunInLoop(Task &&task);
+        void RunInLoop(const Task &task) { RunInLoop(Task(task)); }
+        /**
+         * @brief 在事件循环线程中调用时加入本轮循环结束时执行的队列，不经过任务队列与eventfd，
+         *  用于需要推迟到当前回调返回之后的操作(如关闭连接)；其他线程中调用同SafeCall
+         */
+        void QueueInLoop(Task &&task);
+        void QueueInLoop(const Task &task) { QueueInLoop(Task(task)); }
         //分配一个事件派发器
         virtual EventBase *AllocBase() { return this; }
+        virtual int BaseCount() { return 1; }
+        virtual EventBase *BaseAt(int) { return this; }
 
     public:
         std::unique_ptr<EventsImp> imp_;
@@ -70,14 +168,50 @@ namespace net
     //多线程的事件派发器
     struct MultiBase : public EventBases 
     {
-        MultiBase(int sz) : id_(0), bases_(sz) {}
-        virtual EventBase *AllocBase() 
-        {
-            int c = id_++;
-            return &bases_[c % bases_.size()];
-        }
+        using DistributeFunc = std::function<EventBase *(MultiBase *)>;
+
+        MultiBase(int sz) : id_(0), bases_(sz), numa_local_(false), mode_(DistributeMode::MODE_ROUND_ROBIN), 
+            rebalance_ms_(0), rebalance_threshold_(0), rebalance_moves_(0) {}
+        virtual EventBase *AllocBase();
+        virtual int BaseCount() { return static_cast<int>(bases_.size()); }
+        virtual EventBase *BaseAt(int i) { return &bases_[i]; }
         void Loop();
-        MultiBase &Exit() 
+        /**
+         * @brief 设置事件循环线程的CPU亲和性，需在Loop之前调用
+         * @param cpus 第i个事件循环绑定到cpus[i % cpus.size()]中的CPU，为空则不绑定
+         * @param numaLocal 为true时事件循环线程只从所在NUMA节点分配内存，
+         *  并在本线程重新分配定时器等在构造时由其他线程分配的结构
+         */
+        MultiBase &SetAffinity(const std::vector<std::vector<int>> &cpus, bool numaLocal = true);
+        /**
+         * @brief 设置AllocBase分配事件循环的方式，默认轮流分配。
+         *  轮流分配不考虑负载，连接时长差异大或滚动重启后连接集中重连时，各事件循环的负载可能长期不均
+         */
+        MultiBase &SetDistribution(DistributeMode mode);
+        //自定义分配方式，fn返回本MultiBase中的一个事件循环，可通过BaseAt及GetLoad获取各事件循环的负载
+        MultiBase &SetDistribution(DistributeFunc &&fn);
+        /**
+         * @brief 启用后台负载均衡，需在Loop之前调用。每intervalMs毫秒比较各事件循环处理事件的时间占比，
+         *  最忙与最闲的相差超过threshold(0~1)时，把最忙的事件循环中最近有数据到达的部分连接
+         *  通过TcpConn::MigrateTo迁移到最闲的，每次最多maxMoves个
+         * @param intervalMs 0表示不启用
+         */
+        MultiBase &SetRebalance(int intervalMs, double threshold = 0.2, int maxMoves = 64);
+        /**
+         * @brief 从配置文件读取亲和性及分配方式，格式如下。affinity每行一个CPU集合，依次分配给各事件循环；
+         *  distribute取值round_robin、least_conns、least_queued、two_choices，依次对应DistributeMode的各项，
+         *  two_choices为随机取两个事件循环中循环延迟较低者
+         *  [multibase]
+         *  affinity = 0-3,8
+         *      4-7
+         *  numa_local = true
+         *  distribute = least_conns
+         *  rebalance_ms = 1000
+         *  rebalance_threshold = 0.2
+         * @return 成功返回0，CPU列表或分配方式错误返回-1
+         */
+        int LoadConf(Configure &conf, const std::string &section = "multibase");
+        MultiBase &Exit()
         {
             for (auto &b : bases_) 
             {
@@ -89,6 +223,20 @@ namespace net
     private:
         std::atomic<int> id_;
         std::vector<EventBase> bases_;
+        std::vector<std::vector<int>> affinity_;
+        bool numa_local_;
+        DistributeMode mode_;
+        DistributeFunc distribute_;
+        int rebalance_ms_;
+        double rebalance_threshold_;
+        int rebalance_moves_;
+
+        //负载均衡线程，直到事件循环退出
+        void Rebalance();
+
+        //负载最小的事件循环。比较的起点依次轮换，负载相同时取先比较的，使空闲时仍轮流分配
+        template <class Key>
+        EventBase *Least(Key key);
     };
 
 
@@ -0,0 +1,84 @@
+#include "http.h"
+#include "log.h"
+#include "util.h"
+
+#include <fcntl.h>
+#include <strings.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace net
+{
+////////////////////////////////////////////////////////////////////// HttpConnPtr
+    void HttpConnPtr::SendFile(const std::string &filename) const
+    {
+        HttpResponse &resp = GetResponse();
+        int fd = open(filename.c_str(), O_RDONLY | O_CLOEXEC);
+        struct stat st;
+        int err = fd < 0 || fstat(fd, &st) < 0 ? errno : S_ISREG(st.st_mode) ? 0 : EISDIR;
+        if (err)
+        {
+            if (fd >= 0)
+                close(fd);
+            LOG_FMT_ERROR_MSG("send file %s failed %d %s", filename.c_str(), err, strerror(err));
+            if (err == ENOENT)
+                resp.SetNotFound();
+            else
+                resp.SetStatus(500, strerror(err));
+            SendResponse();
+            return;
+        }
+
+        // 只编码响应头，文件内容由sendfile从内核直接发送，不读入body
+        SetConnection(resp);
+        resp.EncodeHead(tcp_->GetOutput(), st.st_size);
+        LogOutput("http file resp");
+        ClearData();
+        tcp_->SendFile(fd, 0, st.st_size, [fd] { close(fd); });
+    }
+
+    void HttpConnPtr::SetConnection(HttpResponse &resp) const
+    {
+        for (auto &hd : resp.headers_)
+        {
+            if (strcasecmp(hd.first.c_str(), "Connection") == 0)
+                return;
+        }
+        HttpRequest &req = GetRequest();
+        std::string conn = req.GetHeader("connection");
+        bool keepAlive = req.version_ == "HTTP/1.0" ? strcasecmp(conn.c_str(), "keep-alive") == 0
+            : strcasecmp(conn.c_str(), "close") != 0;
+        resp.headers_["Connection"] = keepAlive ? "Keep-Alive" : "close";
+    }
+
+
+
+////////////////////////////////////////////////////////////////////// HttpResponse
+    int HttpResponse::EncodeHead(Buffer &buf, size_t contentLen)
+    {
+        size_t osz = buf.Size();
+        buf.Append(util::Format("%s %d %s\r\n", version_.c_str(), status, status_word_.c_str()));
+        bool hasConn = false;
+        for (auto &hd : headers_)
+        {
+            // 长度以实际发送的内容为准
+            if (strcasecmp(hd.first.c_str(), "Content-Length") == 0)
+                continue;
+            if (strcasecmp(hd.first.c_str(), "Connection") == 0)
+                hasConn = true;
+            buf.Append(hd.first).Append(": ").Append(hd.second).Append("\r\n");
+        }
+        if (!hasConn)
+            buf.Append("Connection: Keep-Alive\r\n");
+        buf.Append(util::Format("Content-Length: %zu\r\n\r\n", contentLen));
+        return static_cast<int>(buf.Size() - osz);
+    }
+
+    int HttpResponse::Encode(Buffer &buf)
+    {
+        Slice body = GetBody();
+        int n = EncodeHead(buf, body.Size());
+        buf.Append(body);
+        return n + static_cast<int>(body.Size());
+    }
+}
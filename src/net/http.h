@@ -87,6 +87,8 @@ namespace net
         // override
         virtual int Encode(Buffer &buf);
         virtual Result TryDecode(Slice buf, bool copyBody = true);
+        //只编码状态行及头部，Content-Length为contentLen，headers_中的Content-Length被忽略
+        int EncodeHead(Buffer &buf, size_t contentLen);
         virtual void Clear() 
         {
             HttpMsg::Clear();
@@ -122,6 +124,7 @@ namespace net
         }
         void SendResponse(HttpResponse &resp) const 
         {
+            SetConnection(resp);
             resp.Encode(tcp_->GetOutput());
             LogOutput("http resp");
             ClearData();
@@ -143,6 +146,8 @@ namespace net
         };
         void HandleRead(const HttpCallBack &cb) const;
         void LogOutput(const char *title) const;
+        //响应未指定Connection时按请求填写，HTTP/1.0未要求keep-alive或请求Connection: close时为close
+        void SetConnection(HttpResponse &resp) const;
     };
 
 
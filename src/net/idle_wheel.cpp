@@ -0,0 +1,104 @@
+#include "idle_wheel.h"
+
+#include <algorithm>
+
+namespace net
+{
+    void IdleNode::Unlink()
+    {
+        if (!wheel_)
+            return;
+        prev_->next_ = next_;
+        next_->prev_ = prev_;
+        prev_ = next_ = this;
+        wheel_->size_--;
+        wheel_ = nullptr;
+    }
+
+
+
+    IdleWheel::IdleWheel() : current_(0), size_(0)
+    {
+        for (auto &head : slots_)
+            InitList(&head);
+    }
+
+    void IdleWheel::Add(IdleNode *node, int idle, int64_t nowSec)
+    {
+        node->Unlink();
+        if (current_ == 0)
+            current_ = nowSec + 1;
+        node->idle_ = idle > 0 ? idle : 1;
+        node->touched_ = nowSec;
+        node->deadline_ = nowSec + node->idle_;
+        Insert(node);
+    }
+
+    void IdleWheel::Insert(IdleNode *node)
+    {
+        // 已经错过的槽放到下一个待处理的槽
+        int64_t at = node->deadline_ < current_ ? current_ : node->deadline_;
+        IdleNode *head = &slots_[at & (kSlots - 1)];
+        node->prev_ = head->prev_;
+        node->next_ = head;
+        head->prev_->next_ = node;
+        head->prev_ = node;
+        node->wheel_ = this;
+        size_++;
+    }
+
+    void IdleWheel::Advance(int64_t nowSec)
+    {
+        if (current_ == 0)
+            return;
+        // 事件循环阻塞超过一圈时，每个槽处理一次即可覆盖所有节点
+        if (nowSec - current_ >= kSlots)
+            current_ = nowSec - kSlots + 1;
+
+        for (; current_ <= nowSec; current_++)
+        {
+            // 先把整个槽移到临时链表，回调中重新入槽或注销的节点不会影响遍历
+            IdleNode *head = &slots_[current_ & (kSlots - 1)];
+            if (head->next_ == head)
+                continue;
+            IdleNode pending;
+            pending.next_ = head->next_;
+            pending.prev_ = head->prev_;
+            pending.next_->prev_ = &pending;
+            pending.prev_->next_ = &pending;
+            InitList(head);
+
+            while (pending.next_ != &pending)
+            {
+                IdleNode *node = pending.next_;
+                node->prev_->next_ = node->next_;
+                node->next_->prev_ = node->prev_;
+                size_--;
+                node->wheel_ = nullptr;
+
+                int64_t expire = node->touched_ + node->idle_;
+                if (node->deadline_ > current_ || expire > current_)
+                {
+                    // 下一圈的节点，或到期前有过活动，按活动时间重新入槽
+                    node->deadline_ = std::max(node->deadline_, expire);
+                    Insert(node);
+                    continue;
+                }
+                node->touched_ = current_;
+                node->deadline_ = current_ + node->idle_;
+                Insert(node);
+                // 回调可能注销甚至析构节点，之后不再访问node
+                node->callback_();
+            }
+        }
+    }
+
+    void IdleWheel::Clear()
+    {
+        for (auto &head : slots_)
+        {
+            while (head.next_ != &head)
+                head.next_->Unlink();
+        }
+    }
+}
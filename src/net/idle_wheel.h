@@ -0,0 +1,66 @@
+#pragma once
+
+#include "noncopyable.h"
+
+#include <cstdint>
+#include <cstddef>
+#include <functional>
+
+namespace net
+{
+    class IdleWheel;
+
+    /**
+     * @brief 空闲检测节点，嵌入在连接中，注册时不分配内存。
+     *  连接有活动时只记录活动时间(Touch)，不移动节点，到期时再根据活动时间重新入槽，
+     *  因此每个连接在每个空闲周期内最多移动一次
+     */
+    struct IdleNode : private util::NonCopyable
+    {
+        IdleNode() : prev_(this), next_(this), wheel_(nullptr), idle_(0), deadline_(0), touched_(0) {}
+        ~IdleNode() { Unlink(); }
+
+        bool Linked() { return wheel_ != nullptr; }
+        void Touch(int64_t nowSec) { touched_ = nowSec; }
+        void Unlink();
+
+        IdleNode *prev_;
+        IdleNode *next_;
+        IdleWheel *wheel_;
+        int idle_;                      // 空闲时长，秒
+        int64_t deadline_;              // 所在槽的到期秒数
+        int64_t touched_;               // 最近一次活动的秒数
+        std::function<void()> callback_;
+    };
+
+
+    /**
+     * @brief 空闲连接时间轮，精度1秒，由EventsImp持有，只在事件循环线程中使用。
+     *  共kSlots个槽，到期时间超过一圈的节点按到期秒数取模入槽，转到时若未到期则留在原槽。
+     *  注册、注销、活动均为O(1)
+     */
+    class IdleWheel : private util::NonCopyable
+    {
+        friend struct IdleNode;
+    public:
+        IdleWheel();
+        ~IdleWheel() { Clear(); }
+
+        //注册空闲检测，连接空闲idle秒后回调，之后每空闲idle秒再回调一次
+        void Add(IdleNode *node, int idle, int64_t nowSec);
+        //处理now(含)之前到期的槽
+        void Advance(int64_t nowSec);
+        size_t Size() { return size_; }
+        //移除所有节点，不回调
+        void Clear();
+    private:
+        static const int kSlots = 512;
+
+        void Insert(IdleNode *node);
+        static void InitList(IdleNode *head) { head->prev_ = head->next_ = head; }
+    private:
+        int64_t current_;               // 下一个待处理的秒数，0表示尚未开始
+        size_t size_;
+        IdleNode slots_[kSlots];        // 各槽为带哨兵的双向循环链表
+    };
+}
@@ -0,0 +1,271 @@
+#include "mem_pool.h"
+
+#include <algorithm>
+#include <cstdlib>
+#include <new>
+
+namespace net
+{
+    static_assert(sizeof(void*) <= 16, "pool block header must keep 16 byte alignment");
+
+    thread_local MemPool *MemPool::local_ = nullptr;
+
+    MemPool::MemPool()
+        : remote_(nullptr), remote_pending_(false), released_(false), outstanding_(0),
+        allocs_(0), hits_(0), in_use_(0), resident_(0)
+    {
+        static_assert(sizeof(Slab) <= kAlign, "slab header must fit before the first block");
+    }
+
+    MemPool::~MemPool()
+    {
+        for (Slab *slab : slabs_)
+            free(slab);
+    }
+
+    void *MemPool::Allocate(MemPool *pool, size_t size)
+    {
+        if (pool && pool == local_ && size <= kMaxBlock - sizeof(Header))
+            return pool->AllocateLocal(size);
+
+        Header *h = static_cast<Header*>(malloc(sizeof(Header) + size));
+        if (!h)
+            throw std::bad_alloc();
+        h->pool_ = nullptr;
+        h->cls_ = -1;
+        return h + 1;
+    }
+
+    void MemPool::Free(void *p)
+    {
+        if (!p)
+            return;
+        Header *h = static_cast<Header*>(p) - 1;
+        if (!h->pool_)
+            free(h);
+        else if (h->pool_ == local_)
+            h->pool_->FreeLocal(h);
+        else
+            h->pool_->FreeRemote(h);
+    }
+
+    void MemPool::Bind()
+    {
+        local_ = this;
+    }
+
+    void MemPool::Unbind()
+    {
+        if (local_ != this)
+            return;
+        Reclaim();
+        local_ = nullptr;
+    }
+
+    void MemPool::Release()
+    {
+        if (local_ == this)
+            local_ = nullptr;
+        std::unique_lock<std::mutex> lock(remote_mutex_);
+        // 此后没有所有者，回收的块不再放回slab，析构时随slab一起释放
+        int64_t reclaimed = 0;
+        for (FreeBlock *b = remote_; b; b = b->next_)
+            reclaimed++;
+        remote_ = nullptr;
+        released_ = true;
+        outstanding_ = in_use_.load(std::memory_order_relaxed) - reclaimed;
+        bool last = outstanding_ == 0;
+        lock.unlock();
+        if (last)
+            delete this;
+    }
+
+    void *MemPool::AllocateLocal(size_t size)
+    {
+        int cls = static_cast<int>((sizeof(Header) + size - 1) / kAlign);
+        SizeClass &sc = classes_[cls];
+        Slab *slab = sc.avail_;
+        if (!slab)
+        {
+            Reclaim();
+            slab = sc.avail_;
+        }
+        if (slab)
+            Add(hits_, 1);
+        else
+            slab = NewSlab(cls);
+
+        FreeBlock *b = slab->free_;
+        slab->free_ = b->next_;
+        if (slab->used_++ == 0 && --sc.idle_ < sc.min_idle_)
+            sc.min_idle_ = sc.idle_;
+        if (!slab->free_)
+            Unlink(sc, slab);
+        Add(allocs_, 1);
+        Add(in_use_, 1);
+
+        Header *h = reinterpret_cast<Header*>(b);
+        h->pool_ = this;
+        h->cls_ = cls;
+        return h + 1;
+    }
+
+    void MemPool::FreeLocal(Header *h)
+    {
+        Slab *slab = reinterpret_cast<Slab*>(reinterpret_cast<uintptr_t>(h) & ~(kSlabSize - 1));
+        SizeClass &sc = classes_[slab->cls_];
+        FreeBlock *b = reinterpret_cast<FreeBlock*>(h);
+        b->next_ = slab->free_;
+        slab->free_ = b;
+        Add(in_use_, -1);
+        if (--slab->used_ > 0)
+        {
+            if (!slab->listed_)
+                Link(sc, slab, false);
+            return;
+        }
+        // 全空的移到末尾，分配时先用完未满的，使其保持空闲以便Trim释放
+        if (slab->listed_)
+            Unlink(sc, slab);
+        Link(sc, slab, true);
+        sc.idle_++;
+    }
+
+    void MemPool::Trim()
+    {
+        Reclaim();
+        for (SizeClass &sc : classes_)
+        {
+            int release = std::min(sc.min_idle_, sc.idle_) - kIdleSlabs;
+            while (release-- > 0 && sc.last_ && sc.last_->used_ == 0)
+            {
+                FreeSlab(sc, sc.last_);
+                sc.idle_--;
+            }
+            sc.min_idle_ = sc.idle_;
+        }
+    }
+
+    void MemPool::FreeSlab(SizeClass &sc, Slab *slab)
+    {
+        Unlink(sc, slab);
+        Slab *last = slabs_.back();
+        last->index_ = slab->index_;
+        slabs_[slab->index_] = last;
+        slabs_.pop_back();
+        free(slab);
+        Add(resident_, -static_cast<int64_t>(kSlabSize));
+    }
+
+    void MemPool::FreeRemote(Header *h)
+    {
+        FreeBlock *b = reinterpret_cast<FreeBlock*>(h);
+        std::unique_lock<std::mutex> lock(remote_mutex_);
+        if (released_)
+        {
+            bool last = --outstanding_ == 0;
+            lock.unlock();
+            if (last)
+                delete this;
+            return;
+        }
+        b->next_ = remote_;
+        remote_ = b;
+        remote_pending_.store(true, std::memory_order_relaxed);
+    }
+
+    void MemPool::Reclaim()
+    {
+        if (!remote_pending_.load(std::memory_order_relaxed))
+            return;
+        FreeBlock *list;
+        {
+            std::lock_guard<std::mutex> lock(remote_mutex_);
+            list = remote_;
+            remote_ = nullptr;
+            remote_pending_.store(false, std::memory_order_relaxed);
+        }
+        while (list)
+        {
+            FreeBlock *next = list->next_;
+            FreeLocal(reinterpret_cast<Header*>(list));
+            list = next;
+        }
+    }
+
+    // 申请一个按kSlabSize对齐的slab，切分为该级别的块
+    MemPool::Slab *MemPool::NewSlab(int cls)
+    {
+        Slab *slab = static_cast<Slab*>(aligned_alloc(kSlabSize, kSlabSize));
+        if (!slab)
+            throw std::bad_alloc();
+        size_t block = (cls + 1) * kAlign;
+        size_t count = (kSlabSize - kAlign) / block;
+        char *base = reinterpret_cast<char*>(slab) + kAlign;
+        FreeBlock *first = nullptr;
+        for (size_t i = count; i > 0; i--)
+        {
+            FreeBlock *b = reinterpret_cast<FreeBlock*>(base + (i - 1) * block);
+            b->next_ = first;
+            first = b;
+        }
+        slab->free_ = first;
+        slab->cls_ = cls;
+        slab->used_ = 0;
+        slab->listed_ = false;
+        slab->index_ = slabs_.size();
+        slabs_.push_back(slab);
+        Link(classes_[cls], slab, true);
+        classes_[cls].idle_++;
+        Add(resident_, kSlabSize);
+        return slab;
+    }
+
+    void MemPool::Link(SizeClass &sc, Slab *slab, bool tail)
+    {
+        if (tail)
+        {
+            slab->prev_ = sc.last_;
+            slab->next_ = nullptr;
+            if (sc.last_)
+                sc.last_->next_ = slab;
+            else
+                sc.avail_ = slab;
+            sc.last_ = slab;
+        }
+        else
+        {
+            slab->prev_ = nullptr;
+            slab->next_ = sc.avail_;
+            if (sc.avail_)
+                sc.avail_->prev_ = slab;
+            else
+                sc.last_ = slab;
+            sc.avail_ = slab;
+        }
+        slab->listed_ = true;
+    }
+
+    void MemPool::Unlink(SizeClass &sc, Slab *slab)
+    {
+        if (slab->prev_)
+            slab->prev_->next_ = slab->next_;
+        else
+            sc.avail_ = slab->next_;
+        if (slab->next_)
+            slab->next_->prev_ = slab->prev_;
+        else
+            sc.last_ = slab->prev_;
+        slab->listed_ = false;
+    }
+
+    PoolStats MemPool::Stats()
+    {
+        PoolStats stats;
+        stats.allocs = allocs_.load(std::memory_order_relaxed);
+        stats.hits = hits_.load(std::memory_order_relaxed);
+        stats.in_use = in_use_.load(std::memory_order_relaxed);
+        stats.resident = resident_.load(std::memory_order_relaxed);
+        return stats;
+    }
+}
@@ -0,0 +1,134 @@
+#pragma once
+
+#include "noncopyable.h"
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <vector>
+
+namespace net
+{
+    struct PoolStats
+    {
+        int64_t allocs;     // 所有者线程中的分配次数
+        int64_t hits;       // 由已有slab中的空闲块满足的分配次数
+        int64_t in_use;     // 尚未归还的块数，其他线程归还而所有者尚未回收的仍计入
+        int64_t resident;   // 向系统申请的slab字节数，持续空闲的slab由Trim归还系统
+    };
+
+
+    /**
+     * @brief 按大小分级的定长块内存池，每个EventBase一个，用于连接、通道和缓冲区的小块内存。
+     *  只有所有者线程(Bind所在的事件循环线程)从池中分配，无锁、不使用原子操作；其他线程及
+     *  超过kMaxBlock的请求直接使用malloc。每块前有16字节的块头记录所属的池，因此可以在任意线程
+     *  通过MemPool::Free归还：所有者线程直接放回所在slab，其他线程加锁放入待回收链表，
+     *  由所有者在需要新块或Trim时回收。分配优先使用未满的slab，Trim把自上次Trim以来一直全空的slab
+     *  归还系统，每级保留kIdleSlabs个，连接数回落后占用随之下降，短时的起伏不会反复申请释放slab。
+     *  所有者调用Release且所有块归还后池才析构，连接的生命周期可以长于EventBase
+     */
+    class MemPool : private util::NonCopyable
+    {
+    public:
+        MemPool();
+        //pool为NULL或不在所有者线程中时直接使用malloc，Free同样可以归还
+        static void *Allocate(MemPool *pool, size_t size);
+        static void Free(void *p);
+        //在事件循环线程中调用，此后本线程从该池分配。每个线程同时只绑定一个池
+        void Bind();
+        void Unbind();
+        //所有者不再使用，调用前须已Unbind
+        void Release();
+        //在所有者线程中定期调用，回收其他线程归还的块，释放持续空闲的slab
+        void Trim();
+        PoolStats Stats();
+    private:
+        static const size_t kAlign = 64;
+        static const int kClasses = 64;
+        static const size_t kMaxBlock = kAlign * kClasses;
+        static const size_t kSlabSize = 64 * 1024;     // slab按此大小对齐，由块地址可得所在slab
+        static const int kIdleSlabs = 1;                // Trim时每级保留的全空slab数
+
+        struct Header
+        {
+            MemPool *pool_;             // NULL表示由malloc分配
+            int64_t cls_;
+        };
+        struct FreeBlock
+        {
+            FreeBlock *next_;
+        };
+        // 位于slab起始处，块从kAlign偏移开始
+        struct Slab
+        {
+            Slab *prev_;                // 有空闲块的slab组成的链表
+            Slab *next_;
+            FreeBlock *free_;
+            size_t index_;              // 在slabs_中的位置
+            int cls_;
+            int used_;
+            bool listed_;
+        };
+        struct SizeClass
+        {
+            Slab *avail_ = nullptr;     // 有空闲块的slab，未满的在前，全空的在后
+            Slab *last_ = nullptr;
+            int idle_ = 0;              // 全空的slab数
+            int min_idle_ = 0;          // 上次Trim以来全空slab数的最小值，即一直空闲的slab数
+        };
+
+        ~MemPool();
+        void *AllocateLocal(size_t size);
+        void FreeLocal(Header *h);
+        void FreeRemote(Header *h);
+        //回收其他线程归还的块
+        void Reclaim();
+        Slab *NewSlab(int cls);
+        void FreeSlab(SizeClass &sc, Slab *slab);
+        //加入有空闲块的slab链表，tail为true时加在末尾
+        void Link(SizeClass &sc, Slab *slab, bool tail);
+        void Unlink(SizeClass &sc, Slab *slab);
+        // 只由所有者线程修改，以relaxed读写代替原子加减，开销同普通变量，其他线程可读取
+        static void Add(std::atomic<int64_t> &counter, int64_t n)
+        {
+            counter.store(counter.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+        }
+
+        static thread_local MemPool *local_;    // 本线程绑定的池
+
+        SizeClass classes_[kClasses];
+        std::vector<Slab*> slabs_;
+        std::mutex remote_mutex_;
+        FreeBlock *remote_;                     // 其他线程归还、尚未回收的块
+        std::atomic<bool> remote_pending_;
+        bool released_;
+        int64_t outstanding_;                   // Release后尚未归还的块数，由remote_mutex_保护
+        std::atomic<int64_t> allocs_;
+        std::atomic<int64_t> hits_;
+        std::atomic<int64_t> in_use_;
+        std::atomic<int64_t> resident_;
+    };
+
+
+    // 从MemPool分配的分配器，用于std::allocate_shared使对象与控制块一次分配
+    template <class T>
+    struct PoolAllocator
+    {
+        using value_type = T;
+
+        PoolAllocator(MemPool *pool) : pool_(pool) {}
+        template <class U>
+        PoolAllocator(const PoolAllocator<U> &other) : pool_(other.pool_) {}
+
+        T *allocate(size_t n) { return static_cast<T*>(MemPool::Allocate(pool_, n * sizeof(T))); }
+        void deallocate(T *p, size_t) { MemPool::Free(p); }
+
+        template <class U>
+        bool operator==(const PoolAllocator<U> &other) const { return pool_ == other.pool_; }
+        template <class U>
+        bool operator!=(const PoolAllocator<U> &other) const { return pool_ != other.pool_; }
+
+        MemPool *pool_;
+    };
+}
@@ -63,6 +63,13 @@ namespace net
     {
         int flag = value;
         int len = sizeof flag;
-        return setsockopt(fd, SOL_SOCKET, TCP_NODELAY, &flag, len);
+        return setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &flag, len);
+    }
+
+    int SetCork(int fd, bool value)
+    {
+        int flag = value;
+        int len = sizeof flag;
+        return setsockopt(fd, IPPROTO_TCP, TCP_CORK, &flag, len);
     }
 }
\ No newline at end of file
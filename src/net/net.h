@@ -66,4 +66,6 @@ namespace net
     int SetReuseAddr(int fd, bool value = true);
     int SetReusePort(int fd, bool value = true);
     int SetNoDelay(int fd, bool value = true);
+    //TCP_CORK，开启期间只发送完整的报文段，关闭时发出剩余的数据
+    int SetCork(int fd, bool value = true);
 }
\ No newline at end of file
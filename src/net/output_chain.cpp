@@ -0,0 +1,293 @@
+#include "output_chain.h"
+#include "buffer.h"
+
+#include <algorithm>
+#include <cstring>
+#include <new>
+
+namespace net
+{
+/////////////////////////////////////////////////////// Chunk
+    Chunk *Chunk::Create(MemPool *pool, size_t capacity)
+    {
+        char *storage = static_cast<char*>(MemPool::Allocate(pool, capacity));
+        return Adopt(pool, storage, capacity, 0);
+    }
+
+    Chunk *Chunk::Adopt(MemPool *pool, char *storage, size_t capacity, size_t size)
+    {
+        Chunk *chunk = new (MemPool::Allocate(pool, sizeof(Chunk))) Chunk;
+        chunk->data_ = storage;
+        chunk->capacity_ = capacity;
+        chunk->size_ = size;
+        return chunk;
+    }
+
+    Chunk *Chunk::Wrap(MemPool *pool, const char *data, size_t size, std::function<void()> &&done)
+    {
+        Chunk *chunk = new (MemPool::Allocate(pool, sizeof(Chunk))) Chunk;
+        chunk->data_ = const_cast<char*>(data);
+        chunk->capacity_ = chunk->size_ = size;
+        chunk->done_ = done ? std::move(done) : [] {};
+        return chunk;
+    }
+
+    Chunk *Chunk::File(MemPool *pool, int fd, std::function<void()> &&done)
+    {
+        Chunk *chunk = new (MemPool::Allocate(pool, sizeof(Chunk))) Chunk;
+        chunk->fd_ = fd;
+        chunk->done_ = done ? std::move(done) : [] {};
+        return chunk;
+    }
+
+    void Chunk::Release()
+    {
+        if (refs_.fetch_sub(1, std::memory_order_acq_rel) != 1)
+            return;
+        if (done_)
+            done_();
+        else
+            MemPool::Free(data_);
+        this->~Chunk();
+        MemPool::Free(this);
+    }
+
+
+
+/////////////////////////////////////////////////////// SharedSlice
+    SharedSlice::SharedSlice(const char *data, size_t len, MemPool *pool)
+        : chunk_(nullptr), data_(nullptr), size_(0)
+    {
+        if (len == 0)
+            return;
+        chunk_ = Chunk::Create(pool, len);
+        memcpy(chunk_->data_, data, len);
+        chunk_->size_ = len;
+        data_ = chunk_->data_;
+        size_ = len;
+    }
+
+    SharedSlice::SharedSlice(Buffer &buf)
+        : chunk_(nullptr), data_(nullptr), size_(0)
+    {
+        if (buf.Empty())
+            return;
+        if (buf.Size() <= kCopyLimit)
+        {
+            chunk_ = Chunk::Create(buf.pool_, buf.Size());
+            memcpy(chunk_->data_, buf.Begin(), buf.Size());
+            chunk_->size_ = buf.Size();
+            data_ = chunk_->data_;
+            size_ = chunk_->size_;
+            buf.Clear();
+            return;
+        }
+        // 容量截断到数据末尾，共享的块不能再被追加写入
+        chunk_ = Chunk::Adopt(buf.pool_, buf.buf_, buf.end_, buf.end_);
+        data_ = buf.Begin();
+        size_ = buf.Size();
+        buf.buf_ = nullptr;
+        buf.beg_ = buf.end_ = buf.capacity_ = 0;
+    }
+
+
+
+/////////////////////////////////////////////////////// OutputChain
+    void OutputChain::Push(Chunk *chunk, const char *data, size_t len)
+    {
+        pieces_.push_back(Piece{data, len, chunk, 0});
+        size_ += len;
+    }
+
+    void OutputChain::Append(const char *data, size_t len)
+    {
+        if (len == 0)
+            return;
+        // 尾部块的数据紧接着上一段时，直接追加到上一段
+        if (pieces_.size())
+        {
+            Piece &tail = pieces_.back();
+            Chunk *chunk = tail.chunk_;
+            size_t space = chunk->TailSpace();
+            if (space && tail.data_ + tail.size_ == chunk->data_ + chunk->size_)
+            {
+                size_t n = std::min(space, len);
+                memcpy(chunk->data_ + chunk->size_, data, n);
+                chunk->size_ += n;
+                tail.size_ += n;
+                size_ += n;
+                data += n;
+                len -= n;
+            }
+        }
+        if (len)
+        {
+            Chunk *chunk = Chunk::Create(pool_, len > kChunkSize ? len : kChunkSize);
+            memcpy(chunk->data_, data, len);
+            chunk->size_ = len;
+            Push(chunk, chunk->data_, len);
+        }
+    }
+
+    void OutputChain::Append(Buffer &buf)
+    {
+        if (buf.Empty())
+            return;
+        // 小段数据复制到尾部块中，避免每条小消息各占一块只用了一小部分的存储
+        if (buf.Size() <= kCopyLimit)
+        {
+            Append(buf.Begin(), buf.Size());
+            buf.Clear();
+            return;
+        }
+        Chunk *chunk = Chunk::Adopt(pool_, buf.buf_, buf.capacity_, buf.end_);
+        Push(chunk, buf.Begin(), buf.Size());
+        buf.buf_ = nullptr;
+        buf.beg_ = buf.end_ = buf.capacity_ = 0;
+    }
+
+    void OutputChain::Append(Chunk *chunk, const char *data, size_t len)
+    {
+        if (len == 0)
+            return;
+        chunk->AddRef();
+        Push(chunk, data, len);
+    }
+
+    void OutputChain::AppendRef(const char *data, size_t len, std::function<void()> &&done)
+    {
+        if (len == 0)
+        {
+            if (done)
+                done();
+            return;
+        }
+        Push(Chunk::Wrap(pool_, data, len, std::move(done)), data, len);
+    }
+
+    void OutputChain::AppendFile(int fd, off_t offset, size_t len, std::function<void()> &&done)
+    {
+        if (len == 0)
+        {
+            if (done)
+                done();
+            return;
+        }
+        pieces_.push_back(Piece{nullptr, len, Chunk::File(pool_, fd, std::move(done)), offset});
+        size_ += len;
+    }
+
+    int OutputChain::Fill(struct iovec *iov, int max)
+    {
+        int n = 0;
+        for (auto it = pieces_.begin(); it != pieces_.end() && n < max && it->chunk_->fd_ < 0; ++it, ++n)
+        {
+            iov[n].iov_base = const_cast<char*>(it->data_);
+            iov[n].iov_len = it->size_;
+        }
+        return n;
+    }
+
+    void OutputChain::Consume(size_t len)
+    {
+        size_ -= len;
+        while (len)
+        {
+            Piece &head = pieces_.front();
+            if (len < head.size_)
+            {
+                if (head.chunk_->fd_ >= 0)
+                    head.offset_ += len;
+                else
+                    head.data_ += len;
+                head.size_ -= len;
+                return;
+            }
+            len -= head.size_;
+            Chunk *chunk = head.chunk_;
+            pieces_.pop_front();
+            chunk->Release();
+        }
+    }
+
+    bool OutputChain::Gatherable(int max) const
+    {
+        if (pieces_.size() > static_cast<size_t>(max))
+            return false;
+        for (auto &p : pieces_)
+        {
+            if (p.chunk_->fd_ >= 0)
+                return false;
+        }
+        return true;
+    }
+
+    bool OutputChain::FrontFile(int *fd, off_t *offset, size_t *len)
+    {
+        if (pieces_.empty() || pieces_.front().chunk_->fd_ < 0)
+            return false;
+        Piece &head = pieces_.front();
+        *fd = head.chunk_->fd_;
+        *offset = head.offset_;
+        *len = head.size_;
+        return true;
+    }
+
+    void OutputChain::Clear()
+    {
+        // 先移出链表，回调中可能再次向本链追加数据
+        std::deque<Piece> pieces;
+        pieces.swap(pieces_);
+        size_ = 0;
+        for (auto &p : pieces)
+            p.chunk_->Release();
+    }
+
+
+
+/////////////////////////////////////////////////////// ZeroCopyTracker
+    void ZeroCopyTracker::Sent(Chunk *chunk)
+    {
+        chunk->AddRef();
+        pending_.push_back(chunk);
+    }
+
+    void ZeroCopyTracker::Complete(uint32_t lo, uint32_t hi)
+    {
+        // 编号按32位回绕，用差值定位
+        for (uint32_t id = lo; ; id++)
+        {
+            uint32_t i = id - first_id_;
+            if (i < pending_.size() && pending_[i])
+            {
+                pending_[i]->Release();
+                pending_[i] = nullptr;
+            }
+            if (id == hi)
+                break;
+        }
+        while (pending_.size() && !pending_.front())
+        {
+            pending_.pop_front();
+            first_id_++;
+        }
+    }
+
+    void ZeroCopyTracker::MoveTo(ZeroCopyTracker *other)
+    {
+        other->ReleaseAll();
+        other->pending_.swap(pending_);
+        other->first_id_ = first_id_;
+        first_id_ = 0;
+    }
+
+    void ZeroCopyTracker::ReleaseAll()
+    {
+        for (Chunk *chunk : pending_)
+            if (chunk)
+                chunk->Release();
+        pending_.clear();
+        // 新的socket重新从0编号
+        first_id_ = 0;
+    }
+}
@@ -0,0 +1,190 @@
+#pragma once
+
+#include "noncopyable.h"
+#include "mem_pool.h"
+
+#include <atomic>
+#include <deque>
+#include <functional>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+namespace net
+{
+    class Buffer;
+
+    /**
+     * @brief 引用计数的数据块。存储由MemPool分配，或为用户内存，
+     *  用户内存在最后一个引用释放时回调done_，之后用户才可以释放内存。可在多个连接、多个线程间共享。
+     *  也可以代表一个文件，此时fd_不小于0，数据不在内存中，由sendfile直接从文件发送
+     */
+    struct Chunk : private util::NonCopyable
+    {
+        //分配capacity字节的存储
+        static Chunk *Create(MemPool *pool, size_t capacity);
+        //接管由MemPool分配的存储，其中前size字节已有数据
+        static Chunk *Adopt(MemPool *pool, char *storage, size_t capacity, size_t size);
+        //引用用户内存，不复制
+        static Chunk *Wrap(MemPool *pool, const char *data, size_t size, std::function<void()> &&done);
+        //引用文件，最后一个引用释放时回调done，由done关闭fd
+        static Chunk *File(MemPool *pool, int fd, std::function<void()> &&done);
+
+        void AddRef() { refs_.fetch_add(1, std::memory_order_relaxed); }
+        void Release();
+        //只有自身持有且存储可写时可以在尾部追加数据
+        size_t TailSpace() { return done_ || refs_.load(std::memory_order_acquire) != 1 ? 0 : capacity_ - size_; }
+
+        std::atomic<int> refs_;
+        char *data_;
+        size_t capacity_;
+        size_t size_;                   // 已写入的字节数
+        std::function<void()> done_;    // 不为空时data_为用户内存
+        int fd_;                        // 文件块的文件描述符，内存块为-1
+    private:
+        Chunk() : refs_(1), data_(nullptr), capacity_(0), size_(0), fd_(-1) {}
+        ~Chunk() {}
+    };
+
+
+    /**
+     * @brief 引用计数的不可变数据，复制时只增加引用计数。
+     *  用于把同一消息编码一次后发送给多个连接，可跨线程传递
+     */
+    class SharedSlice
+    {
+    public:
+        SharedSlice() : chunk_(nullptr), data_(nullptr), size_(0) {}
+        //复制数据
+        SharedSlice(const char *data, size_t len, MemPool *pool = nullptr);
+        //接管buf的存储，数据较少时复制，buf变为空
+        explicit SharedSlice(Buffer &buf);
+        SharedSlice(const SharedSlice &other) : chunk_(other.chunk_), data_(other.data_), size_(other.size_)
+        {
+            if (chunk_)
+                chunk_->AddRef();
+        }
+        SharedSlice(SharedSlice &&other) : chunk_(other.chunk_), data_(other.data_), size_(other.size_)
+        {
+            other.chunk_ = nullptr;
+            other.data_ = nullptr;
+            other.size_ = 0;
+        }
+        SharedSlice &operator=(SharedSlice other)
+        {
+            std::swap(chunk_, other.chunk_);
+            std::swap(data_, other.data_);
+            std::swap(size_, other.size_);
+            return *this;
+        }
+        ~SharedSlice()
+        {
+            if (chunk_)
+                chunk_->Release();
+        }
+
+        const char *Data() const { return data_; }
+        size_t Size() const { return size_; }
+        bool Empty() const { return size_ == 0; }
+        Chunk *GetChunk() const { return chunk_; }
+    private:
+        //SharedSlice(Buffer&)时不超过该大小的数据复制到恰好大小的块中，不让共享期间占用buf的整个存储
+        static const size_t kCopyLimit = 1024;
+
+        Chunk *chunk_;
+        const char *data_;
+        size_t size_;
+    };
+
+
+    /**
+     * @brief 待发送数据的链表，每段引用一个Chunk中的一段数据，用writev一次发送多段。
+     *  追加小块数据时复制到尾部块的剩余空间，追加Buffer时接管其存储，均不会因增长而重新复制已有数据。
+     *  只在连接所属的事件循环线程中使用
+     */
+    class OutputChain : private util::NonCopyable
+    {
+    public:
+        OutputChain() : pool_(nullptr), size_(0) {}
+        ~OutputChain() { Clear(); }
+
+        void SetPool(MemPool *pool) { pool_ = pool; }
+        //待发送的字节数
+        size_t Size() const { return size_; }
+        bool Empty() const { return size_ == 0; }
+        size_t Pieces() const { return pieces_.size(); }
+        //全部数据可由一次writev发送，即不超过max段且没有文件段
+        bool Gatherable(int max) const;
+
+        //复制数据
+        void Append(const char *data, size_t len);
+        //接管buf的存储，数据较少时复制，buf变为空
+        void Append(Buffer &buf);
+        //引用chunk中的一段数据，增加chunk的引用计数
+        void Append(Chunk *chunk, const char *data, size_t len);
+        void Append(const SharedSlice &slice) { Append(slice.GetChunk(), slice.Data(), slice.Size()); }
+        //引用用户内存，发送完毕或丢弃后回调done
+        void AppendRef(const char *data, size_t len, std::function<void()> &&done);
+        //引用文件fd从offset开始的len字节，发送完毕或丢弃后回调done
+        void AppendFile(int fd, off_t offset, size_t len, std::function<void()> &&done);
+
+        //从头部开始填充最多max段，遇到文件段停止，返回段数。头部为文件段时返回0
+        int Fill(struct iovec *iov, int max);
+        //头部为文件段时返回true，并取出文件及待发送的范围
+        bool FrontFile(int *fd, off_t *offset, size_t *len);
+        //头部段所在的块
+        Chunk *FrontChunk() { return pieces_.front().chunk_; }
+        //移除已发送的len字节，释放发送完的块
+        void Consume(size_t len);
+        //丢弃所有数据
+        void Clear();
+    private:
+        struct Piece
+        {
+            const char *data_;
+            size_t size_;
+            Chunk *chunk_;
+            off_t offset_;      // 文件段在文件中的偏移
+        };
+
+        //复制数据时新块的最小大小，加上MemPool的块头不超过其最大一级
+        static const size_t kChunkSize = 4096 - 32;
+        //Append(Buffer&)时不超过该大小的数据复制而不接管存储
+        static const size_t kCopyLimit = 1024;
+
+        void Push(Chunk *chunk, const char *data, size_t len);
+    private:
+        std::deque<Piece> pieces_;
+        MemPool *pool_;
+        size_t size_;
+    };
+
+
+    /**
+     * @brief 记录MSG_ZEROCOPY发送中的块。内核对每个socket的零拷贝发送从0开始依次编号，
+     *  完成后在错误队列中通知一段编号，在此之前块的内存不能释放或修改
+     */
+    class ZeroCopyTracker : private util::NonCopyable
+    {
+    public:
+        ZeroCopyTracker() : threshold_(0), first_id_(0) {}
+        ~ZeroCopyTracker() { ReleaseAll(); }
+
+        //不小于threshold的段零拷贝发送，0表示不启用
+        void SetThreshold(size_t threshold) { threshold_ = threshold; }
+        size_t Threshold() const { return threshold_; }
+        bool Waiting() const { return pending_.size() > 0; }
+
+        //一次零拷贝发送成功，持有chunk直到完成
+        void Sent(Chunk *chunk);
+        //编号lo到hi的发送已完成
+        void Complete(uint32_t lo, uint32_t hi);
+        //把发送中的块及编号交给other，自身恢复为初始状态。连接关闭后由other继续等待完成通知
+        void MoveTo(ZeroCopyTracker *other);
+        //释放所有块，只在内核不再引用时调用
+        void ReleaseAll();
+    private:
+        size_t threshold_;
+        uint32_t first_id_;             // pending_头部的编号
+        std::deque<Chunk*> pending_;    // 已完成但前面还有未完成的置为NULL
+    };
+}
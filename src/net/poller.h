@@ -16,7 +16,7 @@ namespace net
     class PollerBase : private util::NonCopyable 
     {
     public:
-        PollerBase() : last_active_(-1) 
+        PollerBase() : last_active_(-1), ctl_count_(0), active_(0) 
         {
             static std::atomic<int64_t> id(0);
             id_ = ++id;
@@ -24,11 +24,37 @@ namespace net
         virtual void AddChannel(Channel *ch) = 0;
         virtual void RemoveChannel(Channel *ch) = 0;
         virtual void UpdateChannel(Channel *ch) = 0;
+        //注销通道但不关闭fd，fd之后可能注册到其他poller
+        virtual void DetachChannel(Channel *ch) { RemoveChannel(ch); }
         virtual void LoopOnce(int waitMs) = 0;
         virtual ~PollerBase(){};
+        //向内核注册、修改监听事件的系统调用次数
+        int64_t CtlCount() { return ctl_count_; }
+        //最近一次LoopOnce返回的事件数
+        int Active() { return active_; }
+        //等待返回后、派发事件前回调，用于刷新事件循环的时间缓存
+        void OnPolled(std::function<void()> &&cb) { polled_callback_ = std::move(cb); }
+
+        //是否只在状态变化时报告事件。为true时读到一半停止的通道不会再收到可读事件，需要自行重新调度
+        virtual bool EdgeTriggered() { return false; }
+        //是否为完成模式，完成模式下读写由poller直接完成，通过Channel::HandleRecv回调数据
+        virtual bool Completion() { return false; }
+        //连接建立后切换为由poller接收数据
+        virtual void StartRecv(Channel *) {}
+        //复制数据并提交发送，不支持时返回false
+        virtual bool SubmitSend(Channel *, const char *, size_t) { return false; }
     protected:
         int64_t id_;
         int last_active_;
+        int64_t ctl_count_;
+        int active_;
+        std::function<void()> polled_callback_;
+
+        void Polled()
+        {
+            if (polled_callback_)
+                polled_callback_();
+        }
     };
 
     
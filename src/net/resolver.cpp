@@ -0,0 +1,440 @@
+#include "resolver.h"
+#include "event_base.h"
+#include "log.h"
+#include "util.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <fstream>
+#include <random>
+#include <sstream>
+#include <arpa/inet.h>
+#include <netdb.h>
+#include <strings.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+namespace net
+{
+    namespace
+    {
+        const int kDefaultTtl = 60;
+        const int kMaxTtl = 3600;
+        const int kNegativeTtl = 5;
+        const size_t kMaxDnsPacket = 512;
+
+        //按DNS报文格式编码域名，标签超过63字节或总长超过255字节时返回false
+        bool EncodeName(const std::string &host, std::string *out)
+        {
+            size_t start = 0;
+            while (start < host.size())
+            {
+                size_t dot = host.find('.', start);
+                if (dot == std::string::npos)
+                    dot = host.size();
+                size_t len = dot - start;
+                if (len == 0 || len > 63)
+                    return false;
+                out->push_back(static_cast<char>(len));
+                out->append(host, start, len);
+                start = dot + 1;
+            }
+            out->push_back('\0');
+            // out之前已有12字节的报文头
+            return out->size() <= 12 + 255;
+        }
+
+        //跳过报文中off处的域名，支持压缩指针
+        bool SkipName(const uint8_t *msg, size_t len, size_t *off)
+        {
+            while (*off < len)
+            {
+                uint8_t c = msg[*off];
+                if (c == 0)
+                {
+                    (*off)++;
+                    return true;
+                }
+                if ((c & 0xc0) == 0xc0)
+                {
+                    *off += 2;
+                    return *off <= len;
+                }
+                if (c & 0xc0)
+                    return false;
+                *off += c + 1;
+            }
+            return false;
+        }
+
+        uint16_t Get16(const uint8_t *p) { return static_cast<uint16_t>(p[0] << 8 | p[1]); }
+        uint32_t Get32(const uint8_t *p) { return static_cast<uint32_t>(Get16(p)) << 16 | Get16(p + 2); }
+
+        //解析应答中的A记录，TTL取A及CNAME记录中最小的
+        int ParseAnswer(const uint8_t *msg, size_t len, uint16_t id, std::vector<struct in_addr> *addrs, int *ttl)
+        {
+            if (len < 12 || Get16(msg) != id || !(msg[2] & 0x80))
+                return EAI_FAIL;
+            int rcode = msg[3] & 0x0f;
+            if (rcode == 3)
+                return EAI_NONAME;
+            if (rcode != 0)
+                return EAI_FAIL;
+            size_t off = 12;
+            for (int i = Get16(msg + 4); i > 0; i--)
+            {
+                if (!SkipName(msg, len, &off))
+                    return EAI_FAIL;
+                off += 4;
+            }
+            int64_t minTtl = INT32_MAX;
+            for (int i = Get16(msg + 6); i > 0; i--)
+            {
+                if (!SkipName(msg, len, &off) || off + 10 > len)
+                    return EAI_FAIL;
+                uint16_t type = Get16(msg + off);
+                uint16_t cls = Get16(msg + off + 2);
+                int64_t rrTtl = Get32(msg + off + 4) & 0x7fffffff;
+                uint16_t rdlen = Get16(msg + off + 8);
+                off += 10;
+                if (off + rdlen > len)
+                    return EAI_FAIL;
+                if (cls == 1 && type == 1 && rdlen == 4)
+                {
+                    struct in_addr addr;
+                    memcpy(&addr, msg + off, 4);
+                    addrs->push_back(addr);
+                    minTtl = std::min(minTtl, rrTtl);
+                }
+                else if (cls == 1 && type == 5)
+                {
+                    minTtl = std::min(minTtl, rrTtl);
+                }
+                off += rdlen;
+            }
+            if (addrs->empty())
+                return EAI_NODATA;
+            *ttl = static_cast<int>(minTtl);
+            return 0;
+        }
+    }
+
+
+
+    Resolver::Resolver(int threads, Backend backend)
+        : backend_(std::move(backend)), default_ttl_(kDefaultTtl), max_ttl_(kMaxTtl), negative_ttl_(kNegativeTtl),
+        exit_(false), hits_(0), misses_(0), coalesced_(0), lookups_(0), failures_(0)
+    {
+        for (int i = 0; i < std::max(threads, 1); i++)
+            threads_.emplace_back([this] { ThreadFunc(); });
+    }
+
+    Resolver::~Resolver()
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            exit_ = true;
+        }
+        ready_.notify_all();
+        for (auto &t : threads_)
+            t.join();
+    }
+
+    Resolver &Resolver::Default()
+    {
+        // 不析构，退出时不等待正在进行的查询
+        static Resolver *resolver = new Resolver;
+        return *resolver;
+    }
+
+    void Resolver::SetBackend(Backend backend)
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        backend_ = std::move(backend);
+    }
+
+    void Resolver::SetCachePolicy(int defaultTtl, int maxTtl, int negativeTtl)
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        default_ttl_ = defaultTtl;
+        max_ttl_ = maxTtl;
+        negative_ttl_ = negativeTtl;
+    }
+
+    bool Resolver::ParseNumeric(const std::string &host, struct in_addr *addr)
+    {
+        if (host.empty())
+        {
+            addr->s_addr = INADDR_ANY;
+            return true;
+        }
+        return inet_pton(AF_INET, host.c_str(), addr) == 1;
+    }
+
+    bool Resolver::Lookup(const std::string &host, std::vector<struct in_addr> *addrs)
+    {
+        struct in_addr addr;
+        if (ParseNumeric(host, &addr))
+        {
+            addrs->assign(1, addr);
+            return true;
+        }
+        std::lock_guard<std::mutex> lock(mutex_);
+        auto it = cache_.find(host);
+        if (it == cache_.end() || it->second.querying_ || it->second.expire_ <= util::TimeMilli())
+            return false;
+        *addrs = it->second.addrs_;
+        return true;
+    }
+
+    void Resolver::Resolve(EventBase *base, const std::string &host, const ResolveCallBack &cb)
+    {
+        std::vector<struct in_addr> addrs;
+        struct in_addr addr;
+        if (ParseNumeric(host, &addr))
+        {
+            addrs.push_back(addr);
+            cb(addrs);
+            return;
+        }
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            int64_t now = util::TimeMilli();
+            auto it = cache_.find(host);
+            if (it == cache_.end() && cache_.size() >= kMaxEntries)
+                Prune(now);
+            Entry &entry = it != cache_.end() ? it->second : cache_[host];
+            if (!entry.querying_ && entry.expire_ > now)
+            {
+                hits_.fetch_add(1, std::memory_order_relaxed);
+                addrs = entry.addrs_;
+            }
+            else
+            {
+                entry.waiters_.push_back(Waiter{base, cb});
+                if (entry.querying_)
+                {
+                    coalesced_.fetch_add(1, std::memory_order_relaxed);
+                    return;
+                }
+                misses_.fetch_add(1, std::memory_order_relaxed);
+                entry.querying_ = true;
+                queries_.push_back(host);
+                ready_.notify_one();
+                return;
+            }
+        }
+        cb(addrs);
+    }
+
+    void Resolver::Prune(int64_t now)
+    {
+        for (auto it = cache_.begin(); it != cache_.end(); )
+        {
+            if (!it->second.querying_ && it->second.expire_ <= now)
+                it = cache_.erase(it);
+            else
+                ++it;
+        }
+    }
+
+    void Resolver::Clear()
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        for (auto it = cache_.begin(); it != cache_.end(); )
+        {
+            if (it->second.querying_)
+                ++it;
+            else
+                it = cache_.erase(it);
+        }
+    }
+
+    ResolverStats Resolver::GetStats()
+    {
+        ResolverStats stats;
+        stats.hits = hits_.load(std::memory_order_relaxed);
+        stats.misses = misses_.load(std::memory_order_relaxed);
+        stats.coalesced = coalesced_.load(std::memory_order_relaxed);
+        stats.lookups = lookups_.load(std::memory_order_relaxed);
+        stats.failures = failures_.load(std::memory_order_relaxed);
+        std::lock_guard<std::mutex> lock(mutex_);
+        stats.entries = static_cast<int64_t>(cache_.size());
+        return stats;
+    }
+
+    void Resolver::ThreadFunc()
+    {
+        while (true)
+        {
+            std::string host;
+            Backend backend;
+            {
+                std::unique_lock<std::mutex> lock(mutex_);
+                ready_.wait(lock, [this] { return exit_ || !queries_.empty(); });
+                if (exit_)
+                    return;
+                host = std::move(queries_.front());
+                queries_.pop_front();
+                backend = backend_;
+            }
+
+            std::vector<struct in_addr> addrs;
+            int ttl = -1;
+            int err = backend ? backend(host, &addrs, &ttl) : EAI_FAIL;
+            lookups_.fetch_add(1, std::memory_order_relaxed);
+            if (err || addrs.empty())
+            {
+                LOG_FMT_WARNING_MSG("resolve %s failed %d %s", host.c_str(), err, gai_strerror(err));
+                failures_.fetch_add(1, std::memory_order_relaxed);
+                addrs.clear();
+            }
+
+            std::vector<Waiter> waiters;
+            {
+                std::lock_guard<std::mutex> lock(mutex_);
+                Entry &entry = cache_[host];
+                int sec = addrs.empty() ? negative_ttl_ : ttl < 0 ? default_ttl_ : std::min(ttl, max_ttl_);
+                entry.addrs_ = addrs;
+                entry.expire_ = util::TimeMilli() + static_cast<int64_t>(sec) * 1000;
+                entry.querying_ = false;
+                waiters.swap(entry.waiters_);
+            }
+            LOG_FMT_DEBUG_MSG("resolved %s %lu addrs ttl %d waiters %lu", host.c_str(), addrs.size(), ttl,
+                waiters.size());
+            for (auto &w : waiters)
+            {
+                ResolveCallBack cb = std::move(w.callback_);
+                w.base_->SafeCall([cb, addrs] { cb(addrs); });
+            }
+        }
+    }
+
+
+
+    Resolver::Backend Resolver::SystemBackend()
+    {
+        return [](const std::string &host, std::vector<struct in_addr> *addrs, int *ttl) {
+            struct addrinfo hints;
+            memset(&hints, 0, sizeof(hints));
+            hints.ai_family = AF_INET;
+            hints.ai_socktype = SOCK_STREAM;
+            struct addrinfo *res = nullptr;
+            int err = getaddrinfo(host.c_str(), nullptr, &hints, &res);
+            if (err)
+                return err;
+            for (struct addrinfo *p = res; p; p = p->ai_next)
+            {
+                struct in_addr addr = reinterpret_cast<struct sockaddr_in *>(p->ai_addr)->sin_addr;
+                bool dup = false;
+                for (auto &a : *addrs)
+                    dup = dup || a.s_addr == addr.s_addr;
+                if (!dup)
+                    addrs->push_back(addr);
+            }
+            freeaddrinfo(res);
+            *ttl = -1;
+            return addrs->empty() ? EAI_NODATA : 0;
+        };
+    }
+
+    Resolver::Backend Resolver::HostsBackend(const std::string &path)
+    {
+        return [path](const std::string &host, std::vector<struct in_addr> *addrs, int *ttl) {
+            std::ifstream in(path);
+            if (!in)
+                return EAI_SYSTEM;
+            std::string line;
+            while (std::getline(in, line))
+            {
+                size_t hash = line.find('#');
+                if (hash != std::string::npos)
+                    line.resize(hash);
+                std::istringstream fields(line);
+                std::string ip, name;
+                struct in_addr addr;
+                if (!(fields >> ip) || inet_pton(AF_INET, ip.c_str(), &addr) != 1)
+                    continue;
+                while (fields >> name)
+                {
+                    if (strcasecmp(name.c_str(), host.c_str()) == 0)
+                    {
+                        addrs->push_back(addr);
+                        break;
+                    }
+                }
+            }
+            *ttl = -1;
+            return addrs->empty() ? EAI_NONAME : 0;
+        };
+    }
+
+    Resolver::Backend Resolver::DnsBackend(const std::string &server, unsigned short port, int timeoutMs)
+    {
+        return [server, port, timeoutMs](const std::string &host, std::vector<struct in_addr> *addrs, int *ttl) {
+            std::string query(12, '\0');
+            if (!EncodeName(host, &query))
+                return EAI_NONAME;
+            static thread_local std::minstd_rand rng(static_cast<unsigned>(util::TimeMicro()));
+            uint16_t id = static_cast<uint16_t>(rng());
+            query[0] = static_cast<char>(id >> 8);
+            query[1] = static_cast<char>(id);
+            query[2] = 0x01;        // RD
+            query[5] = 1;           // QDCOUNT
+            query.append("\0\x01\0\x01", 4);    // QTYPE A, QCLASS IN
+
+            struct sockaddr_in addr;
+            memset(&addr, 0, sizeof(addr));
+            addr.sin_family = AF_INET;
+            addr.sin_port = htons(port);
+            if (inet_pton(AF_INET, server.c_str(), &addr.sin_addr) != 1)
+                return EAI_FAIL;
+            int fd = socket(AF_INET, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+            if (fd < 0)
+                return EAI_SYSTEM;
+            struct timeval tv;
+            tv.tv_sec = timeoutMs / 1000;
+            tv.tv_usec = timeoutMs % 1000 * 1000;
+            setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+            int err = EAI_AGAIN;
+            if (connect(fd, reinterpret_cast<struct sockaddr *>(&addr), sizeof(addr)) == 0)
+            {
+                uint8_t buf[kMaxDnsPacket];
+                for (int attempt = 0; attempt < 2 && err == EAI_AGAIN; attempt++)
+                {
+                    if (send(fd, query.data(), query.size(), 0) < 0)
+                        break;
+                    ssize_t n;
+                    // 忽略id不符的迟到应答，直到超时
+                    while ((n = recv(fd, buf, sizeof(buf), 0)) >= 0)
+                    {
+                        if (n >= 2 && Get16(buf) == id)
+                        {
+                            err = ParseAnswer(buf, n, id, addrs, ttl);
+                            break;
+                        }
+                    }
+                }
+            }
+            close(fd);
+            return err;
+        };
+    }
+
+    Resolver::Backend Resolver::Chain(std::vector<Backend> backends)
+    {
+        return [backends](const std::string &host, std::vector<struct in_addr> *addrs, int *ttl) {
+            int err = EAI_NONAME;
+            for (auto &backend : backends)
+            {
+                addrs->clear();
+                err = backend(host, addrs, ttl);
+                if (err == 0)
+                    break;
+            }
+            return err;
+        };
+    }
+}
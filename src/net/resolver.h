@@ -0,0 +1,119 @@
+#pragma once
+
+#include "noncopyable.h"
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+#include <netinet/in.h>
+
+namespace net
+{
+    struct EventBase;
+
+    //解析得到的IPv4地址，失败时为空
+    using ResolveCallBack = std::function<void(const std::vector<struct in_addr> &addrs)>;
+
+    struct ResolverStats
+    {
+        int64_t hits;           // 命中缓存的解析次数
+        int64_t misses;         // 需要查询的解析次数
+        int64_t coalesced;      // 同一域名正在查询、等待同一结果的解析次数
+        int64_t lookups;        // 实际执行的查询次数
+        int64_t failures;       // 失败的查询次数
+        int64_t entries;        // 缓存的域名数
+    };
+
+    /**
+     * @brief 异步域名解析。查询在解析线程中执行，结果通过SafeCall交给发起解析的事件循环回调，
+     *  不阻塞事件循环。结果按TTL缓存，由各事件循环共享，同一域名同时只查询一次，
+     *  期间的解析请求等待同一结果。数字地址及命中缓存时在调用线程中直接回调
+     */
+    class Resolver : private util::NonCopyable
+    {
+    public:
+        /**
+         * @brief 在解析线程中执行的查询方式
+         * @param ttl 结果的缓存秒数，小于0表示查询方式不提供TTL，按默认值缓存
+         * @return 成功返回0并填入地址，失败返回EAI_*错误码
+         */
+        using Backend = std::function<int(const std::string &host, std::vector<struct in_addr> *addrs, int *ttl)>;
+
+        explicit Resolver(int threads = 1, Backend backend = SystemBackend());
+        ~Resolver();
+
+        //进程共享的解析器，首次使用时创建，TcpConn::Connect及UdpConn::CreateConnection通过它解析域名
+        static Resolver &Default();
+
+        //只影响之后开始的查询
+        void SetBackend(Backend backend);
+        /**
+         * @param defaultTtl 查询方式不提供TTL时的缓存秒数
+         * @param maxTtl TTL的上限
+         * @param negativeTtl 失败结果的缓存秒数，0表示不缓存
+         */
+        void SetCachePolicy(int defaultTtl, int maxTtl, int negativeTtl);
+
+        //解析host，在base的事件循环中回调cb，base在回调前须有效
+        void Resolve(EventBase *base, const std::string &host, const ResolveCallBack &cb);
+        //只查数字地址及缓存，不阻塞。未命中返回false
+        bool Lookup(const std::string &host, std::vector<struct in_addr> *addrs);
+        //清空缓存，正在进行的查询不受影响
+        void Clear();
+        ResolverStats GetStats();
+
+        //getaddrinfo，按系统配置查询hosts文件及DNS，不提供TTL
+        static Backend SystemBackend();
+        //只查询hosts文件，每次查询时读取，修改后在缓存过期后生效
+        static Backend HostsBackend(const std::string &path = "/etc/hosts");
+        //直接向DNS服务器查询A记录，使用应答中的TTL，超时后重试一次
+        static Backend DnsBackend(const std::string &server, unsigned short port = 53, int timeoutMs = 2000);
+        //依次查询，使用第一个成功的结果
+        static Backend Chain(std::vector<Backend> backends);
+        //数字地址或空串(INADDR_ANY)时返回true
+        static bool ParseNumeric(const std::string &host, struct in_addr *addr);
+
+    private:
+        struct Waiter
+        {
+            EventBase *base_;
+            ResolveCallBack callback_;
+        };
+        struct Entry
+        {
+            Entry() : expire_(0), querying_(false) {}
+            std::vector<struct in_addr> addrs_;
+            int64_t expire_;        // 过期时间，毫秒
+            bool querying_;
+            std::vector<Waiter> waiters_;
+        };
+        //缓存的域名超过此数量时，加入新域名前清除已过期的
+        static const size_t kMaxEntries = 4096;
+
+        void ThreadFunc();
+        void Prune(int64_t now);
+
+        std::mutex mutex_;
+        std::condition_variable ready_;
+        std::deque<std::string> queries_;   // 待查询的域名
+        std::unordered_map<std::string, Entry> cache_;
+        std::vector<std::thread> threads_;
+        Backend backend_;
+        int default_ttl_;
+        int max_ttl_;
+        int negative_ttl_;
+        bool exit_;
+        std::atomic<int64_t> hits_;
+        std::atomic<int64_t> misses_;
+        std::atomic<int64_t> coalesced_;
+        std::atomic<int64_t> lookups_;
+        std::atomic<int64_t> failures_;
+    };
+}
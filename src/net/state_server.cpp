@@ -31,6 +31,14 @@ namespace net
                 query.assign(req.uri.data() + 1, req.uri.size() - 1);
             }
 
+            auto file = page_files_.find(query);
+            if (file != page_files_.end() && req.uri != "/")
+            {
+                resp.headers_["Content-Type"] = "text/plain; charset=utf-8";
+                con.SendFile(file->second);
+                return;
+            }
+
             if (query.size()) 
             {
                 auto p = all_callbacks_.find(query); 
@@ -111,6 +119,8 @@ namespace net
     
     void StatServer::OnPageFile(const std::string &page, const std::string &desc, const std::string &file) 
     {
+        // 直接访问页面时用sendfile发送，首页的子查询仍读入内容嵌入页面
+        page_files_[page] = file;
         return OnRequest(PAGE, page, desc, [file](const HttpRequest &req, HttpResponse &resp) 
         {
             util::Status st = util::File::GetContent(file, resp.body_);
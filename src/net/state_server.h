@@ -59,6 +59,7 @@ namespace net
         using DescState = std::pair<std::string, StatCallBack>;
         std::map<std::string, DescState> stat_callbacks_, page_callbacks_, cmd_callbacks_;
         std::map<std::string, StatCallBack> all_callbacks_;
+        std::map<std::string, std::string> page_files_;     // 页面对应的文件
     };
 
 }
\ No newline at end of file
@@ -0,0 +1,354 @@
+#include "timer.h"
+
+#include <algorithm>
+#include <climits>
+
+namespace net
+{
+/////////////////////////////////////////////////////// MapTimer
+    TimerId MapTimer::RunAt(int64_t milli, Task &&task, int64_t interval)
+    {
+        if (interval)
+        {
+            TimerId tid{-milli, ++timer_seq_};
+            TimerRepeatable &rtr = timer_reps_[tid];
+            rtr = {milli, interval, {milli, ++timer_seq_}, std::move(task)};
+            TimerRepeatable *tr = &rtr;
+            timers_[tr->timerid] = [this, tr] { RepeatableTimeout(tr); };
+            return tid;
+        }
+        else
+        {
+            TimerId tid{milli, ++timer_seq_};
+            timers_.insert({tid, std::move(task)});
+            return tid;
+        }
+    }
+
+    bool MapTimer::Cancel(TimerId timerid)
+    {
+        if (timerid.first < 0)
+        {
+            auto it = timer_reps_.find(timerid);
+            if (it == timer_reps_.end())
+                return false;
+
+            auto ptimer = timers_.find(it->second.timerid);
+            if (ptimer != timers_.end())
+                timers_.erase(ptimer);
+
+            timer_reps_.erase(it);
+            return true;
+        }
+        else
+        {
+            auto p = timers_.find(timerid);
+            if (p != timers_.end())
+            {
+                timers_.erase(p);
+                return true;
+            }
+            return false;
+        }
+    }
+
+    void MapTimer::HandleTimeouts(int64_t now)
+    {
+        TimerId tid{now, 1L << 62};
+        while (timers_.size() && timers_.begin()->first < tid)
+        {
+            Task task = std::move(timers_.begin()->second);
+            timers_.erase(timers_.begin());
+            task();
+        }
+    }
+
+    int MapTimer::NextTimeout(int64_t now)
+    {
+        if (timers_.empty())
+            return 1 << 30;
+
+        int64_t timeout = timers_.begin()->first.first - now;
+        return timeout < 0 ? 0 : static_cast<int>(std::min<int64_t>(timeout, 1 << 30));
+    }
+
+    void MapTimer::Clear()
+    {
+        timer_reps_.clear();
+        timers_.clear();
+    }
+
+    void MapTimer::RepeatableTimeout(TimerRepeatable *tr)
+    {
+        tr->at += tr->interval;
+        tr->timerid = {tr->at, ++timer_seq_};
+        timers_[tr->timerid] = [this, tr] { RepeatableTimeout(tr); };
+        tr->cb();
+    }
+
+
+
+/////////////////////////////////////////////////////// WheelTimer
+    WheelTimer::WheelTimer(int64_t now)
+        : current_(now), size_(0), upper_size_(0)
+    {
+        for (auto &head : root_)
+            InitList(&head);
+        for (auto &level : levels_)
+        {
+            for (auto &head : level)
+                InitList(&head);
+        }
+        std::fill(root_bits_, root_bits_ + kRootSize / 64, 0);
+    }
+
+    WheelTimer::~WheelTimer()
+    {
+        Clear();
+    }
+
+    TimerId WheelTimer::RunAt(int64_t milli, Task &&task, int64_t interval)
+    {
+        Node *node;
+        if (free_nodes_.size())
+        {
+            node = &nodes_[free_nodes_.back()];
+            free_nodes_.pop_back();
+        }
+        else
+        {
+            nodes_.emplace_back();
+            node = &nodes_.back();
+            node->index_ = static_cast<uint32_t>(nodes_.size() - 1);
+            // 代数从1开始，默认构造的TimerId{0, 0}不会对应任何节点
+            node->gen_ = 1;
+        }
+        node->at_ = milli;
+        node->interval_ = interval;
+        node->task_ = std::move(task);
+        AddNode(node);
+        size_++;
+
+        int64_t seq = static_cast<int64_t>((uint64_t(node->gen_) << 32) | node->index_);
+        return TimerId{interval ? -milli : milli, seq};
+    }
+
+    bool WheelTimer::Cancel(TimerId timerid)
+    {
+        uint64_t seq = static_cast<uint64_t>(timerid.second);
+        uint32_t index = static_cast<uint32_t>(seq & 0xffffffff);
+        uint32_t gen = static_cast<uint32_t>(seq >> 32);
+        if (index >= nodes_.size())
+            return false;
+
+        Node *node = &nodes_[index];
+        if (node->gen_ != gen || !node->linked_)
+            return false;
+
+        Detach(node);
+        FreeNode(node);
+        return true;
+    }
+
+    void WheelTimer::HandleTimeouts(int64_t now)
+    {
+        if (size_ == 0)
+        {
+            current_ = std::max(current_, now + 1);
+            return;
+        }
+
+        while (current_ <= now)
+        {
+            int idx = static_cast<int>(current_ & (kRootSize - 1));
+            if (idx == 0)
+            {
+                for (int level = 0; level < kLevels; level++)
+                {
+                    if (Cascade(level, (current_ >> (kRootBits + level * kLevelBits)) & (kLevelSize - 1)))
+                        break;
+                }
+            }
+
+            // 当前槽为空时直接跳到下一个非空槽或下一次转动上层的位置
+            if (root_[idx].next_ == &root_[idx])
+            {
+                int64_t step = kRootSize - idx;
+                int off = FindRoot(idx);
+                if (off > 0 && off < step)
+                    step = off;
+                current_ += std::min(step, now - current_ + 1);
+                continue;
+            }
+
+            Node batch;
+            InitList(&batch);
+            batch.next_ = root_[idx].next_;
+            batch.prev_ = root_[idx].prev_;
+            batch.next_->prev_ = &batch;
+            batch.prev_->next_ = &batch;
+            InitList(&root_[idx]);
+            ClearBit(idx);
+            current_++;
+
+            // 回调中可能取消batch中的其他任务，因此每次都从头部取
+            while (batch.next_ != &batch)
+            {
+                Node *node = batch.next_;
+                Detach(node);
+                if (node->interval_)
+                {
+                    node->at_ += node->interval_;
+                    AddNode(node);
+                    uint32_t index = node->index_;
+                    uint32_t gen = node->gen_;
+                    Task task = std::move(node->task_);
+                    task();
+                    // 回调中可能取消了自身
+                    Node &n = nodes_[index];
+                    if (n.gen_ == gen && n.linked_)
+                        n.task_ = std::move(task);
+                }
+                else
+                {
+                    Task task = std::move(node->task_);
+                    FreeNode(node);
+                    task();
+                }
+            }
+        }
+    }
+
+    int WheelTimer::NextTimeout(int64_t now)
+    {
+        if (size_ == 0)
+            return 1 << 30;
+
+        int idx = static_cast<int>(current_ & (kRootSize - 1));
+        int64_t at = INT64_MAX;
+        int off = FindRoot(idx);
+        if (off >= 0)
+            at = current_ + off;
+        // idx为0时上层还未转动，任务可能就在当前槽
+        if (upper_size_)
+            at = std::min(at, current_ + ((kRootSize - idx) & (kRootSize - 1)));
+
+        if (at <= now)
+            return 0;
+        return static_cast<int>(std::min<int64_t>(at - now, 1 << 30));
+    }
+
+    void WheelTimer::Clear()
+    {
+        for (auto &node : nodes_)
+        {
+            if (node.linked_)
+            {
+                Detach(&node);
+                FreeNode(&node);
+            }
+        }
+        std::fill(root_bits_, root_bits_ + kRootSize / 64, 0);
+    }
+
+    void WheelTimer::AddNode(Node *node)
+    {
+        int64_t expire = std::max(node->at_, current_);
+        uint64_t delta = expire - current_;
+        if (delta < kRootSize)
+        {
+            int idx = static_cast<int>(expire & (kRootSize - 1));
+            PushBack(&root_[idx], node);
+            SetBit(idx);
+            node->level_ = 0;
+        }
+        else
+        {
+            if (delta > 0xffffffffULL)
+                expire = current_ + 0xffffffffLL;
+
+            int level = 0;
+            while (level < kLevels - 1 && delta >= (uint64_t(1) << (kRootBits + (level + 1) * kLevelBits)))
+                level++;
+            int idx = static_cast<int>((expire >> (kRootBits + level * kLevelBits)) & (kLevelSize - 1));
+            PushBack(&levels_[level][idx], node);
+            node->level_ = static_cast<uint8_t>(level + 1);
+            upper_size_++;
+        }
+        node->linked_ = true;
+    }
+
+    void WheelTimer::Detach(Node *node)
+    {
+        node->prev_->next_ = node->next_;
+        node->next_->prev_ = node->prev_;
+        node->prev_ = node->next_ = nullptr;
+        node->linked_ = false;
+        if (node->level_)
+            upper_size_--;
+        node->level_ = 0;
+    }
+
+    void WheelTimer::FreeNode(Node *node)
+    {
+        node->task_ = nullptr;
+        if (++node->gen_ == 0)
+            node->gen_ = 1;
+        size_--;
+        free_nodes_.push_back(node->index_);
+    }
+
+    int WheelTimer::Cascade(int level, int idx)
+    {
+        Node *head = &levels_[level][idx];
+        while (head->next_ != head)
+        {
+            Node *node = head->next_;
+            Detach(node);
+            AddNode(node);
+        }
+        return idx;
+    }
+
+    void WheelTimer::PushBack(Node *head, Node *node)
+    {
+        node->prev_ = head->prev_;
+        node->next_ = head;
+        head->prev_->next_ = node;
+        head->prev_ = node;
+    }
+
+    int WheelTimer::FindRoot(int from)
+    {
+        const int words = kRootSize / 64;
+        for (int i = 0; i <= words; i++)
+        {
+            int w = ((from >> 6) + i) % words;
+            uint64_t mask = root_bits_[w];
+            if (i == 0)
+                mask &= ~uint64_t(0) << (from & 63);
+            else if (i == words)
+                mask &= (uint64_t(1) << (from & 63)) - 1;
+
+            while (mask)
+            {
+                int idx = w * 64 + __builtin_ctzll(mask);
+                if (root_[idx].next_ != &root_[idx])
+                    return (idx - from) & (kRootSize - 1);
+
+                ClearBit(idx);
+                mask &= mask - 1;
+            }
+        }
+        return -1;
+    }
+
+
+
+    TimerBase *CreateTimer(TimerMode mode)
+    {
+        if (mode == TimerMode::MODE_MAP)
+            return new MapTimer;
+        return new WheelTimer(util::TimeMilli());
+    }
+}
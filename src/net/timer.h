@@ -0,0 +1,113 @@
+#pragma once
+
+#include "noncopyable.h"
+#include "event_base.h"
+
+#include <cstdint>
+#include <deque>
+#include <map>
+#include <vector>
+
+namespace net
+{
+    // 定时器存储引擎, 由EventsImp持有, 只在事件循环线程中使用
+    class TimerBase : private util::NonCopyable
+    {
+    public:
+        virtual ~TimerBase() {}
+        //添加定时任务，interval=0表示一次性任务，否则为重复任务，时间为毫秒
+        virtual TimerId RunAt(int64_t milli, Task &&task, int64_t interval) = 0;
+        //取消定时任务，若timer已经过期，则忽略
+        virtual bool Cancel(TimerId timerid) = 0;
+        //执行所有在now(含)之前到期的任务
+        virtual void HandleTimeouts(int64_t now) = 0;
+        //距离最近一个任务到期的毫秒数，没有任务时返回1 << 30
+        virtual int NextTimeout(int64_t now) = 0;
+        virtual size_t Size() = 0;
+        virtual void Clear() = 0;
+    };
+
+
+    // 基于std::map的定时器，插入、取消均为O(logn)
+    class MapTimer : public TimerBase
+    {
+    public:
+        MapTimer() : timer_seq_(0) {}
+
+        TimerId RunAt(int64_t milli, Task &&task, int64_t interval) override;
+        bool Cancel(TimerId timerid) override;
+        void HandleTimeouts(int64_t now) override;
+        int NextTimeout(int64_t now) override;
+        size_t Size() override { return timers_.size(); }
+        void Clear() override;
+    private:
+        void RepeatableTimeout(TimerRepeatable *tr);
+    private:
+        std::map<TimerId, TimerRepeatable> timer_reps_;
+        std::map<TimerId, Task> timers_;
+        int64_t timer_seq_;
+    };
+
+
+    /**
+     * @brief 分层时间轮，精度1毫秒。插入、取消均为O(1)，到期任务按槽批量执行
+     *  第0层256个槽，第1~4层各64个槽，共可表示2^32毫秒(约49天)，更远的任务放在最高层的最后一个槽，
+     *  转动时会重新分层。
+     *  TimerId.first为到期时间(重复任务为负数)，TimerId.second高32位为节点代数，低32位为节点下标，
+     *  节点释放后代数加1，因此过期的TimerId无法取消新任务。代数不为0，默认的TimerId不对应任何任务
+     */
+    class WheelTimer : public TimerBase
+    {
+    public:
+        WheelTimer(int64_t now);
+        ~WheelTimer();
+
+        TimerId RunAt(int64_t milli, Task &&task, int64_t interval) override;
+        bool Cancel(TimerId timerid) override;
+        void HandleTimeouts(int64_t now) override;
+        int NextTimeout(int64_t now) override;
+        size_t Size() override { return size_; }
+        void Clear() override;
+    private:
+        static const int kRootBits = 8;
+        static const int kLevelBits = 6;
+        static const int kRootSize = 1 << kRootBits;
+        static const int kLevelSize = 1 << kLevelBits;
+        static const int kLevels = 4;
+
+        struct Node
+        {
+            Node *prev_;
+            Node *next_;
+            int64_t at_;
+            int64_t interval_;
+            uint32_t gen_;
+            uint32_t index_;
+            uint8_t level_;                     // 0为第0层，否则为上层编号
+            bool linked_;
+            Task task_;
+        };
+
+        void AddNode(Node *node);
+        void FreeNode(Node *node);
+        int Cascade(int level, int idx);
+        static void InitList(Node *head) { head->prev_ = head->next_ = head; }
+        void Detach(Node *node);
+        static void PushBack(Node *head, Node *node);
+        void SetBit(int idx) { root_bits_[idx >> 6] |= uint64_t(1) << (idx & 63); }
+        void ClearBit(int idx) { root_bits_[idx >> 6] &= ~(uint64_t(1) << (idx & 63)); }
+        int FindRoot(int from);
+    private:
+        int64_t current_;                       // 下一个待处理的毫秒
+        size_t size_;
+        size_t upper_size_;                     // 位于上层的任务数
+        Node root_[kRootSize];                  // 各槽为带哨兵的双向循环链表
+        Node levels_[kLevels][kLevelSize];
+        uint64_t root_bits_[kRootSize / 64];    // 第0层非空槽位图，用于快速求最近的到期时间
+        std::deque<Node> nodes_;                // 节点池，deque保证扩容时地址不变
+        std::vector<uint32_t> free_nodes_;
+    };
+
+
+    TimerBase *CreateTimer(TimerMode mode);
+}
@@ -2,8 +2,10 @@
 #include "log.h"
 #include "net.h"
 #include "poller.h"
+#include "resolver.h"
 
 #include <fcntl.h>
+#include <arpa/inet.h>
 #include <unistd.h>
 
 namespace net 
@@ -27,31 +29,37 @@ namespace net
         SetNonBlock(fd);
         LOG_FMT_VERBOSE_MSG("udp fd %d bind to %s", fd, addr_.ToString().c_str());
         channel_ = new Channel(base_, fd, kReadEvent);
-        channel_->OnRead([this] 
+        channel_->SetHandler(this);
+        return 0;
+    }
+
+
+
+    void UdpServer::OnReadable()
+    {
+        // 读到EAGAIN为止，边沿触发时不会再次通知已到达的数据报
+        while (channel_ && channel_->Fd() >= 0) 
         {
             Buffer buf;
             struct sockaddr_in raddr;
             socklen_t rsz = sizeof(raddr);
-            if (!channel_ || channel_->Fd() < 0) 
-            {
-                return;
-            }
             int fd = channel_->Fd();
             ssize_t rn = recvfrom(fd, buf.MakeRoom(kUdpPacketSize), kUdpPacketSize, 0, (sockaddr *) &raddr, &rsz);
+            if (rn < 0 && errno == EINTR) 
+                continue;
             if (rn < 0) 
             {
-                LOG_FMT_ERROR_MSG("udp %d recv failed: %d %s", fd, errno, strerror(errno));
+                if (errno != EAGAIN && errno != EWOULDBLOCK)
+                    LOG_FMT_ERROR_MSG("udp %d recv failed: %d %s", fd, errno, strerror(errno));
                 return;
             }
             buf.AddSize(rn);
             LOG_FMT_VERBOSE_MSG("udp %d recv %ld bytes from %s", fd, rn, Addr(raddr).ToString().data());
             this->msg_callback_(shared_from_this(), buf, raddr);
-        });
-        return 0;
+        }
     }
 
 
-
     UdpServerPtr UdpServer::StartServer(EventBases *bases, const std::string &host, unsigned short port, bool reusePort) 
     {
         UdpServerPtr udp(new UdpServer(bases));
@@ -89,7 +97,24 @@ namespace net
 ////////////////////////////////////////////////////////////////////// UdpConn
     UdpConnPtr UdpConn::CreateConnection(EventBase *base, const std::string &host, unsigned short port) 
     {
-        Addr addr(host, port);
+        std::vector<struct in_addr> addrs;
+        Addr addr(port);
+        if (Resolver::Default().Lookup(host, &addrs) && addrs.size())
+        {
+            addr.GetAddr().sin_addr = addrs[0];
+        }
+        else if (base->IsInLoopThread())
+        {
+            // 不在事件循环线程中同步解析。开始异步解析，稍后重试时可命中缓存
+            LOG_FMT_WARNING_MSG("udp host %s is neither numeric nor cached, use the resolving CreateConnection", 
+                host.c_str());
+            Resolver::Default().Resolve(base, host, [](const std::vector<struct in_addr> &) {});
+            return NULL;
+        }
+        else
+        {
+            addr = Addr(host, port);
+        }
         int fd = socket(AF_INET, SOCK_DGRAM, 0);
         
         SetNonBlock(fd);
@@ -109,25 +134,54 @@ namespace net
         con->base_ = base;
         Channel *ch = new Channel(base, fd, kReadEvent);
         con->channel_ = ch;
-        ch->OnRead([con] 
-        {
-            if (!con->channel_ || con->channel_->Fd() < 0) 
-                return con->Close();
+        con->self_ = con;
+        ch->SetHandler(con.get());
+        return con;
+    }
+
+    void UdpConn::CreateConnection(EventBase *base, const std::string &host, unsigned short port, 
+        const std::function<void(const UdpConnPtr &)> &cb)
+    {
+        Resolver::Default().Resolve(base, host, [base, host, port, cb](const std::vector<struct in_addr> &addrs) {
+            if (addrs.empty())
+            {
+                LOG_FMT_ERROR_MSG("udp resolve %s failed", host.c_str());
+                cb(NULL);
+                return;
+            }
+            char ip[INET_ADDRSTRLEN];
+            inet_ntop(AF_INET, &addrs[0], ip, sizeof(ip));
+            cb(CreateConnection(base, ip, port));
+        });
+    }
 
+
+    void UdpConn::OnReadable()
+    {
+        if (!channel_ || channel_->Fd() < 0) 
+            return Close();
+
+        // 回调中可能Close释放self_，持有引用直到处理完毕
+        UdpConnPtr con = self_;
+        // 读到EAGAIN为止，边沿触发时不会再次通知已到达的数据报
+        while (channel_ && channel_->Fd() >= 0) 
+        {
             Buffer input;
-            int fd = con->channel_->Fd();
+            int fd = channel_->Fd();
             int rn = ::read(fd, input.MakeRoom(kUdpPacketSize), kUdpPacketSize);
+            if (rn < 0 && errno == EINTR) 
+                continue;
             if (rn < 0) 
             {
-                LOG_FMT_ERROR_MSG("udp read from %d error %d %s", fd, errno, strerror(errno));
+                if (errno != EAGAIN && errno != EWOULDBLOCK)
+                    LOG_FMT_ERROR_MSG("udp read from %d error %d %s", fd, errno, strerror(errno));
                 return;
             }
 
             LOG_FMT_VERBOSE_MSG("udp %d read %d bytes", fd, rn);
             input.AddSize(rn);
-            con->cb_(con, input);
-        });
-        return con;
+            cb_(con, input);
+        }
     }
 
 
@@ -155,7 +209,8 @@ namespace net
             return;
         auto p = channel_;
         channel_ = NULL;
-        base_->SafeCall([p]() { delete p; });
+        // 删除通道时会回调OnReadable，先删除通道再释放自身
+        base_->QueueInLoop([p, self = std::move(self_)]() { delete p; });
     }
 
 
@@ -23,7 +23,7 @@ namespace net
 
 
     const int kUdpPacketSize = 4096;
-    class UdpServer : public std::enable_shared_from_this<UdpServer>, private util::NonCopyable 
+    class UdpServer : public std::enable_shared_from_this<UdpServer>, private util::NonCopyable, private ChannelHandler
     {
     public:
         UdpServer(EventBases *bases)
@@ -57,17 +57,25 @@ namespace net
         Addr addr_;
         Channel *channel_;
         UdpSvrCallBack msg_callback_;
+
+        void OnReadable() override;
+        void OnWritable() override {}
     };
 
 
     // Udp连接，使用引用计数
-    class UdpConn : public std::enable_shared_from_this<UdpConn>, private util::NonCopyable  
+    class UdpConn : public std::enable_shared_from_this<UdpConn>, private util::NonCopyable, private ChannelHandler
     {
     public:
         // Udp构造函数，实际可用的连接应当通过createConnection创建
         UdpConn(){};
         virtual ~UdpConn() { Close(); };
+        //host为域名且未命中Resolver::Default()的缓存时，在base的事件循环线程中调用不阻塞，开始异步解析并返回NULL；
+        //其他线程中同步解析。事件循环线程中的域名应使用下面的重载
         static UdpConnPtr CreateConnection(EventBase *base, const std::string &host, unsigned short port);
+        //异步解析host后创建连接，在base的事件循环中回调cb，失败时参数为NULL
+        static void CreateConnection(EventBase *base, const std::string &host, unsigned short port, 
+            const std::function<void(const UdpConnPtr &)> &cb);
         // automatically managed context. allocated when first used, deleted when destruct
         template <class T>
         T &Context() 
@@ -101,6 +109,10 @@ namespace net
         std::string destHost_;
         int destPort_;
         UdpCallBack cb_;
+        UdpConnPtr self_;       // 通道存在期间持有自身，Close时释放
+
+        void OnReadable() override;
+        void OnWritable() override {}
     };
 
 
@@ -0,0 +1,512 @@
+#include "uring_poller.h"
+#include "log.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+namespace net
+{
+    UringPoller::UringPoller(bool completion)
+        : completion_(completion), fd_(-1), sq_ptr_(MAP_FAILED), cq_ptr_(MAP_FAILED),
+        sq_size_(0), cq_size_(0), sqes_size_(0), sq_local_tail_(0), sqes_(NULL),
+        buf_ring_(NULL), buf_ring_size_(0), buf_base_(NULL), buf_tail_(0), recv_multishot_(true) {}
+
+    UringPoller::~UringPoller()
+    {
+        LOG_FMT_VERBOSE_MSG("Destroying io_uring %d\n", fd_);
+        while (channels_.size())
+            channels_.begin()->first->Close();
+
+        // 关闭前等待已取消的操作结束，避免内核在释放后继续写入provided buffer
+        for (int i = 0; i < 100 && closing_.size() && fd_ >= 0; i++)
+            LoopOnce(10);
+        if (buf_ring_)
+        {
+            struct io_uring_buf_reg reg;
+            memset(&reg, 0, sizeof(reg));
+            reg.bgid = kUringBufGroup;
+            syscall(__NR_io_uring_register, fd_, IORING_UNREGISTER_PBUF_RING, &reg, 1);
+            munmap(buf_ring_, buf_ring_size_);
+        }
+        if (fd_ >= 0)
+            ::close(fd_);
+        if (sqes_)
+            munmap(sqes_, sqes_size_);
+        if (cq_ptr_ != MAP_FAILED && cq_ptr_ != sq_ptr_)
+            munmap(cq_ptr_, cq_size_);
+        if (sq_ptr_ != MAP_FAILED)
+            munmap(sq_ptr_, sq_size_);
+        delete [] buf_base_;
+        for (auto e : closing_)
+            delete e;
+        LOG_FMT_VERBOSE_MSG("destroyed io_uring %d\n", fd_);
+    }
+
+    bool UringPoller::Init()
+    {
+        struct io_uring_params params;
+        memset(&params, 0, sizeof(params));
+        params.flags = IORING_SETUP_CLAMP | IORING_SETUP_CQSIZE;
+        params.cq_entries = kUringEntries * 4;
+        fd_ = syscall(__NR_io_uring_setup, kUringEntries, &params);
+        if (fd_ < 0)
+        {
+            LOG_FMT_WARNING_MSG("io_uring_setup failed %d %s", errno, strerror(errno));
+            return false;
+        }
+        if (!(params.features & IORING_FEAT_EXT_ARG) || !(params.features & IORING_FEAT_NODROP))
+        {
+            LOG_FMT_WARNING_MSG("io_uring features %x not supported", params.features);
+            return false;
+        }
+
+        sq_size_ = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+        cq_size_ = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+        if (params.features & IORING_FEAT_SINGLE_MMAP)
+            sq_size_ = cq_size_ = std::max(sq_size_, cq_size_);
+
+        sq_ptr_ = mmap(NULL, sq_size_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd_, IORING_OFF_SQ_RING);
+        if (sq_ptr_ == MAP_FAILED)
+            return false;
+        if (params.features & IORING_FEAT_SINGLE_MMAP)
+            cq_ptr_ = sq_ptr_;
+        else
+        {
+            cq_ptr_ = mmap(NULL, cq_size_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd_, IORING_OFF_CQ_RING);
+            if (cq_ptr_ == MAP_FAILED)
+                return false;
+        }
+        sqes_size_ = params.sq_entries * sizeof(struct io_uring_sqe);
+        void *sqes = mmap(NULL, sqes_size_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd_, IORING_OFF_SQES);
+        if (sqes == MAP_FAILED)
+            return false;
+        sqes_ = static_cast<struct io_uring_sqe *>(sqes);
+
+        char *sq = static_cast<char *>(sq_ptr_);
+        sq_head_ = reinterpret_cast<unsigned *>(sq + params.sq_off.head);
+        sq_tail_ = reinterpret_cast<unsigned *>(sq + params.sq_off.tail);
+        sq_mask_ = reinterpret_cast<unsigned *>(sq + params.sq_off.ring_mask);
+        sq_array_ = reinterpret_cast<unsigned *>(sq + params.sq_off.array);
+        sq_entries_ = params.sq_entries;
+        sq_local_tail_ = *sq_tail_;
+
+        char *cq = static_cast<char *>(cq_ptr_);
+        cq_head_ = reinterpret_cast<unsigned *>(cq + params.cq_off.head);
+        cq_tail_ = reinterpret_cast<unsigned *>(cq + params.cq_off.tail);
+        cq_mask_ = reinterpret_cast<unsigned *>(cq + params.cq_off.ring_mask);
+        cqes_ = reinterpret_cast<struct io_uring_cqe *>(cq + params.cq_off.cqes);
+
+        if (completion_ && !SetupBufferRing())
+        {
+            LOG_FMT_WARNING_MSG("io_uring provided buffer ring unsupported %d %s, completion mode disabled",
+                errno, strerror(errno));
+            completion_ = false;
+        }
+        LOG_FMT_VERBOSE_MSG("io_uring %d created completion %d\n", fd_, completion_);
+        return true;
+    }
+
+    bool UringPoller::SetupBufferRing()
+    {
+        buf_ring_size_ = kUringBufCount * sizeof(struct io_uring_buf);
+        void *ring = mmap(NULL, buf_ring_size_, PROT_READ | PROT_WRITE, MAP_ANONYMOUS | MAP_PRIVATE, -1, 0);
+        if (ring == MAP_FAILED)
+            return false;
+
+        struct io_uring_buf_reg reg;
+        memset(&reg, 0, sizeof(reg));
+        reg.ring_addr = reinterpret_cast<uint64_t>(ring);
+        reg.ring_entries = kUringBufCount;
+        reg.bgid = kUringBufGroup;
+        if (syscall(__NR_io_uring_register, fd_, IORING_REGISTER_PBUF_RING, &reg, 1) < 0)
+        {
+            munmap(ring, buf_ring_size_);
+            return false;
+        }
+        buf_ring_ = static_cast<struct io_uring_buf_ring *>(ring);
+        buf_base_ = new char[kUringBufCount * kUringBufSize];
+        for (unsigned i = 0; i < kUringBufCount; i++)
+            RecycleBuffer(static_cast<unsigned short>(i));
+        return true;
+    }
+
+    void UringPoller::AddChannel(Channel *ch)
+    {
+        Entry *e = new Entry();
+        e->ch_ = ch;
+        e->fd_ = ch->Fd();
+        e->events_ = ch->Events();
+        channels_[ch] = e;
+        LOG_FMT_VERBOSE_MSG("adding channel %lld Fd %d events %d io_uring %d", (long long) ch->Id(), ch->Fd(),
+            ch->Events(), fd_);
+        ArmPoll(e);
+    }
+
+    void UringPoller::UpdateChannel(Channel *ch)
+    {
+        auto p = channels_.find(ch);
+        if (p == channels_.end())
+            return;
+
+        Entry *e = p->second;
+        bool read_on = !(e->events_ & kReadEvent) && (ch->Events() & kReadEvent);
+        bool read_off = (e->events_ & kReadEvent) && !(ch->Events() & kReadEvent);
+        e->events_ = ch->Events();
+        if (e->receiving_)
+        {
+            // recv会持续占用provided buffer，暂停读时取消
+            if (read_off && e->recvs_)
+                CancelOp(e, OP_RECV);
+            else if (read_on && !e->recvs_)
+                ArmRecv(e);
+        }
+        else if (read_on)
+        {
+            // 与边沿触发相同，读重新开启时重新注册poll以获取当前的可读状态
+            if (e->polls_)
+                CancelOp(e, OP_POLL);
+            ArmPoll(e);
+        }
+    }
+
+    void UringPoller::RemoveChannel(Channel *ch)
+    {
+        auto p = channels_.find(ch);
+        if (p == channels_.end())
+            return;
+
+        Entry *e = p->second;
+        channels_.erase(p);
+        LOG_FMT_VERBOSE_MSG("deleting channel %lld Fd %d io_uring %d", (long long) ch->Id(), ch->Fd(), fd_);
+        e->ch_ = NULL;
+        if (e->polls_)
+            CancelOp(e, OP_POLL);
+        if (e->recvs_)
+            CancelOp(e, OP_RECV);
+        if (e->sending_)
+            CancelOp(e, OP_SEND);
+        if (e->inflight_)
+            closing_.insert(e);
+        else
+            delete e;
+    }
+
+    void UringPoller::StartRecv(Channel *ch)
+    {
+        auto p = channels_.find(ch);
+        if (!completion_ || !recv_multishot_ || p == channels_.end() || p->second->receiving_)
+            return;
+
+        Entry *e = p->second;
+        e->receiving_ = true;
+        if (e->polls_)
+            CancelOp(e, OP_POLL);
+        if (ch->ReadEnabled())
+            ArmRecv(e);
+    }
+
+    bool UringPoller::SubmitSend(Channel *ch, const char *buf, size_t len)
+    {
+        auto p = channels_.find(ch);
+        if (!completion_ || p == channels_.end())
+            return false;
+        if (len == 0)
+            return true;
+
+        Entry *e = p->second;
+        e->send_queue_.emplace_back(buf, len);
+        e->queued_ += len;
+        ch->SetSendQueued(e->queued_);
+        if (!e->sending_)
+            ArmSend(e, false);
+        return true;
+    }
+
+    void UringPoller::LoopOnce(int wait_ms)
+    {
+        int64_t ticks = util::CoarseMilli();
+        unsigned ready = __atomic_load_n(cq_tail_, __ATOMIC_ACQUIRE) - *cq_head_;
+        int r = Enter(ready || wait_ms == 0 ? 0 : 1, wait_ms);
+        if (r < 0 && errno != ETIME && errno != EINTR && errno != EBUSY)
+            LOG_FMT_ERROR_MSG("io_uring_enter failed %d %s", errno, strerror(errno));
+        Polled();
+        int64_t used = util::CoarseMilli() - ticks;
+
+        unsigned head = *cq_head_;
+        unsigned tail = __atomic_load_n(cq_tail_, __ATOMIC_ACQUIRE);
+        active_ = static_cast<int>(tail - head);
+        LOG_FMT_VERBOSE_MSG("io_uring wait %d return %u used %lld millsecond", wait_ms, tail - head,
+            (long long) used);
+        while (head != tail)
+        {
+            struct io_uring_cqe *cqe = &cqes_[head & *cq_mask_];
+            uint64_t data = cqe->user_data;
+            int res = cqe->res;
+            unsigned flags = cqe->flags;
+            __atomic_store_n(cq_head_, ++head, __ATOMIC_RELEASE);
+
+            Entry *e = reinterpret_cast<Entry *>(data & ~uint64_t(7));
+            switch (static_cast<Op>(data & 7))
+            {
+            case OP_POLL:
+                HandlePoll(e, res, flags);
+                break;
+            case OP_RECV:
+                HandleRecv(e, res, flags);
+                break;
+            case OP_SEND:
+                HandleSend(e, res);
+                break;
+            default:
+                Finish(e);
+                break;
+            }
+        }
+    }
+
+    struct io_uring_sqe *UringPoller::GetSqe(Entry *e, Op op)
+    {
+        if (sq_local_tail_ - __atomic_load_n(sq_head_, __ATOMIC_ACQUIRE) >= sq_entries_)
+            Enter(0, 0);
+
+        unsigned idx = sq_local_tail_ & *sq_mask_;
+        struct io_uring_sqe *sqe = &sqes_[idx];
+        memset(sqe, 0, sizeof(*sqe));
+        sqe->user_data = reinterpret_cast<uint64_t>(e) | op;
+        sq_array_[idx] = idx;
+        sq_local_tail_++;
+        e->inflight_++;
+        return sqe;
+    }
+
+    void UringPoller::ArmPoll(Entry *e)
+    {
+        struct io_uring_sqe *sqe = GetSqe(e, OP_POLL);
+        sqe->opcode = IORING_OP_POLL_ADD;
+        sqe->fd = e->fd_;
+        sqe->len = IORING_POLL_ADD_MULTI;
+        sqe->poll32_events = POLLIN | POLLOUT;
+        e->polls_++;
+    }
+
+    void UringPoller::ArmRecv(Entry *e)
+    {
+        struct io_uring_sqe *sqe = GetSqe(e, OP_RECV);
+        sqe->opcode = IORING_OP_RECV;
+        sqe->fd = e->fd_;
+        sqe->ioprio = IORING_RECV_MULTISHOT;
+        sqe->flags = IOSQE_BUFFER_SELECT;
+        sqe->buf_group = kUringBufGroup;
+        e->recvs_++;
+    }
+
+    void UringPoller::ArmSend(Entry *e, bool wait_writable)
+    {
+        // 同一连接同时只有一个send在内核中，保证数据顺序，期间排队的数据以iovec一次发送，不再合并复制
+        if (wait_writable)
+        {
+            struct io_uring_sqe *sqe = GetSqe(e, OP_OTHER);
+            sqe->opcode = IORING_OP_POLL_ADD;
+            sqe->fd = e->fd_;
+            sqe->poll32_events = POLLOUT;
+            sqe->flags = IOSQE_IO_LINK;
+        }
+        e->iov_.clear();
+        size_t offset = e->offset_;
+        for (auto &data : e->send_queue_)
+        {
+            if (e->iov_.size() == kUringSendIov)
+                break;
+            struct iovec iov;
+            iov.iov_base = const_cast<char *>(data.data() + offset);
+            iov.iov_len = data.size() - offset;
+            e->iov_.push_back(iov);
+            offset = 0;
+        }
+        memset(&e->msg_, 0, sizeof(e->msg_));
+        e->msg_.msg_iov = e->iov_.data();
+        e->msg_.msg_iovlen = e->iov_.size();
+        struct io_uring_sqe *sqe = GetSqe(e, OP_SEND);
+        sqe->opcode = IORING_OP_SENDMSG;
+        sqe->fd = e->fd_;
+        sqe->addr = reinterpret_cast<uint64_t>(&e->msg_);
+        sqe->len = 1;
+        sqe->msg_flags = MSG_NOSIGNAL;
+        e->sending_ = true;
+    }
+
+    void UringPoller::CancelOp(Entry *e, Op op)
+    {
+        struct io_uring_sqe *sqe = GetSqe(e, OP_OTHER);
+        sqe->opcode = IORING_OP_ASYNC_CANCEL;
+        sqe->fd = -1;
+        sqe->addr = reinterpret_cast<uint64_t>(e) | op;
+    }
+
+    void UringPoller::HandlePoll(Entry *e, int res, unsigned flags)
+    {
+        Channel *ch = e->ch_;
+        if (res > 0 && ch && !e->receiving_)
+        {
+            // 与边沿触发的epoll相同，读写需要在同一轮中都处理
+            if (res & POLLERR)
+            {
+                LOG_FMT_VERBOSE_MSG("channel %lld Fd %d handle error", (long long) ch->Id(), ch->Fd());
+                ch->HandleError();
+            }
+            else if ((res & POLLHUP) || ((res & kReadEvent) && ch->ReadEnabled()))
+            {
+                LOG_FMT_VERBOSE_MSG("channel %lld Fd %d handle read", (long long) ch->Id(), ch->Fd());
+                ch->HandleRead();
+            }
+            ch = e->ch_;
+            if (ch && !e->receiving_ && (res & kWriteEvent) && ch->WriteEnabled())
+            {
+                LOG_FMT_VERBOSE_MSG("channel %lld Fd %d handle write", (long long) ch->Id(), ch->Fd());
+                ch->HandleWrite();
+            }
+        }
+        if (!(flags & IORING_CQE_F_MORE))
+        {
+            e->polls_--;
+            // multishot被内核终止(如完成队列溢出)时重新注册
+            if (e->ch_ && !e->receiving_ && !e->polls_ && res >= 0)
+                ArmPoll(e);
+            else if (res < 0 && res != -ECANCELED)
+                LOG_FMT_ERROR_MSG("io_uring poll fd %d failed %d %s", e->fd_, -res, strerror(-res));
+            Finish(e);
+        }
+    }
+
+    void UringPoller::HandleRecv(Entry *e, int res, unsigned flags)
+    {
+        if (flags & IORING_CQE_F_BUFFER)
+        {
+            unsigned short bid = static_cast<unsigned short>(flags >> IORING_CQE_BUFFER_SHIFT);
+            if (res > 0 && e->ch_)
+                e->ch_->HandleRecv(buf_base_ + bid * kUringBufSize, res);
+            RecycleBuffer(bid);
+        }
+        if (flags & IORING_CQE_F_MORE)
+            return;
+
+        e->recvs_--;
+        if (e->ch_ && res == -EINVAL && recv_multishot_)
+        {
+            // 内核不支持multishot recv，读回退为就绪模式，发送仍走io_uring
+            LOG_WARNING_MSG("io_uring multishot recv unsupported, fallback to poll");
+            recv_multishot_ = false;
+        }
+        if (e->ch_ && !recv_multishot_)
+        {
+            e->receiving_ = false;
+            ArmPoll(e);
+        }
+        else if (e->ch_ && !e->recvs_)
+        {
+            if (res > 0 || res == -ENOBUFS || res == -ECANCELED)
+            {
+                if (e->ch_->ReadEnabled())
+                    ArmRecv(e);
+            }
+            else
+            {
+                // 0为对端关闭，小于0为出错
+                e->ch_->HandleRecv(NULL, res);
+            }
+        }
+        Finish(e);
+    }
+
+    void UringPoller::HandleSend(Entry *e, int res)
+    {
+        e->sending_ = false;
+        if (e->ch_)
+        {
+            if (res > 0)
+            {
+                // 发送的数据可能跨越多个排队的段
+                size_t left = res;
+                e->queued_ -= left;
+                while (left)
+                {
+                    size_t n = std::min(left, e->send_queue_.front().size() - e->offset_);
+                    e->offset_ += n;
+                    left -= n;
+                    if (e->offset_ == e->send_queue_.front().size())
+                    {
+                        e->send_queue_.pop_front();
+                        e->offset_ = 0;
+                    }
+                }
+            }
+            else if (res < 0 && res != -EAGAIN && res != -ECANCELED)
+            {
+                // 连接已出错，由读一侧负责清理
+                LOG_FMT_ERROR_MSG("io_uring send fd %d failed %d %s", e->fd_, -res, strerror(-res));
+                e->send_queue_.clear();
+                e->offset_ = 0;
+                e->queued_ = 0;
+            }
+            e->ch_->SetSendQueued(e->queued_);
+
+            if (e->send_queue_.size())
+                ArmSend(e, res == -EAGAIN);
+            // 关注可写的连接在每次发送完成时回调，用于检查水位及发送完毕的通知
+            if (res > 0 && e->ch_ && e->ch_->WriteEnabled())
+                e->ch_->HandleWrite();
+        }
+        Finish(e);
+    }
+
+    void UringPoller::Finish(Entry *e)
+    {
+        if (--e->inflight_ == 0 && !e->ch_)
+        {
+            closing_.erase(e);
+            delete e;
+        }
+    }
+
+    void UringPoller::RecycleBuffer(unsigned short bid)
+    {
+        // tail与第0个buffer的resv重叠，只写addr/len/bid。
+        // C++下头文件中的柔性数组bufs前有一个空结构体会占用空间，偏移与内核不一致，因此直接按下标计算地址
+        struct io_uring_buf *buf = reinterpret_cast<struct io_uring_buf *>(buf_ring_) + (buf_tail_ & (kUringBufCount - 1));
+        buf->addr = reinterpret_cast<uint64_t>(buf_base_ + bid * kUringBufSize);
+        buf->len = kUringBufSize;
+        buf->bid = bid;
+        buf_tail_++;
+        __atomic_store_n(&buf_ring_->tail, buf_tail_, __ATOMIC_RELEASE);
+    }
+
+    int UringPoller::Enter(unsigned min_complete, int wait_ms)
+    {
+        __atomic_store_n(sq_tail_, sq_local_tail_, __ATOMIC_RELEASE);
+        unsigned to_submit = sq_local_tail_ - __atomic_load_n(sq_head_, __ATOMIC_ACQUIRE);
+        if (!to_submit && !min_complete)
+            return 0;
+
+        struct __kernel_timespec ts;
+        struct io_uring_getevents_arg arg;
+        memset(&arg, 0, sizeof(arg));
+        unsigned flags = IORING_ENTER_EXT_ARG;
+        if (min_complete)
+        {
+            flags |= IORING_ENTER_GETEVENTS;
+            if (wait_ms >= 0)
+            {
+                ts.tv_sec = wait_ms / 1000;
+                ts.tv_nsec = (wait_ms % 1000) * 1000000LL;
+                arg.ts = reinterpret_cast<uint64_t>(&ts);
+            }
+        }
+        return syscall(__NR_io_uring_enter, fd_, to_submit, min_complete, flags, &arg, sizeof(arg));
+    }
+}
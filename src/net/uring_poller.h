@@ -0,0 +1,115 @@
+#pragma once
+
+#include "poller.h"
+#include "channel.h"
+
+#include <linux/io_uring.h>
+#include <deque>
+#include <sys/socket.h>
+#include <string>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+namespace net
+{
+    const unsigned kUringEntries = 4096;    // 提交队列大小
+    const unsigned kUringBufCount = 1024;   // provided buffer数量，必须为2的幂
+    const unsigned kUringBufSize = 4096;    // 每个provided buffer的大小
+    const unsigned short kUringBufGroup = 0;
+    const int kUringSendIov = 64;           // 每次sendmsg最多发送的数据段数
+
+    /**
+     * @brief io_uring实现的poller，不依赖liburing，直接使用系统调用
+     *  就绪模式: 每个通道一个multishot poll，与边沿触发的epoll语义相同，读写事件只注册一次
+     *  完成模式: 在就绪模式的基础上，TcpConn连接建立后调用StartRecv改为multishot recv，
+     *   数据由内核读入整个poller共享的provided buffer ring，再通过Channel::HandleRecv回调，
+     *   空闲连接不占用读缓冲区; SubmitSend复制数据后只放入提交队列，在下一次io_uring_enter时批量提交。
+     *   每个连接同时只有一个sendmsg在内核中，期间提交的数据排队，完成后以iovec一次发送，
+     *   排队的字节数通过Channel::SendQueued计入连接的待发送数据
+     */
+    class UringPoller : public PollerBase
+    {
+    public:
+        UringPoller(bool completion);
+        ~UringPoller();
+
+        //内核不支持或被禁止时返回false，由CreatePoller回退到epoll
+        bool Init();
+
+        void AddChannel(Channel *ch) override;
+        void RemoveChannel(Channel *ch) override;
+        void UpdateChannel(Channel *ch) override;
+        void LoopOnce(int waitMs) override;
+        // multishot poll只在有新数据时报告
+        bool EdgeTriggered() override { return true; }
+        bool Completion() override { return completion_; }
+        void StartRecv(Channel *ch) override;
+        bool SubmitSend(Channel *ch, const char *buf, size_t len) override;
+    private:
+        enum Op
+        {
+            OP_POLL = 0,
+            OP_RECV,
+            OP_SEND,
+            OP_OTHER,       // 取消、发送前的等待可写等，完成时只需计数
+        };
+
+        // 每个通道的状态。通道移除后ch_为NULL，等待已提交的操作全部结束后才释放
+        struct Entry
+        {
+            Channel *ch_;
+            int fd_;
+            short events_;          // 上一次的事件标记
+            bool receiving_;        // 已切换为multishot recv
+            bool sending_;
+            int polls_;             // 未结束的poll数
+            int recvs_;             // 未结束的recv数
+            int inflight_;          // 未结束的操作总数
+            size_t offset_;         // 队首数据已发送的字节数
+            size_t queued_;         // send_queue_中尚未发送的字节数
+            std::deque<std::string> send_queue_;
+            std::vector<struct iovec> iov_;     // 正在发送的sendmsg引用的数据，send完成前保持不变
+            struct msghdr msg_;
+        };
+
+        struct io_uring_sqe *GetSqe(Entry *e, Op op);
+        void ArmPoll(Entry *e);
+        void ArmRecv(Entry *e);
+        void ArmSend(Entry *e, bool wait_writable);
+        void CancelOp(Entry *e, Op op);
+        void HandlePoll(Entry *e, int res, unsigned flags);
+        void HandleRecv(Entry *e, int res, unsigned flags);
+        void HandleSend(Entry *e, int res);
+        void Finish(Entry *e);
+        void RecycleBuffer(unsigned short bid);
+        int Enter(unsigned min_complete, int waitMs);
+        bool SetupBufferRing();
+    private:
+        bool completion_;
+        int fd_;
+        void *sq_ptr_;
+        void *cq_ptr_;
+        size_t sq_size_;
+        size_t cq_size_;
+        size_t sqes_size_;
+        unsigned *sq_head_;
+        unsigned *sq_tail_;
+        unsigned *sq_mask_;
+        unsigned *sq_array_;
+        unsigned sq_entries_;
+        unsigned sq_local_tail_;        // 已填充但尚未发布给内核的sqe
+        struct io_uring_sqe *sqes_;
+        unsigned *cq_head_;
+        unsigned *cq_tail_;
+        unsigned *cq_mask_;
+        struct io_uring_cqe *cqes_;
+        struct io_uring_buf_ring *buf_ring_;
+        size_t buf_ring_size_;
+        char *buf_base_;
+        unsigned short buf_tail_;
+        bool recv_multishot_;           // 内核是否支持multishot recv
+        std::unordered_map<Channel*, Entry*> channels_;
+        std::unordered_set<Entry*> closing_;   // 已移除但仍有未结束操作的通道
+    };
+}
@@ -6,6 +6,7 @@
 #include <string>
 #include <functional>
 #include <chrono>
+#include <time.h>
 
 namespace util
 {
@@ -21,6 +22,22 @@ namespace util
 
 
     static int64_t TimeMilli() { return TimeMicro() / 1000; }
+
+    // 粗粒度单调时钟，精度为一个时钟节拍(1~4毫秒)，开销远小于精确时钟，只用于计算时间间隔
+    static inline int64_t CoarseMilli()
+    {
+        struct timespec ts;
+        clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+        return ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+    }
+
+    // 粗粒度墙上时间，与TimeMilli同一基准，精度同CoarseMilli
+    static inline int64_t CoarseTimeMilli()
+    {
+        struct timespec ts;
+        clock_gettime(CLOCK_REALTIME_COARSE, &ts);
+        return ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+    }
     int AddFdFlag(int fd, int flag);
     
 